@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <endian.h>
+#include "bitwise.h"
+#include "block-codec.h"
+
+/*
+  Count or encode the stream of a job, read with its load function
+  into the buffer of worker if it has no bytes
+*/
+static void encode_job(struct block_codec* codec,
+                       struct block_job* job,
+                       int worker) {
+  uint8_t* in = job->in;
+  if (in == NULL) {
+    if (codec->buffers[worker] == NULL) {
+      codec->buffers[worker] = (uint8_t*)malloc(MULTI_BLOCK_LEN);
+    }
+    in = codec->buffers[worker];
+    if (job->load(job, in) < 0) {
+      job->failed = 1;
+      return;
+    }
+  }
+
+  if (job->out == NULL) {
+    job->bits = compress_bits(job->dict, in, job->len);
+    return;
+  }
+  struct compress_stream stream;
+  compress_stream_init(&stream);
+  job->out_len =
+      compress_stream_update(job->dict, &stream, in, job->len, job->out);
+  job->bits = job->out_len * 8 + stream.acc_len;
+  job->out_len += compress_stream_finish(&stream, &job->out[job->out_len]);
+}
+
+/*
+  Run a job on a thread of the codec, and wake its waiters
+*/
+static void run_job(void* task, int worker) {
+  struct block_job* job = (struct block_job*)task;
+  if (job->tree != NULL) {
+    job->failed = decompress_streams(job->tree, job->src, job->offsets,
+                                     job->payload_len, job->first,
+                                     job->streams, job->out) < 0;
+  } else {
+    encode_job(job->codec, job, worker);
+  }
+
+  struct block_batch* batch = job->batch;
+  pthread_mutex_lock(&batch->lock);
+  job->done = 1;
+  batch->left--;
+  pthread_cond_broadcast(&batch->done);
+  pthread_mutex_unlock(&batch->lock);
+}
+
+struct block_codec* block_codec_init(int threads) {
+  struct block_codec* codec =
+      (struct block_codec*)calloc(1, sizeof(struct block_codec));
+  codec->threads = threads;
+  codec->buffers = (uint8_t**)calloc(threads, sizeof(uint8_t*));
+  codec->pool = work_pool_init(threads, run_job);
+  if (codec->pool == NULL) {
+    free(codec->buffers);
+    free(codec);
+    return NULL;
+  }
+  return codec;
+}
+
+void block_batch_init(struct block_batch* batch) {
+  pthread_mutex_init(&batch->lock, NULL);
+  pthread_cond_init(&batch->done, NULL);
+  batch->left = 0;
+}
+
+void block_codec_submit(struct block_codec* codec,
+                        struct block_job* job,
+                        struct block_batch* batch) {
+  job->codec = codec;
+  job->batch = batch;
+  job->failed = 0;
+  job->done = 0;
+  pthread_mutex_lock(&batch->lock);
+  batch->left++;
+  pthread_mutex_unlock(&batch->lock);
+  work_pool_submit(codec->pool, job, -1);
+}
+
+void block_job_wait(struct block_job* job) {
+  struct block_batch* batch = job->batch;
+  pthread_mutex_lock(&batch->lock);
+  while (!job->done) {
+    pthread_cond_wait(&batch->done, &batch->lock);
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+void block_batch_wait(struct block_batch* batch) {
+  pthread_mutex_lock(&batch->lock);
+  while (batch->left > 0) {
+    pthread_cond_wait(&batch->done, &batch->lock);
+  }
+  pthread_mutex_unlock(&batch->lock);
+}
+
+int block_codec_run(struct block_codec* codec,
+                    struct block_job* jobs,
+                    uint64_t n) {
+  struct block_batch batch;
+  block_batch_init(&batch);
+  for (uint64_t i = 0; i < n; i++) {
+    block_codec_submit(codec, &jobs[i], &batch);
+  }
+  block_batch_wait(&batch);
+  block_batch_destory(&batch);
+
+  for (uint64_t i = 0; i < n; i++) {
+    if (jobs[i].failed) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int block_compress_multi(struct block_codec* codec,
+                         struct dict* dict,
+                         uint8_t** buffer_send,
+                         uint8_t** buffer_recv,
+                         int payload_len) {
+  if (payload_len < BLOCK_PARALLEL_MIN) {
+    return compress_multi(dict, buffer_send, buffer_recv, payload_len);
+  }
+  uint8_t* in = &(*buffer_recv)[9];
+
+  uint64_t streams = multi_stream_count(payload_len);
+  uint64_t* bounds = (uint64_t*)malloc((streams + 1) * sizeof(uint64_t));
+  multi_stream_bounds(payload_len, bounds);
+  struct block_job* jobs =
+      (struct block_job*)calloc(streams, sizeof(struct block_job));
+  for (uint64_t i = 0; i < streams; i++) {
+    jobs[i].dict = dict;
+    jobs[i].in = &in[bounds[i]];
+    jobs[i].len = bounds[i + 1] - bounds[i];
+    jobs[i].start = bounds[i];
+  }
+  block_codec_run(codec, jobs, streams);
+
+  // the stream lengths are known, every stream is encoded in its place
+  uint64_t* stream_lens = (uint64_t*)malloc(streams * sizeof(uint64_t));
+  uint64_t send_pl_len = multi_table_len(payload_len);
+  for (uint64_t i = 0; i < streams; i++) {
+    stream_lens[i] = (jobs[i].bits + 7) / 8 + 1;
+    send_pl_len += stream_lens[i];
+  }
+  if (malloc_usable_size(*buffer_send) < send_pl_len + 9) {
+    *buffer_send = realloc(*buffer_send, sizeof(uint8_t) * (send_pl_len + 9));
+  }
+  uint8_t* out = &(*buffer_send)[9];
+  compress_multi_table(out, payload_len, stream_lens);
+  out += multi_table_len(payload_len);
+  for (uint64_t i = 0; i < streams; i++) {
+    jobs[i].out = out;
+    out += stream_lens[i];
+  }
+  block_codec_run(codec, jobs, streams);
+  free(jobs);
+  free(stream_lens);
+  free(bounds);
+
+  /*modify header*/
+  (*buffer_send)[0] = 0x00;
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);  // type
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);  // compreesed
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 1, 1);  // multi stream
+
+  uint64_t pl_len_in64 = htobe64(send_pl_len);
+  memcpy(&(*buffer_send)[1], &pl_len_in64, sizeof(uint64_t));
+
+  return send_pl_len;
+}
+
+int block_decompress_multi(struct block_codec* codec,
+                           struct decode_tree* tree,
+                           uint8_t** dest,
+                           uint8_t** src,
+                           int src_pl_len) {
+  if (src_pl_len < BLOCK_PARALLEL_MIN) {
+    return decompress_multi(tree, dest, src, src_pl_len);
+  }
+  uint8_t* in = &(*src)[9];
+  uint64_t* offsets;
+  int64_t payload_len = multi_table_read(tree, in, src_pl_len, &offsets);
+  if (payload_len < 0) {
+    return -1;
+  }
+  if (malloc_usable_size(*dest) < (uint64_t)payload_len + 9) {
+    *dest = realloc(*dest, sizeof(uint8_t) * (payload_len + 9));
+  }
+
+  // streams decoded in lockstep are faster, if no thread is left idle
+  uint64_t streams = multi_stream_count(payload_len);
+  uint64_t per_job = 1;
+  if (streams >= (uint64_t)MULTI_STREAMS * codec->threads) {
+    per_job = MULTI_STREAMS;
+  }
+  uint64_t n = (streams + per_job - 1) / per_job;
+  struct block_job* jobs =
+      (struct block_job*)calloc(n, sizeof(struct block_job));
+  for (uint64_t i = 0; i < n; i++) {
+    jobs[i].tree = tree;
+    jobs[i].src = in;
+    jobs[i].offsets = offsets;
+    jobs[i].payload_len = payload_len;
+    jobs[i].first = i * per_job;
+    jobs[i].streams =
+        streams - jobs[i].first < per_job ? streams - jobs[i].first : per_job;
+    jobs[i].out = &(*dest)[9];
+  }
+  int res = block_codec_run(codec, jobs, n);
+  free(jobs);
+  free(offsets);
+  if (res < 0) {
+    return -1;
+  }
+
+  (*dest)[0] = modify_bit((*dest)[0], 3, 0);
+  return payload_len;
+}
+
+void block_batch_destory(struct block_batch* batch) {
+  pthread_cond_destroy(&batch->done);
+  pthread_mutex_destroy(&batch->lock);
+}
+
+void block_codec_destory(struct block_codec* codec) {
+  work_pool_destory(codec->pool);
+  for (int i = 0; i < codec->threads; i++) {
+    free(codec->buffers[i]);
+  }
+  free(codec->buffers);
+  free(codec);
+}
@@ -0,0 +1,148 @@
+#ifndef BLOCK_CODEC_H /* guard */
+#define BLOCK_CODEC_H
+
+/*
+  Block codec.
+  Encodes and decodes the streams of the multi stream format
+  on a pool of threads.
+  The streams of a payload are independent, each is counted or encoded
+  by a job of its own with the shared dict, which is only read.
+  Compressing a payload counts the bits of every stream first, so the
+  jump table and the offset of every stream in the output are known,
+  then every stream is encoded straight into its place.
+
+  A job either points at the bytes of its stream, or reads them with
+  its load function into a buffer of the thread running it, so a stream
+  of a file is read by that thread too.
+
+  Decompressing a payload reads the jump table, then every thread
+  decodes streams of its own straight into their place of the output.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "compression.h"
+#include "work-pool.h"
+
+#define BLOCK_PARALLEL_MIN (1 << 18)  // shorter payloads are not split
+
+/*jobs waited for together*/
+struct block_batch {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  uint64_t left;  // jobs submitted and not done
+};
+
+/*
+  one stream of a payload, counted or encoded by a thread,
+  or streams of a multi stream payload decoded by a thread
+*/
+struct block_job {
+  struct dict* dict;
+  uint8_t* in;   // bytes of the stream, NULL to read them with load
+  uint64_t len;  // bytes of the stream, at most MULTI_BLOCK_LEN
+  uint64_t start;  // first payload byte of the stream
+
+  /*
+    read the len bytes of the stream into buffer,
+    return 0, or -1 if they can not be read
+  */
+  int (*load)(struct block_job* job, uint8_t* buffer);
+  void* arg;  // of load
+
+  uint8_t* out;      // encoded stream with its padding byte, NULL to count
+  uint64_t bits;     // bits of the codes, set once counted or encoded
+  uint64_t out_len;  // bytes written to out, set once encoded
+  /* decoding only, if tree is not NULL */
+  struct decode_tree* tree;
+  uint8_t* src;       // the multi stream payload, decoded into out
+  uint64_t* offsets;  // of its streams, from multi_table_read()
+  uint64_t payload_len;
+  uint64_t first;    // first stream decoded
+  uint64_t streams;  // streams decoded
+
+  int failed;  // load failed, or the streams are malformed
+  int done;
+  struct block_batch* batch;
+  struct block_codec* codec;  // running the job
+};
+
+/*the threads encoding blocks*/
+struct block_codec {
+  int threads;
+  struct work_pool* pool;
+  uint8_t** buffers;  // MULTI_BLOCK_LEN bytes per thread, for load
+};
+
+/*
+  initilize a codec of threads threads
+*/
+struct block_codec* block_codec_init(int threads);
+
+/*
+  initilize a batch with no job
+*/
+void block_batch_init(struct block_batch* batch);
+
+/*
+  Submit a job of batch, counted if its out is NULL, encoded if not
+*/
+void block_codec_submit(struct block_codec* codec,
+                        struct block_job* job,
+                        struct block_batch* batch);
+
+/*
+  Wait until a job submitted is done
+*/
+void block_job_wait(struct block_job* job);
+
+/*
+  Wait until all jobs submitted with batch are done
+*/
+void block_batch_wait(struct block_batch* batch);
+
+/*
+  Submit n jobs and wait until they are done
+  return 0, or -1 if a job failed
+*/
+int block_codec_run(struct block_codec* codec,
+                    struct block_job* jobs,
+                    uint64_t n);
+
+/*
+  same as compress_multi(), but the streams are counted and encoded by
+  the threads of codec. a payload shorter than BLOCK_PARALLEL_MIN is
+  compressed by the caller
+*/
+int block_compress_multi(struct block_codec* codec,
+                         struct dict* dict,
+                         uint8_t** buffer_send,
+                         uint8_t** buffer_recv,
+                         int payload_len);
+
+/*
+  same as decompress_multi(), but the streams are decoded by the threads
+  of codec, MULTI_STREAMS per job once there are enough of them for
+  every thread. a payload shorter than BLOCK_PARALLEL_MIN is decoded
+  by the caller
+*/
+int block_decompress_multi(struct block_codec* codec,
+                           struct decode_tree* tree,
+                           uint8_t** dest,
+                           uint8_t** src,
+                           int src_pl_len);
+
+/*
+  free the memory usage of a batch, no job may be left
+*/
+void block_batch_destory(struct block_batch* batch);
+
+/*
+  Stop the threads once the jobs submitted are done,
+  and free all memory usage of the codec
+*/
+void block_codec_destory(struct block_codec* codec);
+
+#endif //BLOCK_CODEC_H
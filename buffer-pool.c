@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include "buffer-pool.h"
+
+/* heap allocations of all pools, updated atomically */
+static uint64_t heap_allocs = 0;
+
+static void count_heap_alloc() {
+  __atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+  Get a buffer of at least size bytes, reusing a kept one if possible
+*/
+uint8_t* pool_get(struct buffer_pool* pool, uint64_t size) {
+  if (size == 0) {
+    size = 1;
+  }
+
+  // smallest kept buffer large enough, otherwise the largest one
+  int best = -1;
+  uint64_t best_capacity = 0;
+  for (int i = 0; i < pool->count; i++) {
+    uint64_t capacity = malloc_usable_size(pool->buffers[i]);
+    int fits = capacity >= size;
+    int best_fits = best >= 0 && best_capacity >= size;
+    if (best < 0 || (fits && (!best_fits || capacity < best_capacity)) ||
+        (!fits && !best_fits && capacity > best_capacity)) {
+      best = i;
+      best_capacity = capacity;
+    }
+  }
+
+  if (best < 0) {
+    count_heap_alloc();
+    return (uint8_t*)malloc(size);
+  }
+
+  uint8_t* buffer = pool->buffers[best];
+  pool->buffers[best] = pool->buffers[--pool->count];
+  pool_reserve(&buffer, size);
+  return buffer;
+}
+
+/*
+  Grow buffer to at least size bytes, keeping its content,
+  nothing is allocated if it is already large enough
+*/
+void pool_reserve(uint8_t** buffer, uint64_t size) {
+  if (*buffer != NULL && malloc_usable_size(*buffer) >= size) {
+    return;
+  }
+  count_heap_alloc();
+  *buffer = (uint8_t*)realloc(*buffer, size);
+}
+
+/*
+  Give a buffer back to the pool, NULL is ignored
+*/
+void pool_put(struct buffer_pool* pool, uint8_t* buffer) {
+  if (buffer == NULL) {
+    return;
+  }
+  if (pool->count == POOL_BUFFERS_N ||
+      malloc_usable_size(buffer) > POOL_RETAIN_MAX) {
+    free(buffer);
+    return;
+  }
+  pool->buffers[pool->count++] = buffer;
+}
+
+/*
+  Free all buffers kept by the pool
+*/
+void pool_destory(struct buffer_pool* pool) {
+  for (int i = 0; i < pool->count; i++) {
+    free(pool->buffers[i]);
+  }
+  pool->count = 0;
+}
+
+/*
+  Number of heap allocations made by all pools since start
+*/
+uint64_t pool_heap_allocs() {
+  return __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,53 @@
+#ifndef BUFFER_POOL_H /* guard */
+#define BUFFER_POOL_H
+
+/*
+  Buffer pool.
+  Every connection owns a pool, buffers given back to it are kept
+  and handed out again by the next request, only growing when a
+  request needs more. Steady state request processing therefore
+  does not touch the heap.
+
+  A global counter records every heap allocation made by all pools.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define POOL_BUFFERS_N (4)          // buffers kept by a pool
+#define POOL_RETAIN_MAX (1 << 20)   // larger buffers are freed when put
+
+/*buffers kept by a connection between requests*/
+struct buffer_pool {
+  uint8_t* buffers[POOL_BUFFERS_N];
+  int count;
+};
+
+/*
+  Get a buffer of at least size bytes, reusing a kept one if possible
+*/
+uint8_t* pool_get(struct buffer_pool* pool, uint64_t size);
+
+/*
+  Grow buffer to at least size bytes, keeping its content,
+  nothing is allocated if it is already large enough
+*/
+void pool_reserve(uint8_t** buffer, uint64_t size);
+
+/*
+  Give a buffer back to the pool, NULL is ignored
+*/
+void pool_put(struct buffer_pool* pool, uint8_t* buffer);
+
+/*
+  Free all buffers kept by the pool
+*/
+void pool_destory(struct buffer_pool* pool);
+
+/*
+  Number of heap allocations made by all pools since start
+*/
+uint64_t pool_heap_allocs();
+
+#endif //BUFFER_POOL_H
@@ -0,0 +1,438 @@
+/*
+    Codec benchmark for the C socket server!!
+
+    Time the hot loops of compression.c on generated corpora:
+    compress(), decompress() and the reference decompress_tree(),
+    the multi stream compress_multi() and decompress_multi(),
+    block_compress_multi() and block_decompress_multi() on a block codec
+    of -j threads, the exact compress_len() and the sampled
+    compress_estimate(),
+    and the startup cost of generate_dict() and generate_decode_tree().
+    Every corpus is decoded back and compared before it is timed.
+
+    Build:
+        gcc -O2 -pthread -o codec-benchmark codec-benchmark.c compression.c \
+            bitwise.c block-codec.c work-pool.c
+    Run:
+        ./codec-benchmark [-d dict] [-n corpus bytes] [-t seconds]
+                          [-j threads]
+
+    Results are printed as CSV, one line per benchmark and corpus.
+    Rates are of uncompressed bytes, a symbol is one uncompressed byte.
+    cycles_per_byte is counted with the time stamp counter on x86,
+    and is 0 elsewhere.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "block-codec.h"
+#include "compression.h"
+
+#define DICT_PATH ("compression.dict")  // the path of dictionary
+#define CORPUS_LEN (1 << 20)            // default bytes of a corpus
+#define MIN_SECONDS (0.5)               // default time of a benchmark
+#define STARTUP_RUNS (200)              // runs of each startup benchmark
+
+/*a generated input, and its encoding*/
+struct corpus {
+  const char* name;
+  uint8_t* buffer;       // 9 bytes header and the payload
+  uint64_t len;          // payload length
+  uint8_t* compressed;   // 9 bytes header and the encoded payload
+  uint64_t comp_len;     // encoded payload length
+  uint8_t* multi;        // 9 bytes header and the multi stream payload
+  uint64_t multi_len;    // multi stream payload length
+};
+
+/*the threads of block_compress_multi, one per CPU or option -j*/
+struct block_codec* blocks;
+
+/*time and cycles taken by a benchmark*/
+struct sample {
+  uint64_t iterations;
+  double seconds;
+  uint64_t cycles;
+};
+
+/*
+ * Return the time of a monotonic clock in seconds
+ */
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return the time stamp counter, or 0 if there is none
+ */
+uint64_t now_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/*
+ * xorshift64*, deterministic so corpora are the same every run
+ */
+uint64_t next_random(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+/*
+ * English like text: words of a small vocabulary, spaces,
+ * punctuation and line breaks
+ */
+void fill_text(uint8_t* out, uint64_t len, uint64_t* rng) {
+  static const char* words[] = {
+      "the",    "of",     "and",   "to",       "in",     "is",
+      "that",   "for",    "it",    "as",       "with",   "was",
+      "on",     "be",     "by",    "this",     "server", "socket",
+      "file",   "buffer", "thread", "request", "payload", "length",
+      "session", "directory", "compression", "dictionary", "listing",
+      "retrieve", "connection", "response"};
+  uint64_t n = sizeof(words) / sizeof(words[0]);
+  uint64_t i = 0;
+  while (i < len) {
+    const char* word = words[next_random(rng) % n];
+    for (const char* c = word; *c != '\0' && i < len; c++) {
+      out[i++] = *c;
+    }
+    if (i < len) {
+      uint64_t r = next_random(rng) % 16;
+      out[i++] = r == 0 ? '.' : r == 1 ? ',' : r == 2 ? '\n' : ' ';
+    }
+  }
+}
+
+/*
+ * Binary records: small little endian integers, flags and zero padding,
+ * like the structures of an executable or a database page
+ */
+void fill_binary(uint8_t* out, uint64_t len, uint64_t* rng) {
+  for (uint64_t i = 0; i < len; i += 16) {
+    uint8_t record[16] = {0};
+    uint32_t id = (uint32_t)(i / 16);
+    uint32_t value = (uint32_t)(next_random(rng) % 1000);
+    memcpy(&record[0], &id, 4);
+    memcpy(&record[4], &value, 4);
+    record[8] = (uint8_t)(next_random(rng) % 4);
+    record[12] = 0xff;
+    uint64_t n = len - i < 16 ? len - i : 16;
+    memcpy(&out[i], record, n);
+  }
+}
+
+/*
+ * Uniformly random bytes
+ */
+void fill_random(uint8_t* out, uint64_t len, uint64_t* rng) {
+  for (uint64_t i = 0; i < len; i++) {
+    out[i] = (uint8_t)next_random(rng);
+  }
+}
+
+/*
+ * block_compress_multi() on blocks, with the signature of compress()
+ */
+int block_compress(struct dict* dict,
+                   uint8_t** buffer_send,
+                   uint8_t** buffer_recv,
+                   int payload_len) {
+  return block_compress_multi(blocks, dict, buffer_send, buffer_recv,
+                              payload_len);
+}
+
+/*
+ * compress_len(), with the signature of compress()
+ */
+int length(struct dict* dict,
+           uint8_t** buffer_send,
+           uint8_t** buffer_recv,
+           int payload_len) {
+  return compress_len(dict, &(*buffer_recv)[9], payload_len);
+}
+
+/*
+ * compress_estimate(), with the signature of compress()
+ */
+int estimate(struct dict* dict,
+             uint8_t** buffer_send,
+             uint8_t** buffer_recv,
+             int payload_len) {
+  return compress_estimate(dict, &(*buffer_recv)[9], payload_len);
+}
+
+/*
+ * block_decompress_multi() on blocks, with the signature of decompress()
+ */
+int block_decompress(struct decode_tree* tree,
+                     uint8_t** dest,
+                     uint8_t** src,
+                     int src_pl_len) {
+  return block_decompress_multi(blocks, tree, dest, src, src_pl_len);
+}
+
+/*
+ * Encode the payload of a corpus into its compressed buffer,
+ * and check it decodes back to the same bytes
+ * return 0 if it does, -1 otherwise
+ */
+int prepare_corpus(struct corpus* corpus,
+                   struct dict* dict,
+                   struct decode_tree* tree) {
+  corpus->compressed = (uint8_t*)malloc(
+      compress_len(dict, &corpus->buffer[9], corpus->len) + 9);
+  corpus->comp_len =
+      compress(dict, &corpus->compressed, &corpus->buffer, corpus->len);
+
+  corpus->multi = (uint8_t*)malloc(
+      corpus->comp_len + multi_table_len(corpus->len) +
+      2 * multi_stream_count(corpus->len) + 9);
+  corpus->multi_len =
+      compress_multi(dict, &corpus->multi, &corpus->buffer, corpus->len);
+
+  uint8_t* decoded =
+      (uint8_t*)malloc(decompress_bound(tree, corpus->comp_len) + 9);
+  uint64_t len =
+      decompress(tree, &decoded, &corpus->compressed, corpus->comp_len);
+  int res = (len == corpus->len &&
+             memcmp(&decoded[9], &corpus->buffer[9], len) == 0)
+                ? 0
+                : -1;
+  int multi_len =
+      decompress_multi(tree, &decoded, &corpus->multi, corpus->multi_len);
+  if (multi_len != (int)corpus->len ||
+      memcmp(&decoded[9], &corpus->buffer[9], corpus->len) != 0) {
+    res = -1;
+  }
+  memset(&decoded[9], 0, corpus->len);
+  multi_len = block_decompress(tree, &decoded, &corpus->multi,
+                               corpus->multi_len);
+  if (multi_len != (int)corpus->len ||
+      memcmp(&decoded[9], &corpus->buffer[9], corpus->len) != 0) {
+    res = -1;
+  }
+  free(decoded);
+
+  // the block codec must write the same bytes as compress_multi
+  uint8_t* block = (uint8_t*)malloc(corpus->multi_len + 9);
+  int block_len = block_compress(dict, &block, &corpus->buffer, corpus->len);
+  if (block_len != (int)corpus->multi_len ||
+      memcmp(block, corpus->multi, corpus->multi_len + 9) != 0) {
+    res = -1;
+  }
+  free(block);
+  return res;
+}
+
+/*
+ * Run an encoder on a corpus for at least min_seconds
+ */
+struct sample bench_compress(struct corpus* corpus,
+                             struct dict* dict,
+                             int (*encoder)(struct dict*,
+                                            uint8_t**,
+                                            uint8_t**,
+                                            int),
+                             double min_seconds) {
+  struct sample sample = {0};
+  uint8_t* out = (uint8_t*)malloc(corpus->multi_len + 9);
+
+  double start = now_seconds();
+  uint64_t cycles = now_cycles();
+  do {
+    encoder(dict, &out, &corpus->buffer, corpus->len);
+    sample.iterations++;
+    sample.seconds = now_seconds() - start;
+  } while (sample.seconds < min_seconds);
+  sample.cycles = now_cycles() - cycles;
+
+  free(out);
+  return sample;
+}
+
+/*
+ * Run a decoder on an encoded corpus for at least min_seconds
+ */
+struct sample bench_decompress(struct corpus* corpus,
+                               uint8_t* encoded,
+                               uint64_t encoded_len,
+                               struct decode_tree* tree,
+                               int (*decoder)(struct decode_tree*,
+                                              uint8_t**,
+                                              uint8_t**,
+                                              int),
+                               double min_seconds) {
+  struct sample sample = {0};
+  uint8_t* out =
+      (uint8_t*)malloc(decompress_bound(tree, corpus->comp_len) + 9);
+
+  double start = now_seconds();
+  uint64_t cycles = now_cycles();
+  do {
+    decoder(tree, &out, &encoded, encoded_len);
+    sample.iterations++;
+    sample.seconds = now_seconds() - start;
+  } while (sample.seconds < min_seconds);
+  sample.cycles = now_cycles() - cycles;
+
+  free(out);
+  return sample;
+}
+
+/*
+ * Print one CSV line of a codec benchmark
+ */
+void report(const char* benchmark, struct corpus* corpus, struct sample s) {
+  double bytes = (double)corpus->len * s.iterations;
+  printf("%s,%s,%llu,%llu,%llu,%.6f,%.2f,%.0f,%.3f,%.3f\n", benchmark,
+         corpus->name, (unsigned long long)corpus->len,
+         (unsigned long long)corpus->comp_len,
+         (unsigned long long)s.iterations, s.seconds,
+         bytes / s.seconds / 1e6, bytes / s.seconds,
+         (double)s.cycles / bytes, s.seconds / s.iterations * 1e6);
+}
+
+/*
+ * Print one CSV line of a startup benchmark, rates do not apply
+ */
+void report_startup(const char* benchmark, struct sample s) {
+  printf("%s,-,0,0,%llu,%.6f,0,0,0,%.3f\n", benchmark,
+         (unsigned long long)s.iterations, s.seconds,
+         s.seconds / s.iterations * 1e6);
+}
+
+int main(int argc, char** argv) {
+  char* dict_path = DICT_PATH;
+  uint64_t corpus_len = CORPUS_LEN;
+  double min_seconds = MIN_SECONDS;
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:t:j:")) != -1) {
+    switch (opt) {
+      case 'd':
+        dict_path = optarg;
+        break;
+      case 'n':
+        corpus_len = strtoull(optarg, NULL, 10);
+        break;
+      case 't':
+        min_seconds = atof(optarg);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      default:
+        puts("Usage: codec-benchmark [-d dict] [-n corpus bytes] "
+             "[-t seconds] [-j threads]");
+        exit(1);
+    }
+  }
+  if (corpus_len == 0 || threads < 1 || access(dict_path, R_OK) != 0) {
+    puts("Invalid input");
+    exit(1);
+  }
+  blocks = block_codec_init(threads);
+
+  printf("benchmark,corpus,bytes,compressed_bytes,iterations,seconds,"
+         "mb_per_s,symbols_per_s,cycles_per_byte,us_per_iteration\n");
+
+  // startup, the dict is read from its file every time
+  struct sample s = {0};
+  uint64_t cycles = now_cycles();
+  double start = now_seconds();
+  for (int i = 0; i < STARTUP_RUNS; i++) {
+    free(generate_dict(dict_path));
+  }
+  s.iterations = STARTUP_RUNS;
+  s.seconds = now_seconds() - start;
+  s.cycles = now_cycles() - cycles;
+  report_startup("generate_dict", s);
+
+  struct dict* dict = generate_dict(dict_path);
+  cycles = now_cycles();
+  start = now_seconds();
+  for (int i = 0; i < STARTUP_RUNS; i++) {
+    destory_decode_tree(generate_decode_tree(dict));
+  }
+  s.seconds = now_seconds() - start;
+  s.cycles = now_cycles() - cycles;
+  report_startup("generate_decode_tree", s);
+  struct decode_tree* tree = generate_decode_tree(dict);
+
+  // corpora, the already compressed one is the encoded text
+  struct corpus corpora[4] = {{"text"}, {"binary"}, {"random"},
+                              {"compressed"}};
+  uint64_t rng = 0x9e3779b97f4a7c15ull;
+  for (int i = 0; i < 4; i++) {
+    corpora[i].len = corpus_len;
+    corpora[i].buffer = (uint8_t*)calloc(corpus_len + 9, 1);
+  }
+  fill_text(&corpora[0].buffer[9], corpus_len, &rng);
+  fill_binary(&corpora[1].buffer[9], corpus_len, &rng);
+  fill_random(&corpora[2].buffer[9], corpus_len, &rng);
+
+  for (int i = 0; i < 4; i++) {
+    if (i == 3) {
+      uint64_t n = corpora[0].comp_len;
+      corpora[3].len = n < corpus_len ? n : corpus_len;
+      memcpy(&corpora[3].buffer[9], &corpora[0].compressed[9],
+             corpora[3].len);
+    }
+    if (prepare_corpus(&corpora[i], dict, tree) < 0) {
+      printf("Round trip failed on %s!\n", corpora[i].name);
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < 4; i++) {
+    struct corpus* c = &corpora[i];
+    report("compress", c, bench_compress(c, dict, compress, min_seconds));
+    report("compress_multi", c,
+           bench_compress(c, dict, compress_multi, min_seconds));
+    report("block_compress_multi", c,
+           bench_compress(c, dict, block_compress, min_seconds));
+    report("compress_len", c, bench_compress(c, dict, length, min_seconds));
+    report("compress_estimate", c,
+           bench_compress(c, dict, estimate, min_seconds));
+    report("decompress", c,
+           bench_decompress(c, c->compressed, c->comp_len, tree, decompress,
+                            min_seconds));
+    report("decompress_multi", c,
+           bench_decompress(c, c->multi, c->multi_len, tree,
+                            decompress_multi, min_seconds));
+    report("block_decompress_multi", c,
+           bench_decompress(c, c->multi, c->multi_len, tree,
+                            block_decompress, min_seconds));
+    report("decompress_tree", c,
+           bench_decompress(c, c->compressed, c->comp_len, tree,
+                            decompress_tree, min_seconds));
+  }
+
+  for (int i = 0; i < 4; i++) {
+    free(corpora[i].buffer);
+    free(corpora[i].compressed);
+    free(corpora[i].multi);
+  }
+  block_codec_destory(blocks);
+  destory_decode_tree(tree);
+  destory_dict(dict);
+  return 0;
+}
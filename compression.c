@@ -1,55 +1,207 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include "bitwise.h"
 #include "compression.h"
 
 #define DICT_SIZE (256)
 #define BUF_INITIAL_LEN (1024)
 
+/*
+ * read len bits of bytes from the bit at pos, the highest bit first
+ */
+static uint32_t read_bits(uint8_t* bytes, uint64_t pos, int len) {
+  uint32_t value = 0;
+  for (int i = 0; i < len; i++, pos++) {
+    value = (value << 1) | ith_bit(bytes[pos / 8], 7 - pos % 8);
+  }
+  return value;
+}
+
+/*
+ * hash of the code lengths and codes, FNV-1a
+ */
+static uint32_t dict_hash(struct dict* dict) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < DICT_SIZE; i++) {
+    uint8_t bytes[5] = {dict->len[i], dict->code[i] >> 24, dict->code[i] >> 16,
+                        dict->code[i] >> 8, dict->code[i]};
+    for (int j = 0; j < 5; j++) {
+      hash = (hash ^ bytes[j]) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+/*
+ * given the bytes of a dictionary file, generate a pointer to dict.
+ * every byte needs a code of 1 to DICT_MAX_CODE_LEN bits,
+ * and no code may be the prefix of another
+ * return NULL if the dictionary is malformed
+ */
+struct dict* parse_dict(uint8_t* bytes, uint64_t bytes_len) {
+  struct dict* dict = (struct dict*)calloc(1, sizeof(struct dict));
+  uint64_t bits = bytes_len * 8;
+  uint64_t pos = 0;
+
+  /* iterates 256 times to read length and code into dict*/
+  for (int i = 0; i < DICT_SIZE; i++) {
+    if (pos + 8 > bits) {
+      free(dict);
+      return NULL;
+    }
+    dict->len[i] = read_bits(bytes, pos, 8);
+    pos += 8;
+    if (dict->len[i] == 0 || dict->len[i] > DICT_MAX_CODE_LEN ||
+        pos + dict->len[i] > bits) {
+      free(dict);
+      return NULL;
+    }
+    dict->code[i] = read_bits(bytes, pos, dict->len[i]);
+    pos += dict->len[i];
+  }
+
+  for (int i = 0; i < DICT_SIZE; i++) {
+    for (int j = 0; j < DICT_SIZE; j++) {
+      int shift = dict->len[j] - dict->len[i];
+      if (i != j && shift >= 0 &&
+          (dict->code[j] >> shift) == dict->code[i]) {
+        free(dict);
+        return NULL;
+      }
+    }
+  }
+
+  dict->id = dict_hash(dict);
+  return dict;
+}
+
 /*
  * given a path to dictionary,
  * generate a pointer to dict
+ * return NULL if it can not be read or is malformed
  */
 struct dict* generate_dict(char* dict_path) {
   if (dict_path == NULL) {
     return NULL;
   }
 
-  struct dict* dict = (struct dict*)malloc(sizeof(struct dict));
-
-  /* generate an array to store all the bits */
-  char bit_arr[8000];
   FILE* fp = fopen(dict_path, "rb");
-  int i, j, bit_num, bit_ctr;
-  bit_num = 0;
-  unsigned int c;
-  while ((c = fgetc(fp)) != EOF) {
-    for (j = 0; j < 8; j++) {
-      bit_arr[bit_num] = ith_bit(c, 7 - j);
-      bit_num++;
-    }
+  if (fp == NULL) {
+    return NULL;
   }
+  uint8_t bytes[DICT_FILE_MAX];
+  uint64_t bytes_len = fread(bytes, 1, sizeof(bytes), fp);
   fclose(fp);
 
-  /* set all bits as 0 */
-  for (i = 0; i < DICT_SIZE; i++) {
-    dict->code[i] = 0;
+  return parse_dict(bytes, bytes_len);
+}
+
+/*
+ * write dict into out in the format of a dictionary file,
+ * the last byte is padded with 0.
+ * return the number of bytes written, at most DICT_FILE_MAX
+ */
+uint64_t serialize_dict(struct dict* dict, uint8_t* out) {
+  memset(out, 0, DICT_FILE_MAX);
+  uint64_t pos = 0;
+  for (int i = 0; i < DICT_SIZE; i++) {
+    uint64_t value = ((uint64_t)dict->len[i] << dict->len[i]) | dict->code[i];
+    for (int j = 8 + dict->len[i] - 1; j >= 0; j--, pos++) {
+      out[pos / 8] |= ((value >> j) & 1) << (7 - pos % 8);
+    }
+  }
+  return (pos + 7) / 8;
+}
+
+/*
+ * huffman code lengths of weights, the two lightest trees are
+ * merged until one is left, a leaf is as deep as its merges
+ */
+static void huffman_lengths(uint64_t* weights, uint8_t* lens) {
+  uint64_t weight[DICT_SIZE * 2];
+  int parent[DICT_SIZE * 2];
+  int active[DICT_SIZE * 2];
+  int nodes = DICT_SIZE;
+  for (int i = 0; i < DICT_SIZE; i++) {
+    weight[i] = weights[i];
+    active[i] = 1;
+  }
+
+  while (nodes < DICT_SIZE * 2 - 1) {
+    int a = -1;
+    int b = -1;
+    for (int i = 0; i < nodes; i++) {
+      if (!active[i]) {
+        continue;
+      }
+      if (a < 0 || weight[i] < weight[a]) {
+        b = a;
+        a = i;
+      } else if (b < 0 || weight[i] < weight[b]) {
+        b = i;
+      }
+    }
+    weight[nodes] = weight[a] + weight[b];
+    active[nodes] = 1;
+    active[a] = 0;
+    active[b] = 0;
+    parent[a] = nodes;
+    parent[b] = nodes;
+    nodes++;
+  }
+
+  for (int i = 0; i < DICT_SIZE; i++) {
+    int len = 0;
+    for (int node = i; node != nodes - 1; node = parent[node]) {
+      len++;
+    }
+    lens[i] = len;
+  }
+}
+
+/*
+ * given the count of every byte in the data to compress,
+ * generate the dict of the shortest codes for it.
+ * every byte gets a code, a byte never seen is counted once.
+ * counts are halved until no code is longer than DICT_MAX_CODE_LEN,
+ * the codes are canonical: shorter codes first, then by byte
+ */
+struct dict* train_dict(uint64_t* counts) {
+  struct dict* dict = (struct dict*)calloc(1, sizeof(struct dict));
+  uint64_t weights[DICT_SIZE];
+  for (int i = 0; i < DICT_SIZE; i++) {
+    weights[i] = counts[i] + 1;
   }
 
-  /* iterates 256 times to store length and code into dict*/
-  bit_ctr = 0;
-  for (i = 0; i < DICT_SIZE; i++) {
-    // read length
-    for (j = 0; j < 8; j++) {
-      dict->len[i] = modify_bit(dict->len[i], 7 - j, bit_arr[bit_ctr++]);
+  while (1) {
+    huffman_lengths(weights, dict->len);
+    int max_len = 0;
+    for (int i = 0; i < DICT_SIZE; i++) {
+      max_len = dict->len[i] > max_len ? dict->len[i] : max_len;
+    }
+    if (max_len <= DICT_MAX_CODE_LEN) {
+      break;
     }
+    for (int i = 0; i < DICT_SIZE; i++) {
+      weights[i] = (weights[i] + 1) / 2;
+    }
+  }
 
-    // read code
-    for (j = 0; j < dict->len[i]; j++) {
-      dict->code[i] =
-          modify_bit(dict->code[i], dict->len[i] - 1 - j, bit_arr[bit_ctr++]);
+  uint64_t code = 0;
+  int prev_len = 0;
+  for (int len = 1; len <= DICT_MAX_CODE_LEN; len++) {
+    for (int i = 0; i < DICT_SIZE; i++) {
+      if (dict->len[i] != len) {
+        continue;
+      }
+      code <<= len - prev_len;
+      prev_len = len;
+      dict->code[i] = (uint32_t)code++;
     }
   }
+
+  dict->id = dict_hash(dict);
   return dict;
 }
 
@@ -85,6 +237,50 @@ void generate_decode_tree_helper(struct node* root,
   }
 }
 
+/*
+ * fill the lookup table of decode tree.
+ * a code of len <= DECODE_TABLE_BITS owns every slot it prefixes,
+ * the remaining slots keep the tree node reached after DECODE_TABLE_BITS bits
+ */
+static void generate_decode_table(struct decode_tree* tree,
+                                  struct dict* dict) {
+  memset(tree->table, 0, sizeof(tree->table));
+  tree->min_len = 32;
+
+  for (int i = 0; i < DICT_SIZE; i++) {
+    int len = dict->len[i];
+    if (len == 0) {
+      continue;
+    }
+    if (len < tree->min_len) {
+      tree->min_len = len;
+    }
+    if (len > DECODE_TABLE_BITS) {
+      continue;
+    }
+
+    uint32_t first = (dict->code[i] << (DECODE_TABLE_BITS - len)) &
+                     (DECODE_TABLE_SIZE - 1);
+    uint32_t count = 1u << (DECODE_TABLE_BITS - len);
+    for (uint32_t j = first; j < first + count; j++) {
+      tree->table[j].symbol = i;
+      tree->table[j].len = len;
+    }
+  }
+
+  /* NULL subtree means no code starts with these bits */
+  for (int i = 0; i < DECODE_TABLE_SIZE; i++) {
+    struct node* node = NULL;
+    if (tree->table[i].len == 0) {
+      node = tree->root;
+      for (int j = DECODE_TABLE_BITS - 1; j >= 0 && node != NULL; j--) {
+        node = ith_bit(i, j) ? node->one : node->zero;
+      }
+    }
+    tree->subtree[i] = node;
+  }
+}
+
 /*
  * given a dict, return a decode tree to do uncompression
  */
@@ -106,80 +302,683 @@ struct decode_tree* generate_decode_tree(struct dict* dict) {
     generate_decode_tree_helper(tree->root, dict->code[i], (int)dict->len[i],
                                 i);
   }
+
+  generate_decode_table(tree, dict);
   return tree;
 }
 
+/*
+ * given dict and payload, return the total number of bits
+ * of the codes of payload, without padding
+ */
+uint64_t compress_bits(struct dict* dict,
+                       uint8_t* payload,
+                       uint64_t payload_len) {
+  uint64_t bit_ctr = 0;
+  for (uint64_t i = 0; i < payload_len; i++) {
+    bit_ctr += dict->len[payload[i]];
+  }
+  return bit_ctr;
+}
+
+/*
+ * given dict and payload, return the payload length
+ * compress() generates, including the padding size byte
+ */
+uint64_t compress_len(struct dict* dict,
+                      uint8_t* payload,
+                      uint64_t payload_len) {
+  return (compress_bits(dict, payload, payload_len) + 7) / 8 + 1;
+}
+
+/*
+ * add the number of times every byte value appears in payload
+ * to the DICT_SIZE counters of hist.
+ * four tables in turn, so a run of one byte value does not wait
+ * on the increment of the same counter
+ */
+void compress_histogram(uint8_t* payload,
+                        uint64_t payload_len,
+                        uint64_t* hist) {
+  uint32_t counts[4][DICT_SIZE];
+  memset(counts, 0, sizeof(counts));
+
+  uint64_t i = 0;
+  for (; i + 4 <= payload_len; i += 4) {
+    counts[0][payload[i]]++;
+    counts[1][payload[i + 1]]++;
+    counts[2][payload[i + 2]]++;
+    counts[3][payload[i + 3]]++;
+  }
+  for (; i < payload_len; i++) {
+    counts[0][payload[i]]++;
+  }
+
+  for (int b = 0; b < DICT_SIZE; b++) {
+    hist[b] += (uint64_t)counts[0][b] + counts[1][b] + counts[2][b] +
+               counts[3][b];
+  }
+}
+
+/*
+ * given dict and the histogram of sampled bytes of a payload,
+ * return the payload length compress() would generate for it,
+ * scaled from the sampled bytes to payload_len
+ */
+uint64_t compress_estimate_histogram(struct dict* dict,
+                                     uint64_t* hist,
+                                     uint64_t sampled,
+                                     uint64_t payload_len) {
+  uint64_t bits = 0;
+  for (int b = 0; b < DICT_SIZE; b++) {
+    bits += hist[b] * dict->len[b];
+  }
+  if (sampled > 0 && sampled < payload_len) {
+    bits = bits * payload_len / sampled;
+  }
+  return (bits + 7) / 8 + 1;
+}
+
+/*
+ * given dict and payload, estimate the payload length compress()
+ * generates from the histogram of blocks spread over it
+ */
+uint64_t compress_estimate(struct dict* dict,
+                           uint8_t* payload,
+                           uint64_t payload_len) {
+  uint64_t hist[DICT_SIZE] = {0};
+  if (payload_len <= COMPRESS_SAMPLE_LEN) {
+    compress_histogram(payload, payload_len, hist);
+    return compress_estimate_histogram(dict, hist, payload_len,
+                                       payload_len);
+  }
+
+  uint64_t block_len = COMPRESS_SAMPLE_LEN / COMPRESS_SAMPLE_BLOCKS;
+  for (int i = 0; i < COMPRESS_SAMPLE_BLOCKS; i++) {
+    uint64_t start =
+        (payload_len - block_len) * i / (COMPRESS_SAMPLE_BLOCKS - 1);
+    compress_histogram(&payload[start], block_len, hist);
+  }
+  return compress_estimate_histogram(dict, hist, COMPRESS_SAMPLE_LEN,
+                                     payload_len);
+}
+
+/*
+ * start a streaming encoder with no pending bits
+ */
+void compress_stream_init(struct compress_stream* stream) {
+  stream->acc = 0;
+  stream->acc_len = 0;
+}
+
+/*
+ * given a payload length, return the most bytes
+ * compress_stream_update() or compress_stream_finish() can write for it
+ */
+uint64_t compress_stream_bound(uint64_t payload_len) {
+  return payload_len * 4 + 8;
+}
+
+/*
+ * encode payload into out, codes are appended to a 64 bit accumulator
+ * and written out 32 bits at a time. bits that do not fill a word
+ * stay in stream for the next call.
+ * return the number of bytes written into out
+ */
+uint64_t compress_stream_update(struct dict* dict,
+                                struct compress_stream* stream,
+                                uint8_t* payload,
+                                uint64_t payload_len,
+                                uint8_t* out) {
+  uint64_t acc = stream->acc;  // pending bits, aligned to the rightmost bit
+  int acc_len = stream->acc_len;  // always < 32 between codes
+  uint8_t* start = out;
+
+  for (uint64_t i = 0; i < payload_len; i++) {
+    uint8_t byte = payload[i];
+    acc = (acc << dict->len[byte]) | dict->code[byte];
+    acc_len += dict->len[byte];
+
+    if (acc_len >= 32) {
+      acc_len -= 32;
+      uint32_t word = htobe32((uint32_t)(acc >> acc_len));
+      memcpy(out, &word, sizeof(word));
+      out += sizeof(word);
+    }
+  }
+
+  stream->acc = acc;
+  stream->acc_len = acc_len;
+  return out - start;
+}
+
+/*
+ * flush the pending bits of stream into out, padding the last byte
+ * with 0, followed by the padding size byte.
+ * return the number of bytes written into out
+ */
+uint64_t compress_stream_finish(struct compress_stream* stream, uint8_t* out) {
+  uint8_t padding_size = (8 - stream->acc_len % 8) % 8;
+  uint8_t* start = out;
+
+  while (stream->acc_len > 0) {
+    if (stream->acc_len >= 8) {
+      stream->acc_len -= 8;
+      *out++ = (uint8_t)(stream->acc >> stream->acc_len);
+    } else {
+      *out++ = (uint8_t)(stream->acc << (8 - stream->acc_len));
+      stream->acc_len = 0;
+    }
+  }
+
+  /* store padding size into last byte */
+  *out++ = padding_size;
+  return out - start;
+}
+
+/*
+ * append encoded bits into out, 32 bits at a time through the
+ * accumulator, then 8 bits at a time and the bits left in the last
+ * byte of src.
+ * return the number of bytes written into out
+ */
+uint64_t compress_stream_append(struct compress_stream* stream,
+                                uint8_t* src,
+                                uint64_t bits,
+                                uint8_t* out) {
+  uint64_t acc = stream->acc;
+  int acc_len = stream->acc_len;  // < 32, a word in makes a word out
+  uint8_t* start = out;
+
+  uint64_t words = bits / 32;
+  for (uint64_t i = 0; i < words; i++) {
+    uint32_t word;
+    memcpy(&word, &src[i * 4], sizeof(word));
+    acc = (acc << 32) | be32toh(word);
+    word = htobe32((uint32_t)(acc >> acc_len));
+    memcpy(out, &word, sizeof(word));
+    out += sizeof(word);
+  }
+
+  for (uint64_t i = words * 4; i < (bits + 7) / 8; i++) {
+    int len = (bits - i * 8 >= 8) ? 8 : (int)(bits - i * 8);
+    acc = (acc << len) | (src[i] >> (8 - len));
+    acc_len += len;
+
+    if (acc_len >= 32) {
+      acc_len -= 32;
+      uint32_t word = htobe32((uint32_t)(acc >> acc_len));
+      memcpy(out, &word, sizeof(word));
+      out += sizeof(word);
+    }
+  }
+
+  stream->acc = acc;
+  stream->acc_len = acc_len;
+  return out - start;
+}
+
 /*
  * given dict, buffers, and payload length,
  * generate compressed payload into buffer_send,
  * retrun the payload length after compress
+ *
+ * buffer_send is sized once from the code lengths
+ * and only reallocated if it is too small
  */
 int compress(struct dict* dict,
              uint8_t** buffer_send,
              uint8_t** buffer_recv,
              int payload_len) {
-                 
-  int bit_ctr = 0;
-  int send_pl_len = payload_len;
-  memset((*buffer_send), 0x00, send_pl_len + 9);
-  int index, bit, pos;
-  for (int i = 0; i < payload_len; i++) {
-    uint8_t byte = (*buffer_recv)[i + 9];  //  byte in recveved payload
-    uint32_t code = dict->code[byte];      //  corrsponding code in dict
-    uint8_t code_len = dict->len[byte];    // code length
-
-    for (int j = 0; j < code_len; j++) {
-      bit = ith_bit(code, code_len - 1 - j);  //  bit from leftmost to the right
-      index = bit_ctr / 8 + 9;                //  index of buffer_send
-      pos = 7 - bit_ctr % 8;                  //  position to modify bit
-
-      (*buffer_send)[index] = modify_bit((*buffer_send)[index], pos, bit);
-
-      bit_ctr++;
-
-      /* check buffer size, if buffer is full, realloc it*/
-      if (bit_ctr == send_pl_len) {
-        send_pl_len *= 2;
-        *buffer_send =
-            realloc(*buffer_send, sizeof(uint8_t) * (send_pl_len + 9));
-        for (int k = send_pl_len / 2 + 9; k < send_pl_len + 9; k++) {
-          (*buffer_send)[k] = 0x00;
-        }
-      }
-    }
+  uint8_t* in = &(*buffer_recv)[9];
+
+  /* total bits after encoding, the payload also stores the padding byte */
+  uint64_t bit_ctr = compress_bits(dict, in, payload_len);
+  uint64_t send_pl_len = (bit_ctr + 7) / 8 + 1;
+
+  if (malloc_usable_size(*buffer_send) < send_pl_len + 9) {
+    *buffer_send = realloc(*buffer_send, sizeof(uint8_t) * (send_pl_len + 9));
   }
+  uint8_t* out = &(*buffer_send)[9];
+
+  struct compress_stream stream;
+  compress_stream_init(&stream);
+  out += compress_stream_update(dict, &stream, in, payload_len, out);
+  compress_stream_finish(&stream, out);
 
   /*modify header*/
+  (*buffer_send)[0] = 0x00;
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);  // type
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);  // compreesed
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);  // req compress
 
-  /* calculate payload length and padding size.
-  store padding size into last byte*/
-  uint8_t padding_size = 8 - bit_ctr % 8;
-  if (padding_size == 8) {
-    padding_size = 0;
+  uint64_t pl_len_in64 = htobe64(send_pl_len);
+  memcpy(&(*buffer_send)[1], &pl_len_in64, sizeof(uint64_t));
+
+  return send_pl_len;
+}
+
+/*
+ * given a payload length, return the number of streams
+ * of the multi stream format, one per block once it is long enough
+ */
+uint64_t multi_stream_count(uint64_t payload_len) {
+  if (payload_len <= (uint64_t)MULTI_STREAMS * MULTI_BLOCK_LEN) {
+    return MULTI_STREAMS;
+  }
+  return (payload_len + MULTI_BLOCK_LEN - 1) / MULTI_BLOCK_LEN;
+}
+
+/*
+ * given a payload length, return the length of the jump table,
+ * the payload length and the length of every stream but the last
+ */
+uint64_t multi_table_len(uint64_t payload_len) {
+  return multi_stream_count(payload_len) * sizeof(uint64_t);
+}
+
+/*
+ * given a payload length, store the first byte of each segment of the
+ * multi stream format into bounds, and the payload length after them
+ */
+void multi_stream_bounds(uint64_t payload_len, uint64_t* bounds) {
+  uint64_t streams = multi_stream_count(payload_len);
+  uint64_t segment = MULTI_BLOCK_LEN;
+  if (streams == MULTI_STREAMS) {
+    segment = (payload_len + MULTI_STREAMS - 1) / MULTI_STREAMS;
+  }
+  for (uint64_t i = 0; i <= streams; i++) {
+    uint64_t start = segment * i;
+    bounds[i] = start < payload_len ? start : payload_len;
+  }
+}
+
+/*
+ * write the jump table of the multi stream format into out,
+ * the length of the last stream is what is left of the payload
+ */
+void compress_multi_table(uint8_t* out,
+                          uint64_t payload_len,
+                          uint64_t* stream_lens) {
+  uint64_t field_in64 = htobe64(payload_len);
+  memcpy(out, &field_in64, sizeof(uint64_t));
+  uint64_t streams = multi_stream_count(payload_len);
+  for (uint64_t i = 0; i < streams - 1; i++) {
+    field_in64 = htobe64(stream_lens[i]);
+    memcpy(&out[(i + 1) * sizeof(uint64_t)], &field_in64, sizeof(uint64_t));
+  }
+}
+
+/*
+ * given dict, buffers, and payload length,
+ * generate the multi stream format into buffer_send,
+ * retrun the payload length after compress
+ */
+int compress_multi(struct dict* dict,
+                   uint8_t** buffer_send,
+                   uint8_t** buffer_recv,
+                   int payload_len) {
+  uint8_t* in = &(*buffer_recv)[9];
+
+  uint64_t streams = multi_stream_count(payload_len);
+  uint64_t* bounds = (uint64_t*)malloc((streams + 1) * sizeof(uint64_t));
+  uint64_t* stream_lens = (uint64_t*)malloc(streams * sizeof(uint64_t));
+  uint64_t send_pl_len = multi_table_len(payload_len);
+  multi_stream_bounds(payload_len, bounds);
+  for (uint64_t i = 0; i < streams; i++) {
+    uint64_t bit_ctr =
+        compress_bits(dict, &in[bounds[i]], bounds[i + 1] - bounds[i]);
+    stream_lens[i] = (bit_ctr + 7) / 8 + 1;
+    send_pl_len += stream_lens[i];
+  }
+
+  if (malloc_usable_size(*buffer_send) < send_pl_len + 9) {
+    *buffer_send = realloc(*buffer_send, sizeof(uint8_t) * (send_pl_len + 9));
+  }
+  uint8_t* out = &(*buffer_send)[9];
+  compress_multi_table(out, payload_len, stream_lens);
+  out += multi_table_len(payload_len);
+
+  for (uint64_t i = 0; i < streams; i++) {
+    struct compress_stream stream;
+    compress_stream_init(&stream);
+    out += compress_stream_update(dict, &stream, &in[bounds[i]],
+                                  bounds[i + 1] - bounds[i], out);
+    out += compress_stream_finish(&stream, out);
+  }
+  free(bounds);
+  free(stream_lens);
+
+  /*modify header*/
+  (*buffer_send)[0] = 0x00;
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);  // type
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);  // compreesed
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 1, 1);  // multi stream
+
+  uint64_t pl_len_in64 = htobe64(send_pl_len);
+  memcpy(&(*buffer_send)[1], &pl_len_in64, sizeof(uint64_t));
+
+  return send_pl_len;
+}
+
+/*
+ * given the decode tree and a compressed payload length,
+ * return the largest payload length decompress() can generate
+ */
+uint64_t decompress_bound(struct decode_tree* tree, uint64_t src_pl_len) {
+  return src_pl_len * 8 / tree->min_len;
+}
+
+/*
+ * given the decode tree, buffers, and payload length,
+ * decompress the payload in src, and store in dest,
+ * return the payload length after decompress
+ *
+ * bits are kept in a 64 bit buffer, most significant bit first,
+ * so one table lookup decodes a whole code of up to DECODE_TABLE_BITS.
+ * the last byte of src payload is the padding size and is not decoded
+ */
+int decompress(struct decode_tree* tree,
+               uint8_t** dest,
+               uint8_t** src,
+               int src_pl_len) {
+  if (src_pl_len < 1) {
+    (*dest)[0] = modify_bit((*dest)[0], 3, 0);
+    return 0;
+  }
+
+  uint8_t* in = &(*src)[9];
+  int in_len = src_pl_len - 1;
+  int64_t bits_left = (int64_t)in_len * 8 - (in[in_len] & 0x07);
+
+  /* every code is at least min_len bits, grow dest once up front */
+  uint64_t max_len = decompress_bound(tree, src_pl_len);
+  if (malloc_usable_size(*dest) < max_len + 9) {
+    *dest = realloc(*dest, sizeof(uint8_t) * (max_len + 9));
   }
-  int padding_size_index = 0;
-  if (padding_size == 0) {
-    padding_size_index = bit_ctr / 8;
+  uint8_t* out = &(*dest)[9];
+  int dest_len = 0;
+
+  uint64_t buffer = 0;  // unread bits, aligned to the leftmost bit
+  int buffer_len = 0;   // number of valid bits in buffer
+  int in_index = 0;
+  while (bits_left > 0) {
+    while (buffer_len <= 56 && in_index < in_len) {
+      buffer |= (uint64_t)in[in_index++] << (56 - buffer_len);
+      buffer_len += 8;
+    }
+
+    int index = buffer >> (64 - DECODE_TABLE_BITS);
+    struct decode_entry entry = tree->table[index];
+    if (entry.len != 0) {
+      if (entry.len > bits_left) {
+        break;  // only padding left
+      }
+      out[dest_len++] = entry.symbol;
+      buffer <<= entry.len;
+      buffer_len -= entry.len;
+      bits_left -= entry.len;
+      continue;
+    }
+
+    /* code longer than the table, walk the rest bit by bit */
+    struct node* node = tree->subtree[index];
+    if (node == NULL || bits_left < DECODE_TABLE_BITS) {
+      break;  // not a valid code
+    }
+    buffer <<= DECODE_TABLE_BITS;
+    buffer_len -= DECODE_TABLE_BITS;
+    bits_left -= DECODE_TABLE_BITS;
+    while (node != NULL && node->decode == -1 && bits_left > 0) {
+      node = (buffer >> 63) ? node->one : node->zero;
+      buffer <<= 1;
+      buffer_len--;
+      bits_left--;
+    }
+    if (node == NULL || node->decode == -1) {
+      break;
+    }
+    out[dest_len++] = node->decode;
+  }
+
+  (*dest)[0] = modify_bit((*dest)[0], 3, 0);
+  return dest_len;  // payload length
+}
+
+/*
+ * bit reader of one stream of the multi stream format
+ */
+struct bit_reader {
+  uint8_t* in;   // encoded bytes, without the padding size byte
+  uint64_t len;  // bytes of in
+  uint64_t pos;  // bits already decoded
+};
+
+/*
+ * return the next 64 bits of reader, aligned to the leftmost bit.
+ * at least 57 of them are valid, bytes after the end read as 0
+ */
+static inline uint64_t peek_bits(struct bit_reader* reader) {
+  uint64_t byte = reader->pos >> 3;
+  uint64_t word = 0;
+  if (byte + sizeof(uint64_t) <= reader->len) {
+    memcpy(&word, &reader->in[byte], sizeof(uint64_t));
+    word = be64toh(word);
   } else {
-    padding_size_index = (bit_ctr / 8) + 1;
+    for (uint64_t i = byte; i < byte + sizeof(uint64_t); i++) {
+      word = (word << 8) | (i < reader->len ? reader->in[i] : 0);
+    }
   }
+  return word << (reader->pos & 7);
+}
 
-  (*buffer_send)[padding_size_index + 9] = padding_size;
+/*
+ * decode the next symbol of reader with the table,
+ * and the tree for codes longer than the table.
+ * return the symbol, or -1 if the bits are not a valid code
+ */
+static inline int decode_symbol(struct decode_tree* tree,
+                                struct bit_reader* reader) {
+  uint64_t bits = peek_bits(reader);
+  int index = bits >> (64 - DECODE_TABLE_BITS);
+  struct decode_entry entry = tree->table[index];
+  if (entry.len != 0) {
+    reader->pos += entry.len;
+    return entry.symbol;
+  }
 
-  /* length of payload is larger than index by 1,
-   and store payload it to buffer*/
-  padding_size_index += 1;
+  struct node* node = tree->subtree[index];
+  int len = DECODE_TABLE_BITS;
+  bits <<= DECODE_TABLE_BITS;
+  while (node != NULL && node->decode == -1) {
+    node = (bits >> 63) ? node->one : node->zero;
+    bits <<= 1;
+    len++;
+  }
+  if (node == NULL) {
+    return -1;
+  }
+  reader->pos += len;
+  return node->decode;
+}
 
-  uint64_t pl_len_in64 = htobe64(padding_size_index);
-  uint8_t* ptr = (uint8_t*)&pl_len_in64;
-  for (int i = 1; i < 9; i++) {
-    (*buffer_send)[i] = ptr[i - 1];
+/*
+ * decode n streams of a group, at most MULTI_STREAMS, into the segments
+ * [bounds[i], bounds[i + 1]) of out.
+ * the streams are independent, so decoding one symbol of each in
+ * turn keeps MULTI_STREAMS table lookups in flight at once
+ * instead of one chain where every lookup waits for the last.
+ * return 0, or -1 if a stream is malformed or not used up
+ */
+static int decode_group(struct decode_tree* tree,
+                        struct bit_reader* readers,
+                        uint64_t* stream_bits,
+                        uint64_t* bounds,
+                        uint64_t n,
+                        uint8_t* out) {
+  // the last segment is the shortest, decode that many of each in lockstep
+  uint64_t lockstep = 0;
+  if (n == MULTI_STREAMS) {
+    struct bit_reader r0 = readers[0], r1 = readers[1];
+    struct bit_reader r2 = readers[2], r3 = readers[3];
+    uint8_t* out0 = &out[bounds[0]];
+    uint8_t* out1 = &out[bounds[1]];
+    uint8_t* out2 = &out[bounds[2]];
+    uint8_t* out3 = &out[bounds[3]];
+    lockstep = bounds[4] - bounds[3];
+    for (uint64_t i = 0; i < lockstep; i++) {
+      int s0 = decode_symbol(tree, &r0);
+      int s1 = decode_symbol(tree, &r1);
+      int s2 = decode_symbol(tree, &r2);
+      int s3 = decode_symbol(tree, &r3);
+      if ((s0 | s1 | s2 | s3) < 0) {
+        return -1;
+      }
+      out0[i] = s0;
+      out1[i] = s1;
+      out2[i] = s2;
+      out3[i] = s3;
+    }
+    readers[0] = r0;
+    readers[1] = r1;
+    readers[2] = r2;
+    readers[3] = r3;
   }
 
-  return padding_size_index;
+  // the rest of the longer segments, then every stream must be used up
+  for (uint64_t i = 0; i < n; i++) {
+    for (uint64_t j = bounds[i] + lockstep; j < bounds[i + 1]; j++) {
+      int symbol = decode_symbol(tree, &readers[i]);
+      if (symbol < 0) {
+        return -1;
+      }
+      out[j] = symbol;
+    }
+    if (readers[i].pos != stream_bits[i]) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * read the jump table of the multi stream payload in, of in_len bytes,
+ * and store where each stream starts in in into offsets,
+ * and where the last one ends after them
+ * return the payload length, -1 if the table is malformed
+ */
+int64_t multi_table_read(struct decode_tree* tree,
+                         uint8_t* in,
+                         uint64_t in_len,
+                         uint64_t** offsets) {
+  if (in_len < sizeof(uint64_t)) {
+    return -1;
+  }
+  uint64_t field_in64;
+  memcpy(&field_in64, in, sizeof(uint64_t));
+  uint64_t payload_len = be64toh(field_in64);
+  if (payload_len > decompress_bound(tree, in_len) ||
+      multi_table_len(payload_len) > in_len) {
+    return -1;
+  }
+
+  // every stream holds at least its padding size byte
+  uint64_t streams = multi_stream_count(payload_len);
+  uint64_t* starts = (uint64_t*)malloc((streams + 1) * sizeof(uint64_t));
+  starts[0] = multi_table_len(payload_len);
+  for (uint64_t i = 0; i < streams - 1; i++) {
+    memcpy(&field_in64, &in[(i + 1) * sizeof(uint64_t)], sizeof(uint64_t));
+    uint64_t stream_len = be64toh(field_in64);
+    if (stream_len < 1 || stream_len > in_len - starts[i]) {
+      free(starts);
+      return -1;
+    }
+    starts[i + 1] = starts[i] + stream_len;
+  }
+  if (in_len - starts[streams - 1] < 1) {
+    free(starts);
+    return -1;
+  }
+  starts[streams] = in_len;
+  *offsets = starts;
+  return payload_len;
+}
+
+/*
+ * decode the streams [first, first + n) of the multi stream payload in
+ * into their segments of out, MULTI_STREAMS at a time in lockstep
+ * return 0, or -1 if a stream is malformed
+ */
+int decompress_streams(struct decode_tree* tree,
+                       uint8_t* in,
+                       uint64_t* offsets,
+                       uint64_t payload_len,
+                       uint64_t first,
+                       uint64_t n,
+                       uint8_t* out) {
+  struct bit_reader readers[MULTI_STREAMS];
+  uint64_t stream_bits[MULTI_STREAMS];
+  uint64_t bounds[MULTI_STREAMS + 1];
+  uint64_t segment = MULTI_BLOCK_LEN;
+  if (multi_stream_count(payload_len) == MULTI_STREAMS) {
+    segment = (payload_len + MULTI_STREAMS - 1) / MULTI_STREAMS;
+  }
+
+  for (uint64_t i = first; i < first + n; i += MULTI_STREAMS) {
+    uint64_t group = first + n - i;
+    if (group > MULTI_STREAMS) {
+      group = MULTI_STREAMS;
+    }
+    for (uint64_t j = 0; j < group; j++) {
+      uint8_t* stream = &in[offsets[i + j]];
+      readers[j].in = stream;
+      readers[j].len = offsets[i + j + 1] - offsets[i + j] - 1;
+      readers[j].pos = 0;
+      stream_bits[j] = readers[j].len * 8 - (stream[readers[j].len] & 0x07);
+    }
+    for (uint64_t j = 0; j <= group; j++) {
+      uint64_t start = segment * (i + j);
+      bounds[j] = start < payload_len ? start : payload_len;
+    }
+    if (decode_group(tree, readers, stream_bits, bounds, group, out) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * given the decode tree, buffers, and payload length,
+ * decompress the multi stream format in src, and store in dest.
+ * return the payload length after decompress, -1 if malformed
+ */
+int decompress_multi(struct decode_tree* tree,
+                     uint8_t** dest,
+                     uint8_t** src,
+                     int src_pl_len) {
+  if (src_pl_len < 0) {
+    return -1;
+  }
+  uint8_t* in = &(*src)[9];
+  uint64_t* offsets;
+  int64_t payload_len = multi_table_read(tree, in, src_pl_len, &offsets);
+  if (payload_len < 0) {
+    return -1;
+  }
+
+  if (malloc_usable_size(*dest) < (uint64_t)payload_len + 9) {
+    *dest = realloc(*dest, sizeof(uint8_t) * (payload_len + 9));
+  }
+  int res = decompress_streams(tree, in, offsets, payload_len, 0,
+                               multi_stream_count(payload_len),
+                               &(*dest)[9]);
+  free(offsets);
+  if (res < 0) {
+    return -1;
+  }
+
+  (*dest)[0] = modify_bit((*dest)[0], 3, 0);
+  return payload_len;  // payload length
 }
 
 /*
@@ -204,14 +1003,13 @@ int decompress_helper(struct node* root,
 }
 
 /*
- * given the decode tree, buffers, and payload length,
- * decompress the payload in src, and store in dest,
- * return the payload length after decompress
+ * the original decoder, walking the tree from the root for every new bit.
+ * only kept as a reference to compare decompress() against
  */
-int decompress(struct decode_tree* tree,
-               uint8_t** dest,
-               uint8_t** src,
-               int src_pl_len) {
+int decompress_tree(struct decode_tree* tree,
+                    uint8_t** dest,
+                    uint8_t** src,
+                    int src_pl_len) {
   int buffer_size = src_pl_len; //record current buffer size
   uint32_t buffer = 0;    // store the bits from the start of payload
   int buffer_index = 31;  // record index and length
@@ -15,12 +15,44 @@
 #include <string.h>
 
 #define DICT_SIZE (256)
+#define DICT_MAX_CODE_LEN (32)  // codes are stored in uint32
+#define DICT_FILE_MAX (DICT_SIZE * (8 + DICT_MAX_CODE_LEN) / 8)
 #define BUF_INITIAL_LEN (1024)
+#define DECODE_TABLE_BITS (10)  // bits resolved by one table lookup
+#define DECODE_TABLE_SIZE (1 << DECODE_TABLE_BITS)
+#define MULTI_STREAMS (4)           // streams of the multi stream format
+#define MULTI_BLOCK_LEN (1 << 20)  // segment length of a large payload
+#define COMPRESS_SAMPLE_LEN (1 << 14)  // bytes counted to estimate a length
+#define COMPRESS_SAMPLE_BLOCKS (16)    // spread over a longer payload
+
+/*
+ * multi stream format, flagged by bit 1 of the header.
+ * the payload is cut into MULTI_STREAMS segments of
+ * (len + MULTI_STREAMS - 1) / MULTI_STREAMS bytes, the last ones shorter,
+ * or into blocks of MULTI_BLOCK_LEN bytes, the last one shorter, if it is
+ * longer than MULTI_STREAMS blocks.
+ * each segment is encoded as a stream of its own, with its own
+ * padding size byte, so the streams can be decoded side by side,
+ * and encoded by different threads.
+ * the jump table holds the payload length and the encoded lengths of
+ * all streams but the last, big endian uint64,
+ * and the streams follow it in order.
+ */
 
 /*dictionary structure, including the code and corresponding length*/
 struct dict {
   uint8_t len[DICT_SIZE];
   uint32_t code[DICT_SIZE];
+  uint32_t id;  // hash of the codes, names the dict on the wire
+};
+
+/*
+ * state of a streaming encoder, the bits which do not fill
+ * a whole word yet are carried to the next chunk
+ */
+struct compress_stream {
+  uint64_t acc;
+  int acc_len;
 };
 
 /* the node of decode tree, store the decode of dictionary*/
@@ -31,17 +63,57 @@ struct node {
   struct node* zero;  // 0 bit
 };
 
-/* decode tree, it is a binary tree data sturcture*/
+/*
+ * one slot of the decode table, indexed by the next DECODE_TABLE_BITS bits.
+ * len is the length of the code starting with those bits,
+ * or 0 if the code is longer than the table
+ */
+struct decode_entry {
+  uint8_t symbol;
+  uint8_t len;
+};
+
+/*
+ * decode tree, it is a binary tree data sturcture.
+ * table resolves every code up to DECODE_TABLE_BITS long in one lookup,
+ * longer codes continue walking the tree from subtree[index]
+ */
 struct decode_tree {
   struct node* root;
+
+  struct decode_entry table[DECODE_TABLE_SIZE];
+  struct node* subtree[DECODE_TABLE_SIZE];
+  int min_len;  // shortest code length, bounds the decoded size
 };
 
 /*
  * given a path to dictionary,
  * generate a pointer to dict
+ * return NULL if it can not be read or is malformed
  */
 struct dict* generate_dict(char* dict_path);
 
+/*
+ * given the bytes of a dictionary file, generate a pointer to dict.
+ * a dictionary file is DICT_SIZE entries of an 8 bit code length
+ * followed by the code, packed from the highest bit.
+ * return NULL if a code is empty, too long, or the prefix of another
+ */
+struct dict* parse_dict(uint8_t* bytes, uint64_t bytes_len);
+
+/*
+ * write dict into out in the format of a dictionary file,
+ * out holds at least DICT_FILE_MAX bytes.
+ * return the number of bytes written
+ */
+uint64_t serialize_dict(struct dict* dict, uint8_t* out);
+
+/*
+ * given the count of every byte in the data to compress,
+ * generate the dict of huffman codes for it
+ */
+struct dict* train_dict(uint64_t* counts);
+
 /*
  * the helper function using recursion to generate decode tree.
  * note: this should be be encapsulated as a private method in
@@ -57,10 +129,55 @@ void generate_decode_tree_helper(struct node* root,
  */
 struct decode_tree* generate_decode_tree(struct dict* dict);
 
+/*
+ * given dict and payload, return the total number of bits
+ * of the codes of payload, without padding
+ */
+uint64_t compress_bits(struct dict* dict,
+                       uint8_t* payload,
+                       uint64_t payload_len);
+
+/*
+ * given dict and payload, return the payload length
+ * compress() generates, including the padding size byte
+ */
+uint64_t compress_len(struct dict* dict,
+                      uint8_t* payload,
+                      uint64_t payload_len);
+
+/*
+ * add the number of times every byte value appears in payload
+ * to the DICT_SIZE counters of hist
+ */
+void compress_histogram(uint8_t* payload,
+                        uint64_t payload_len,
+                        uint64_t* hist);
+
+/*
+ * given dict and the histogram of sampled bytes of a payload,
+ * return the payload length compress() would generate for it,
+ * scaled from the sampled bytes to payload_len
+ */
+uint64_t compress_estimate_histogram(struct dict* dict,
+                                     uint64_t* hist,
+                                     uint64_t sampled,
+                                     uint64_t payload_len);
+
+/*
+ * given dict and payload, estimate the payload length compress()
+ * generates from the histogram of COMPRESS_SAMPLE_BLOCKS blocks spread
+ * over it, COMPRESS_SAMPLE_LEN bytes in all.
+ * exact for a payload no longer than COMPRESS_SAMPLE_LEN
+ */
+uint64_t compress_estimate(struct dict* dict,
+                           uint8_t* payload,
+                           uint64_t payload_len);
+
 /*
  * given dict, buffers, and payload length,
  * generate compressed payload into buffer_send,
- * retrun the payload length after compress
+ * retrun the payload length after compress.
+ * buffer_send is only reallocated if it is too small
  */
 int compress(struct dict* dict,
              uint8_t** buffer_send,
@@ -68,16 +185,147 @@ int compress(struct dict* dict,
              int payload_len);
 
 
+/*
+ * start a streaming encoder with no pending bits
+ */
+void compress_stream_init(struct compress_stream* stream);
+
+/*
+ * given a payload length, return the most bytes
+ * compress_stream_update() or compress_stream_finish() can write for it
+ */
+uint64_t compress_stream_bound(uint64_t payload_len);
+
+/*
+ * encode a chunk of payload into out, continuing the bits of the
+ * previous chunk, so encoding a payload chunk by chunk generates
+ * the same bits as compress().
+ * return the number of bytes written into out
+ */
+uint64_t compress_stream_update(struct dict* dict,
+                                struct compress_stream* stream,
+                                uint8_t* payload,
+                                uint64_t payload_len,
+                                uint8_t* out);
+
+/*
+ * flush the pending bits of stream into out,
+ * followed by the padding size byte.
+ * return the number of bytes written into out
+ */
+uint64_t compress_stream_finish(struct compress_stream* stream, uint8_t* out);
+
+/*
+ * append bits already encoded, packed from the highest bit of
+ * each byte, into out after the pending bits of stream.
+ * at most bits / 8 + 4 bytes are written.
+ * return the number of bytes written into out
+ */
+uint64_t compress_stream_append(struct compress_stream* stream,
+                                uint8_t* src,
+                                uint64_t bits,
+                                uint8_t* out);
+
+/*
+ * given a payload length, return the number of streams
+ * of the multi stream format
+ */
+uint64_t multi_stream_count(uint64_t payload_len);
+
+/*
+ * given a payload length, return the length of the jump table
+ * of the multi stream format
+ */
+uint64_t multi_table_len(uint64_t payload_len);
+
+/*
+ * given a payload length, store the first byte of each segment of the
+ * multi stream format into bounds, and the payload length after them.
+ * bounds holds multi_stream_count() + 1 values
+ */
+void multi_stream_bounds(uint64_t payload_len, uint64_t* bounds);
+
+/*
+ * given the payload length and the encoded length of every stream,
+ * write the jump table of the multi stream format into out
+ */
+void compress_multi_table(uint8_t* out,
+                          uint64_t payload_len,
+                          uint64_t* stream_lens);
+
+/*
+ * same as compress(), but generate the multi stream format,
+ * the header is flagged with bit 1
+ */
+int compress_multi(struct dict* dict,
+                   uint8_t** buffer_send,
+                   uint8_t** buffer_recv,
+                   int payload_len);
+
+/*
+ * given the decode tree and a compressed payload length,
+ * return the largest payload length decompress() can generate
+ */
+uint64_t decompress_bound(struct decode_tree* tree, uint64_t src_pl_len);
+
 /*
  * given the decode tree, buffers, and payload length,
  * decompress the payload in src, and store in dest,
- * return the payload length after decompress
+ * return the payload length after decompress.
+ * dest is only reallocated if it is too small
  */
 int decompress(struct decode_tree* tree,
                uint8_t** dest,
                uint8_t** src,
                int src_pl_len);
 
+/*
+ * given the decode tree, read the jump table of the multi stream
+ * payload in, of in_len bytes, and store into a new *offsets where
+ * each stream starts in in, and where the last one ends after them.
+ * return the payload length, -1 if the table is malformed
+ */
+int64_t multi_table_read(struct decode_tree* tree,
+                         uint8_t* in,
+                         uint64_t in_len,
+                         uint64_t** offsets);
+
+/*
+ * given the decode tree, a multi stream payload in, the offsets from
+ * multi_table_read() and the payload length,
+ * decode the n streams from first into their segments of out,
+ * out holds the whole payload. streams are independent, so any
+ * streams may be decoded by different threads at once.
+ * return 0, or -1 if a stream is malformed or not used up
+ */
+int decompress_streams(struct decode_tree* tree,
+                       uint8_t* in,
+                       uint64_t* offsets,
+                       uint64_t payload_len,
+                       uint64_t first,
+                       uint64_t n,
+                       uint8_t* out);
+
+/*
+ * same as decompress(), but for the multi stream format,
+ * the streams are decoded in lockstep.
+ * bit 1 of the header is kept, only the compressed bit is cleared.
+ * return -1 if the jump table or a stream is malformed
+ */
+int decompress_multi(struct decode_tree* tree,
+                     uint8_t** dest,
+                     uint8_t** src,
+                     int src_pl_len);
+
+/*
+ * the original decoder, walking the tree from the root for every new bit.
+ * only kept as a reference to compare decompress() against
+ */
+int decompress_tree(struct decode_tree* tree,
+                    uint8_t** dest,
+                    uint8_t** src,
+                    int src_pl_len);
+
 /* free the memory usage of dict */
 void destory_dict(struct dict* dict);
 
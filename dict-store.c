@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "dict-store.h"
+
+#define TRAIN_CHUNK_LEN (1 << 16)  // file bytes counted at once
+#define READERS_POLL_US (1000)     // sleep while waiting for readers
+
+/*
+  Read the dictionary file at dict_path into a new version
+  return NULL if it can not be read or is malformed
+*/
+static struct dict_version* load_version(char* dict_path) {
+  FILE* fp = fopen(dict_path, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  struct dict_version* version =
+      (struct dict_version*)calloc(1, sizeof(struct dict_version));
+  version->file_len = fread(version->file, 1, DICT_FILE_MAX, fp);
+  fclose(fp);
+
+  version->dict = parse_dict(version->file, version->file_len);
+  if (version->dict == NULL) {
+    free(version);
+    return NULL;
+  }
+  version->tree = generate_decode_tree(version->dict);
+  version->id = version->dict->id;
+  return version;
+}
+
+static void free_version(struct dict_version* version) {
+  destory_decode_tree(version->tree);
+  destory_dict(version->dict);
+  free(version);
+}
+
+/*
+  Wait until no reader is counted in epoch
+*/
+static void wait_readers(struct dict_store* store, int epoch) {
+  while (__atomic_load_n(&store->readers[epoch], __ATOMIC_SEQ_CST) != 0) {
+    usleep(READERS_POLL_US);
+  }
+}
+
+struct dict_store* dict_store_init(char* dict_path) {
+  struct dict_version* version = load_version(dict_path);
+  if (version == NULL) {
+    return NULL;
+  }
+
+  struct dict_store* store =
+      (struct dict_store*)calloc(1, sizeof(struct dict_store));
+  pthread_mutex_init(&store->lock, NULL);
+  store->dict_path = dict_path;
+  store->current = version;
+  return store;
+}
+
+struct dict_version* dict_store_get(struct dict_store* store, int* epoch) {
+  // counted before the load, so a reload that missed
+  // this reader has already published the new version
+  *epoch = __atomic_load_n(&store->epoch, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&store->readers[*epoch], 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&store->current, __ATOMIC_SEQ_CST);
+}
+
+void dict_store_put(struct dict_store* store, int epoch) {
+  __atomic_sub_fetch(&store->readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+int dict_store_reload(struct dict_store* store) {
+  struct dict_version* version = load_version(store->dict_path);
+  if (version == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&store->lock);
+  struct dict_version* old =
+      __atomic_exchange_n(&store->current, version, __ATOMIC_SEQ_CST);
+
+  // a reader of old is counted in either epoch, new readers move
+  // to the other epoch so the one waited for drains
+  for (int i = 0; i < 2; i++) {
+    int epoch = store->epoch;
+    __atomic_store_n(&store->epoch, !epoch, __ATOMIC_SEQ_CST);
+    wait_readers(store, epoch);
+  }
+  __atomic_add_fetch(&store->reloads, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&store->lock);
+
+  free_version(old);
+  return 0;
+}
+
+int64_t dict_store_train(char* directory_path, char* dict_path) {
+  DIR* d = opendir(directory_path);
+  if (d == NULL) {
+    return -1;
+  }
+
+  uint64_t counts[DICT_SIZE] = {0};
+  uint8_t* chunk = (uint8_t*)malloc(TRAIN_CHUNK_LEN);
+  struct dirent* dir;
+  while ((dir = readdir(d)) != NULL) {
+    if (dir->d_type != DT_REG) {
+      continue;
+    }
+    int fd = openat(dirfd(d), dir->d_name, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    ssize_t n;
+    while ((n = read(fd, chunk, TRAIN_CHUNK_LEN)) > 0) {
+      for (ssize_t i = 0; i < n; i++) {
+        counts[chunk[i]]++;
+      }
+    }
+    close(fd);
+  }
+  closedir(d);
+  free(chunk);
+
+  struct dict* dict = train_dict(counts);
+  uint8_t file[DICT_FILE_MAX];
+  uint64_t file_len = serialize_dict(dict, file);
+  int64_t id = dict->id;
+  destory_dict(dict);
+
+  // written aside and renamed, a reload never reads half a file
+  char tmp_path[strlen(dict_path) + 5];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", dict_path);
+  FILE* fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (fwrite(file, 1, file_len, fp) != file_len) {
+    fclose(fp);
+    unlink(tmp_path);
+    return -1;
+  }
+  if (fclose(fp) != 0 || rename(tmp_path, dict_path) != 0) {
+    unlink(tmp_path);
+    return -1;
+  }
+  return id;
+}
+
+uint64_t dict_store_reloads(struct dict_store* store) {
+  return __atomic_load_n(&store->reloads, __ATOMIC_RELAXED);
+}
+
+void dict_store_destory(struct dict_store* store) {
+  free_version(store->current);
+  pthread_mutex_destroy(&store->lock);
+  free(store);
+}
@@ -0,0 +1,89 @@
+#ifndef DICT_STORE_H /* guard */
+#define DICT_STORE_H
+
+/*
+  Dictionary store.
+  Hold the dict and decode tree the server compresses with, and swap
+  in a new pair at runtime, read from the dictionary file again.
+
+  The pair is published RCU style: readers load the current version
+  without a lock, and a new version is published with one atomic store.
+  Every reader is counted in one of two epochs for as long as it uses
+  its version. A reload flips the epoch twice, waiting each time for
+  the readers of the epoch it left, so the old version is only freed
+  once no request can still use it. Requests in flight finish on the
+  version they started with.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "compression.h"
+
+/*a dict with its decode tree and dictionary file, never changed*/
+struct dict_version {
+  uint32_t id;  // dict->id
+  struct dict* dict;
+  struct decode_tree* tree;
+
+  uint8_t file[DICT_FILE_MAX];  // the dictionary file, as served
+  uint64_t file_len;
+};
+
+/*the published dictionary*/
+struct dict_store {
+  pthread_mutex_t lock;  // held by reloads
+  char* dict_path;
+
+  struct dict_version* current;
+  int epoch;                                        // 0 or 1
+  uint64_t readers[2] __attribute__((aligned(64)));  // by epoch
+  uint64_t reloads;
+};
+
+/*
+  initilize a dictionary store from the dictionary file at dict_path
+  return NULL if the dictionary can not be read or is malformed
+*/
+struct dict_store* dict_store_init(char* dict_path);
+
+/*
+  Get the current version, lock free.
+  *epoch is set to the epoch the reader is counted in,
+  give it back with dict_store_put once the version is not used
+*/
+struct dict_version* dict_store_get(struct dict_store* store, int* epoch);
+
+/*
+  Stop using the version got in epoch
+*/
+void dict_store_put(struct dict_store* store, int epoch);
+
+/*
+  Read the dictionary file again and publish it,
+  the old version is freed when its last reader is gone
+  return 0 if it was published, -1 if the file is malformed
+*/
+int dict_store_reload(struct dict_store* store);
+
+/*
+  Count the bytes of every regular file of directory_path,
+  and write the dictionary of huffman codes for them to dict_path,
+  replacing the old file at once
+  return the id of the new dict, or -1 if it can not be written
+*/
+int64_t dict_store_train(char* directory_path, char* dict_path);
+
+/*
+  Return the number of reloads published
+*/
+uint64_t dict_store_reloads(struct dict_store* store);
+
+/*
+  Free all memory usage of the store, no version may be held
+*/
+void dict_store_destory(struct dict_store* store);
+
+#endif //DICT_STORE_H
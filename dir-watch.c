@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "dir-watch.h"
+
+/* changes of the names in the directory */
+#define NAME_EVENTS                                                       \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+   IN_MOVE_SELF)
+
+/* events that end the watch of the directory */
+#define LOST_EVENTS (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_Q_OVERFLOW)
+
+/*
+  Watch thread, count the events of the directory into generations.
+  if the directory itself goes away, or the events can not be read,
+  the watch is no longer active
+*/
+static void* watch_directory(void* arg) {
+  struct dir_watch* watch = (struct dir_watch*)arg;
+  char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t n = read(watch->inotify_fd, events, sizeof(events));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    uint32_t mask = 0;
+    if (n <= 0) {
+      mask = IN_IGNORED;
+    }
+    for (char* p = events; p < events + n;) {
+      struct inotify_event* event = (struct inotify_event*)p;
+      mask |= event->mask;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+
+    if (mask & LOST_EVENTS) {
+      __atomic_store_n(&watch->active, 0, __ATOMIC_RELEASE);
+    }
+    if (mask & (NAME_EVENTS | LOST_EVENTS)) {
+      __atomic_fetch_add(&watch->names_gen, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&watch->files_gen, 1, __ATOMIC_RELEASE);
+
+    if (n <= 0) {
+      return NULL;
+    }
+  }
+}
+
+struct dir_watch* dir_watch_init(char* directory_path) {
+  struct dir_watch* watch =
+      (struct dir_watch*)calloc(1, sizeof(struct dir_watch));
+
+  watch->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (watch->inotify_fd >= 0 &&
+      inotify_add_watch(watch->inotify_fd, directory_path,
+                        NAME_EVENTS | IN_MODIFY | IN_ONLYDIR) >= 0 &&
+      pthread_create(&watch->thread, NULL, watch_directory, watch) == 0) {
+    watch->active = 1;
+  } else if (watch->inotify_fd >= 0) {
+    close(watch->inotify_fd);
+    watch->inotify_fd = -1;
+  }
+  return watch;
+}
+
+uint64_t dir_watch_generation(struct dir_watch* watch, int files) {
+  return __atomic_load_n(files ? &watch->files_gen : &watch->names_gen,
+                         __ATOMIC_ACQUIRE);
+}
+
+int dir_watch_valid(struct dir_watch* watch, int files, uint64_t gen) {
+  return __atomic_load_n(&watch->active, __ATOMIC_ACQUIRE) &&
+         dir_watch_generation(watch, files) == gen;
+}
+
+void dir_watch_destory(struct dir_watch* watch) {
+  // the thread runs, or has stopped, while the inotify fd is open
+  if (watch->inotify_fd >= 0) {
+    pthread_cancel(watch->thread);
+    pthread_join(watch->thread, NULL);
+    close(watch->inotify_fd);
+  }
+  free(watch);
+}
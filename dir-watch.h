@@ -0,0 +1,53 @@
+#ifndef DIR_WATCH_H /* guard */
+#define DIR_WATCH_H
+
+/*
+  Directory watch.
+  A thread reads inotify events of the served directory and counts
+  them into two generations, the caches built from the directory
+  compare them with the generation they were built at.
+
+  names_gen changes when a file is created, removed or renamed,
+  files_gen changes too when a file is written.
+  Events are counted a moment after the change, by the watch thread.
+  If the watch is lost, active is 0 and nothing can be trusted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*inotify watch of a directory*/
+struct dir_watch {
+  int inotify_fd;  // -1 if inotify is not available
+  pthread_t thread;
+
+  /* read and written atomically */
+  uint64_t names_gen;  // changes of the names in the directory
+  uint64_t files_gen;  // changes of the names or the content of files
+  int active;          // 1 while events are counted
+};
+
+/*
+  start watching directory_path,
+  the watch is never active if inotify is not available
+*/
+struct dir_watch* dir_watch_init(char* directory_path);
+
+/*
+  Return the generation of names, or of files if files is 1
+*/
+uint64_t dir_watch_generation(struct dir_watch* watch, int files);
+
+/*
+  Return 1 if a cache built at generation gen is still valid
+*/
+int dir_watch_valid(struct dir_watch* watch, int files, uint64_t gen);
+
+/*
+  Stop the watch thread and free all memory usage of watch
+*/
+void dir_watch_destory(struct dir_watch* watch);
+
+#endif //DIR_WATCH_H
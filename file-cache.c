@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "file-cache.h"
+
+/* where a SIGBUS returns to, set while this thread reads a mapping */
+static __thread sigjmp_buf* map_fault;
+
+/*
+  Return a SIGBUS raised in file_map_read() to it,
+  any other one still kills the process
+*/
+static void map_fault_handler(int sig) {
+  if (map_fault != NULL) {
+    siglongjmp(*map_fault, 1);
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/*
+  FNV-1a hash of a filename
+*/
+static uint32_t hash_filename(char* filename) {
+  uint32_t h = 2166136261u;
+  for (char* c = filename; *c != '\0'; c++) {
+    h ^= (uint8_t)*c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+  Return 1 if the handle was opened from the file described by st
+*/
+static int same_file(struct cached_file* handle, struct stat* st) {
+  return handle->dev == st->st_dev && handle->ino == st->st_ino &&
+         handle->size == (uint64_t)st->st_size &&
+         handle->mtime.tv_sec == st->st_mtim.tv_sec &&
+         handle->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+  Close the file of a handle and free it
+*/
+static void close_handle(struct cached_file* handle) {
+  if (handle->map != NULL) {
+    munmap(handle->map, handle->size);
+  }
+  close(handle->fd);
+  free(handle);
+}
+
+/*
+  Open filename relative to the cache directory into a new handle
+  return NULL if the file can not be opened
+*/
+static struct cached_file* open_handle(struct file_cache* cache,
+                                       char* filename) {
+  int fd = openat(cache->dir_fd, filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  struct cached_file* handle =
+      (struct cached_file*)calloc(1, sizeof(struct cached_file));
+  strncpy(handle->filename, filename, FILENAME_LEN - 1);
+  handle->fd = fd;
+  handle->size = st.st_size;
+  handle->dev = st.st_dev;
+  handle->ino = st.st_ino;
+  handle->mtime = st.st_mtim;
+
+  // an empty file can not be mapped, and mapping is only an optimization
+  if (cache->use_mmap && handle->size > 0) {
+    void* map = mmap(NULL, handle->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      handle->map = (uint8_t*)map;
+    }
+  }
+  return handle;
+}
+
+/*
+  Move a cached handle to the front of LRU list, the lock must be held
+*/
+static void lru_push_front(struct file_cache* cache,
+                           struct cached_file* handle) {
+  handle->lru_prev = NULL;
+  handle->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL) {
+    cache->lru_head->lru_prev = handle;
+  }
+  cache->lru_head = handle;
+  if (cache->lru_tail == NULL) {
+    cache->lru_tail = handle;
+  }
+}
+
+static void lru_unlink(struct file_cache* cache, struct cached_file* handle) {
+  if (handle->lru_prev != NULL) {
+    handle->lru_prev->lru_next = handle->lru_next;
+  } else {
+    cache->lru_head = handle->lru_next;
+  }
+  if (handle->lru_next != NULL) {
+    handle->lru_next->lru_prev = handle->lru_prev;
+  } else {
+    cache->lru_tail = handle->lru_prev;
+  }
+}
+
+/*
+  Remove a handle from the cache, the lock must be held.
+  it is closed now if nobody holds it, otherwise by the last put
+*/
+static void evict(struct file_cache* cache, struct cached_file* handle) {
+  struct cached_file** link =
+      &cache->buckets[hash_filename(handle->filename) &
+                      (FILE_CACHE_BUCKETS - 1)];
+  while (*link != handle) {
+    link = &(*link)->hash_next;
+  }
+  *link = handle->hash_next;
+  lru_unlink(cache, handle);
+
+  handle->cached = 0;
+  cache->count--;
+  if (handle->refs == 0) {
+    close_handle(handle);
+  }
+}
+
+/*
+  Find the cached handle of filename, the lock must be held
+*/
+static struct cached_file* lookup(struct file_cache* cache, char* filename) {
+  struct cached_file* handle =
+      cache->buckets[hash_filename(filename) & (FILE_CACHE_BUCKETS - 1)];
+  while (handle != NULL && strcmp(handle->filename, filename) != 0) {
+    handle = handle->hash_next;
+  }
+  return handle;
+}
+
+/*
+  initilize a file cache for files under directory_path
+  return NULL if the directory can not be opened
+*/
+struct file_cache* file_cache_init(char* directory_path,
+                                   int capacity,
+                                   int use_mmap) {
+  int dir_fd = open(directory_path, O_RDONLY | O_DIRECTORY);
+  if (dir_fd < 0) {
+    return NULL;
+  }
+
+  struct file_cache* cache =
+      (struct file_cache*)calloc(1, sizeof(struct file_cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->dir_fd = dir_fd;
+  cache->use_mmap = use_mmap;
+  cache->capacity = capacity;
+
+  if (use_mmap) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = map_fault_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+  }
+  return cache;
+}
+
+/*
+  Get a handle of filename, opening it if it is not cached
+  or it changed since it was cached
+  return NULL if the file can not be opened
+  return the handle with a reference held, give it back with file_cache_put
+*/
+struct cached_file* file_cache_get(struct file_cache* cache, char* filename) {
+  if (strlen(filename) >= FILENAME_LEN) {
+    return NULL;
+  }
+
+  // the current identity of the file decides if the cached handle is stale
+  struct stat st;
+  int found = fstatat(cache->dir_fd, filename, &st, 0) == 0;
+
+  pthread_mutex_lock(&cache->lock);
+  struct cached_file* handle = lookup(cache, filename);
+  if (handle != NULL && found && same_file(handle, &st)) {
+    handle->refs++;
+    lru_unlink(cache, handle);
+    lru_push_front(cache, handle);
+    pthread_mutex_unlock(&cache->lock);
+    return handle;
+  }
+  if (handle != NULL) {
+    evict(cache, handle);
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!found) {
+    return NULL;
+  }
+
+  // open outside the lock, another thread may cache the same file meanwhile
+  struct cached_file* opened = open_handle(cache, filename);
+  if (opened == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  handle = lookup(cache, filename);
+  if (handle != NULL) {
+    evict(cache, handle);
+  }
+  opened->refs = 1;
+  opened->cached = 1;
+  uint32_t bucket = hash_filename(filename) & (FILE_CACHE_BUCKETS - 1);
+  opened->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = opened;
+  lru_push_front(cache, opened);
+  cache->count++;
+
+  while (cache->count > cache->capacity) {
+    evict(cache, cache->lru_tail);
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return opened;
+}
+
+/*
+  Give back a reference of handle, it is closed if it was
+  evicted and this was the last reference
+*/
+void file_cache_put(struct file_cache* cache, struct cached_file* handle) {
+  pthread_mutex_lock(&cache->lock);
+  handle->refs--;
+  int unused = handle->refs == 0 && !handle->cached;
+  pthread_mutex_unlock(&cache->lock);
+
+  if (unused) {
+    close_handle(handle);
+  }
+}
+
+/*
+  Run read(arg), return -1 if a SIGBUS stopped it
+*/
+int file_map_read(int (*read)(void* arg), void* arg) {
+  // the signal mask is not saved, as it costs a system call each time,
+  // SIGBUS is unblocked again once the handler jumped back
+  sigjmp_buf fault;
+  if (sigsetjmp(fault, 0) != 0) {
+    map_fault = NULL;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    return -1;
+  }
+  map_fault = &fault;
+  int res = read(arg);
+  map_fault = NULL;
+  return res;
+}
+
+/*
+  Free all memory usage of file cache, no handle may be held
+*/
+void file_cache_destory(struct file_cache* cache) {
+  while (cache->lru_head != NULL) {
+    evict(cache, cache->lru_head);
+  }
+  close(cache->dir_fd);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
@@ -0,0 +1,96 @@
+#ifndef FILE_CACHE_H /* guard */
+#define FILE_CACHE_H
+
+/*
+  File handle cache.
+  Keep files under the served directory open, and optionally mapped,
+  so retrieve and size query do not open, seek and close each time.
+
+  Handles are reference counted and shared by all threads.
+  A handle is replaced when the inode or mtime of the file changes,
+  and the least recently used handles are closed beyond the capacity.
+
+  A mapped file may be truncated while its mapping is read, the pages
+  past the new end then raise SIGBUS. Mapped bytes are only read with
+  file_map_read(), which turns that SIGBUS into an error.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id-storage.h"
+
+#define FILE_CACHE_BUCKETS (256)  // hash buckets, power of 2
+
+/*an open file, valid until its last reference is put*/
+struct cached_file {
+  char filename[FILENAME_LEN];
+  int fd;
+  uint64_t size;
+  uint8_t* map;  // whole file mapped read only, NULL if not mapped
+
+  /* identity of the file when it was opened */
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+
+  int refs;    // references held by callers
+  int cached;  // 1 while the handle is in the cache
+
+  struct cached_file* hash_next;
+  struct cached_file* lru_prev;  // more recently used
+  struct cached_file* lru_next;  // less recently used
+};
+
+/*hash table of handles with a LRU list*/
+struct file_cache {
+  pthread_mutex_t lock;
+  int dir_fd;    // the served directory, files are opened relative to it
+  int use_mmap;  // map files when they are opened
+  int capacity;  // maximum number of cached handles
+  int count;     // number of cached handles
+
+  struct cached_file* buckets[FILE_CACHE_BUCKETS];
+  struct cached_file* lru_head;  // most recently used
+  struct cached_file* lru_tail;  // least recently used
+};
+
+/*
+  initilize a file cache for files under directory_path
+  return NULL if the directory can not be opened
+*/
+struct file_cache* file_cache_init(char* directory_path,
+                                   int capacity,
+                                   int use_mmap);
+
+/*
+  Get a handle of filename, opening it if it is not cached
+  or it changed since it was cached
+  return NULL if the file can not be opened
+  return the handle with a reference held, give it back with file_cache_put
+*/
+struct cached_file* file_cache_get(struct file_cache* cache, char* filename);
+
+/*
+  Give back a reference of handle, it is closed if it was
+  evicted and this was the last reference
+*/
+void file_cache_put(struct file_cache* cache, struct cached_file* handle);
+
+/*
+  Run read(arg), which reads bytes of the mapping of a cached file.
+  a SIGBUS raised by a page of the mapping past the end of a truncated
+  file stops read, the handler is set up by file_cache_init with use_mmap
+  return what read returns, or -1 if it was stopped
+*/
+int file_map_read(int (*read)(void* arg), void* arg);
+
+/*
+  Free all memory usage of file cache, no handle may be held
+*/
+void file_cache_destory(struct file_cache* cache);
+
+#endif //FILE_CACHE_H
@@ -1,14 +1,42 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "id-storage.h"
 
 /*
-  Generate a new entry based on the buffer and payload length
+  Mix the bits of a session id, so ids arriving in order
+  spread over all stripes and slots
 */
-struct id_entry* new_id_entry(uint8_t** buffer, int pl_len) {
-  struct id_entry* new_entry =
-      (struct id_entry*)malloc(sizeof(struct id_entry));
+static uint32_t hash_session_id(uint32_t session_id) {
+  uint32_t h = session_id;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/*
+  The stripe owning a session id, the low bits of the hash pick the
+  stripe and the remaining bits pick the slot
+*/
+static struct id_stripe* get_stripe(struct sessions* sessions,
+                                    uint32_t hash) {
+  return &sessions->stripes[hash % SESSION_STRIPES];
+}
+
+static uint32_t get_slot(struct id_stripe* stripe, uint32_t hash) {
+  return (hash / SESSION_STRIPES) & (stripe->capacity - 1);
+}
 
+/*
+  Generate a new entry based on the buffer and payload length,
+  the entry is taken from the pool of sessions
+*/
+struct id_entry* new_id_entry(struct sessions* sessions,
+                              uint8_t** buffer,
+                              int pl_len) {
   // get session id
   uint8_t session_id_arr[4];
   for (int i = 0; i < 4; i++) {
@@ -16,6 +44,22 @@ struct id_entry* new_id_entry(uint8_t** buffer, int pl_len) {
   }
   uint32_t session_id = *((uint32_t*)session_id_arr);
 
+  // take an entry from the pool of its stripe, grow the pool if empty
+  struct id_stripe* stripe = get_stripe(sessions, hash_session_id(session_id));
+  pthread_mutex_lock(&stripe->lock);
+  if (stripe->free_entries == NULL) {
+    struct id_chunk* chunk = (struct id_chunk*)malloc(sizeof(struct id_chunk));
+    chunk->next = stripe->chunks;
+    stripe->chunks = chunk;
+    for (int i = 0; i < SESSION_POOL_CHUNK; i++) {
+      chunk->entries[i].next = stripe->free_entries;
+      stripe->free_entries = &chunk->entries[i];
+    }
+  }
+  struct id_entry* new_entry = stripe->free_entries;
+  stripe->free_entries = new_entry->next;
+  pthread_mutex_unlock(&stripe->lock);
+
   // get starting offset
   uint8_t sta_off_arr[8];
   for (int i = 0; i < 8; i++) {
@@ -30,113 +74,225 @@ struct id_entry* new_id_entry(uint8_t** buffer, int pl_len) {
   }
   uint64_t len_to_read = *((uint64_t*)data_len_arr);
 
-  // get file name
-  char filename[FILENAME_LEN];
-  for (int i = 20; i < pl_len; i++) {
-    filename[i - 20] = (*buffer)[i + 9];
+  // get file name, the entry keeps its own copy
+  int filename_len = pl_len - 20;
+  if (filename_len > FILENAME_LEN - 1) {
+    filename_len = FILENAME_LEN - 1;
+  }
+  for (int i = 0; i < filename_len; i++) {
+    new_entry->filename[i] = (*buffer)[i + 20 + 9];
   }
+  new_entry->filename[filename_len] = '\0';
 
   // assign values
   new_entry->data_len = len_to_read;
-  new_entry->filename = filename;
   new_entry->session_id = session_id;
   new_entry->start_offset = starting_offset;
-
-  new_entry->left = NULL;
-  new_entry->right = NULL;
+  new_entry->next = NULL;
 
   return new_entry;
 }
 
 /*
-  initilize a session id storage tree
+  Give an entry back to the pool of its stripe,
+  the stripe lock must be held
+*/
+static void release_entry(struct id_stripe* stripe, struct id_entry* entry) {
+  entry->next = stripe->free_entries;
+  stripe->free_entries = entry;
+}
+
+/*
+  Give an entry which was not added back to the pool of sessions
+*/
+void destory_id_entry(struct sessions* sessions, struct id_entry* entry) {
+  struct id_stripe* stripe =
+      get_stripe(sessions, hash_session_id(entry->session_id));
+  pthread_mutex_lock(&stripe->lock);
+  release_entry(stripe, entry);
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+/*
+  initilize a session id storage table
 */
 struct sessions* session_id_storage_init() {
-  struct sessions* session = (struct sessions*)malloc(sizeof(struct sessions));
-  session->root = NULL;
+  struct sessions* session;
+  if (posix_memalign((void**)&session, 64, sizeof(struct sessions)) != 0) {
+    return NULL;
+  }
+
+  for (int i = 0; i < SESSION_STRIPES; i++) {
+    struct id_stripe* stripe = &session->stripes[i];
+    pthread_mutex_init(&stripe->lock, NULL);
+    stripe->capacity = SESSION_STRIPE_INIT;
+    stripe->count = 0;
+    stripe->slots =
+        (struct id_slot*)calloc(stripe->capacity, sizeof(struct id_slot));
+    stripe->free_entries = NULL;
+    stripe->chunks = NULL;
+  }
 
   return session;
 }
 
 /*
-  Use recursion to add a storage entry into storage tree
+  Double the slots of a stripe and re-insert every entry,
+  the stripe lock must be held
+*/
+static void grow_stripe(struct id_stripe* stripe) {
+  struct id_slot* old_slots = stripe->slots;
+  uint32_t old_capacity = stripe->capacity;
+
+  stripe->capacity *= 2;
+  stripe->slots =
+      (struct id_slot*)calloc(stripe->capacity, sizeof(struct id_slot));
+
+  for (uint32_t i = 0; i < old_capacity; i++) {
+    if (old_slots[i].entry == NULL) {
+      continue;
+    }
+    uint32_t slot = get_slot(stripe, hash_session_id(old_slots[i].session_id));
+    while (stripe->slots[slot].entry != NULL) {
+      slot = (slot + 1) & (stripe->capacity - 1);
+    }
+    stripe->slots[slot] = old_slots[i];
+  }
+  free(old_slots);
+}
+
+/*
+  Add a storage entry into storage table
   return -1 if found an entry with same session id
-  return 1 if suessfully add entry into tree
+  return 1 if suessfully add entry into table
 */
-int session_id_storage_add(struct id_entry** root, struct id_entry* entry) {
-  if ((*root) == NULL) {
-    (*root) = entry;
-    return 1;
+int session_id_storage_add(struct sessions* sessions, struct id_entry* entry) {
+  uint32_t hash = hash_session_id(entry->session_id);
+  struct id_stripe* stripe = get_stripe(sessions, hash);
+
+  pthread_mutex_lock(&stripe->lock);
+
+  // keep the load factor under 3/4
+  if ((stripe->count + 1) * 4 > stripe->capacity * 3) {
+    grow_stripe(stripe);
   }
 
-  if ((*root)->session_id < entry->session_id) {
-    return session_id_storage_add(&((*root)->left), entry);
-  } else if ((*root)->session_id > entry->session_id) {
-    return session_id_storage_add(&((*root)->right), entry);
-  } else {
-    return -1;
+  uint32_t slot = get_slot(stripe, hash);
+  while (stripe->slots[slot].entry != NULL) {
+    if (stripe->slots[slot].session_id == entry->session_id) {
+      pthread_mutex_unlock(&stripe->lock);
+      return -1;
+    }
+    slot = (slot + 1) & (stripe->capacity - 1);
   }
+  stripe->slots[slot].session_id = entry->session_id;
+  stripe->slots[slot].entry = entry;
+  stripe->count++;
+
+  pthread_mutex_unlock(&stripe->lock);
+  return 1;
 }
 
 /*
-  Use recursion to remove a entry with the same session id
+  Remove the entry with the session id, and give it back to the pool
   return -1 if not found such entry
   return 1 if found and remove such entry
 */
-int session_id_storage_remove(struct id_entry** root, struct id_entry* entry) {
-  if (root == NULL) {
+int session_id_storage_remove(struct sessions* sessions, uint32_t session_id) {
+  uint32_t hash = hash_session_id(session_id);
+  struct id_stripe* stripe = get_stripe(sessions, hash);
+
+  pthread_mutex_lock(&stripe->lock);
+  uint32_t mask = stripe->capacity - 1;
+
+  uint32_t slot = get_slot(stripe, hash);
+  while (stripe->slots[slot].entry != NULL &&
+         stripe->slots[slot].session_id != session_id) {
+    slot = (slot + 1) & mask;
+  }
+  if (stripe->slots[slot].entry == NULL) {
+    pthread_mutex_unlock(&stripe->lock);
     return -1;  // not found
   }
 
-  if ((*root)->session_id < entry->session_id) {
-    return session_id_storage_remove(&((*root)->left), entry);
-  } else if ((*root)->session_id > entry->session_id) {
-    return session_id_storage_remove(&((*root)->right), entry);
-  } else {
-    free((*root));
-    (*root) = NULL;
-    return 1;  // found and removed
+  release_entry(stripe, stripe->slots[slot].entry);
+  stripe->slots[slot].entry = NULL;
+  stripe->count--;
+
+  // shift back the following entries of the probe run,
+  // so lookups never stop early at the hole
+  uint32_t hole = slot;
+  uint32_t next = (slot + 1) & mask;
+  while (stripe->slots[next].entry != NULL) {
+    uint32_t home =
+        get_slot(stripe, hash_session_id(stripe->slots[next].session_id));
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      stripe->slots[hole] = stripe->slots[next];
+      stripe->slots[next].entry = NULL;
+      hole = next;
+    }
+    next = (next + 1) & mask;
   }
+
+  pthread_mutex_unlock(&stripe->lock);
+  return 1;  // found and removed
 }
 
 /*
-  Use recursion to get the entry which a specific session id
-  return NULL if not found 
-  return pointer to the entry if found
+  Get a copy of the entry with a specific session id into entry
+  return -1 if not found
+  return 1 if found
 */
-struct id_entry* session_id_storage_get(struct id_entry** root,
-                                        uint64_t session_id) {
-  if ((*root) == NULL) {
-    return NULL;  // not found
-  }
+int session_id_storage_get(struct sessions* sessions,
+                           uint32_t session_id,
+                           struct id_entry* entry) {
+  uint32_t hash = hash_session_id(session_id);
+  struct id_stripe* stripe = get_stripe(sessions, hash);
+  int res = -1;
 
-  if ((*root)->session_id < session_id) {
-    return session_id_storage_get(&((*root)->left), session_id);
-  } else if ((*root)->session_id > session_id) {
-    return session_id_storage_get(&((*root)->right), session_id);
-  } else {
-    return (*root);  // found and return
+  pthread_mutex_lock(&stripe->lock);
+  uint32_t slot = get_slot(stripe, hash);
+  while (stripe->slots[slot].entry != NULL) {
+    if (stripe->slots[slot].session_id == session_id) {
+      memcpy(entry, stripe->slots[slot].entry, sizeof(struct id_entry));
+      res = 1;
+      break;
+    }
+    slot = (slot + 1) & (stripe->capacity - 1);
   }
+  pthread_mutex_unlock(&stripe->lock);
+
+  return res;
 }
 
 /*
-  A recursion function to recursively free memory
-  from root of tree
+  return the number of sessions stored in the table
 */
-void destory_helper(struct id_entry* root) {
-  if (root == NULL) {
-    return;
+uint64_t session_id_storage_count(struct sessions* sessions) {
+  uint64_t count = 0;
+  for (int i = 0; i < SESSION_STRIPES; i++) {
+    struct id_stripe* stripe = &sessions->stripes[i];
+    pthread_mutex_lock(&stripe->lock);
+    count += stripe->count;
+    pthread_mutex_unlock(&stripe->lock);
   }
-
-  destory_helper(root->left);
-  destory_helper(root->right);
-
-  free(root);
+  return count;
 }
 
 /*
-  Free all memory usage of session id tree
+  Free all memory usage of session id table
 */
 void session_id_storage_destory(struct sessions* session) {
-  destory_helper(session->root);
-}
\ No newline at end of file
+  for (int i = 0; i < SESSION_STRIPES; i++) {
+    struct id_stripe* stripe = &session->stripes[i];
+    struct id_chunk* chunk = stripe->chunks;
+    while (chunk != NULL) {
+      struct id_chunk* next = chunk->next;
+      free(chunk);
+      chunk = next;
+    }
+    free(stripe->slots);
+    pthread_mutex_destroy(&stripe->lock);
+  }
+  free(session);
+}
@@ -3,70 +3,114 @@
 
 /*
   Session id storage.
-  The storage is a binary tree data structure.
+  The storage is a hash table with open addressing, split into
+  stripes that each have their own lock, table and entry pool.
 
   Session id and some transfer information can be
-  globally stored in the tree
+  globally stored in the table, and shared by all threads
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "timer-wheel.h"
 
 
 #define FILENAME_LEN (200)
+#define SESSION_STRIPES (64)         // number of independently locked stripes
+#define SESSION_STRIPE_INIT (64)     // initial slots of a stripe, power of 2
+#define SESSION_POOL_CHUNK (64)      // entries allocated at once by a pool
 
-/*the entry of tree*/
+/*the entry of table*/
 struct id_entry {
-  char* filename;
+  char filename[FILENAME_LEN];
   uint32_t session_id;
   uint64_t start_offset;
   uint64_t data_len;
+  struct timer timer;  // expires the entry once added, if armed
 
-  struct id_entry* left;
-  struct id_entry* right;
+  struct id_entry* next;  // next free entry, while in the pool
 };
 
-/*binary tree*/
+/*a block of entries owned by a stripe pool*/
+struct id_chunk {
+  struct id_chunk* next;
+  struct id_entry entries[SESSION_POOL_CHUNK];
+};
+
+/*slot of a stripe table, empty if entry is NULL*/
+struct id_slot {
+  uint32_t session_id;
+  struct id_entry* entry;
+};
+
+/*one stripe: a linear probing table and the pool of its entries*/
+struct id_stripe {
+  pthread_mutex_t lock;
+
+  struct id_slot* slots;
+  uint32_t capacity;  // number of slots, power of 2
+  uint32_t count;     // number of used slots
+
+  struct id_entry* free_entries;
+  struct id_chunk* chunks;
+} __attribute__((aligned(64)));
+
+/*hash table*/
 struct sessions {
-  struct id_entry* root;
+  struct id_stripe stripes[SESSION_STRIPES];
 };
 
 /*
-  Generate a new entry based on the buffer and payload length
+  Generate a new entry based on the buffer and payload length,
+  the entry is taken from the pool of sessions
+*/
+struct id_entry* new_id_entry(struct sessions* sessions,
+                              uint8_t** buffer,
+                              int pl_len);
+
+/*
+  Give an entry which was not added back to the pool of sessions
 */
-struct id_entry* new_id_entry(uint8_t** buffer, int pl_len);
+void destory_id_entry(struct sessions* sessions, struct id_entry* entry);
 
 /*
-  initilize a session id storage tree
+  initilize a session id storage table
 */
 struct sessions* session_id_storage_init();
 
 /*
-  Use recursion to add a storage entry into storage tree
+  Add a storage entry into storage table
   return -1 if found an entry with same session id
-  return 1 if suessfully add entry into tree
+  return 1 if suessfully add entry into table
 */
-int session_id_storage_add(struct id_entry** root, struct id_entry* entry);
+int session_id_storage_add(struct sessions* sessions, struct id_entry* entry);
 
 /*
-  Use recursion to remove a entry with the same session id
+  Remove the entry with the session id, and give it back to the pool
   return -1 if not found such entry
   return 1 if found and remove such entry
 */
-int session_id_storage_remove(struct id_entry** root, struct id_entry* entry);
+int session_id_storage_remove(struct sessions* sessions, uint32_t session_id);
+
+/*
+  Get a copy of the entry with a specific session id into entry
+  return -1 if not found
+  return 1 if found
+*/
+int session_id_storage_get(struct sessions* sessions,
+                           uint32_t session_id,
+                           struct id_entry* entry);
 
 /*
-  Use recursion to get the entry which a specific session id
-  return NULL if not found 
-  return pointer to the entry if found
+  return the number of sessions stored in the table
 */
-struct id_entry* session_id_storage_get(struct id_entry** root,
-                                        uint64_t session_id);
+uint64_t session_id_storage_count(struct sessions* sessions);
 
 /*
-  Free all memory usage of session id tree
+  Free all memory usage of session id table
 */
 void session_id_storage_destory(struct sessions* session);
 
-#endif //ID_STORAGE_H
\ No newline at end of file
+#endif //ID_STORAGE_H
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <endian.h>
+#include "bitwise.h"
+#include "listing-cache.h"
+
+#define LISTING_INIT_LEN (1024)  // first size of the listing buffer
+
+/*
+  Write the header of a listing response with payload length
+*/
+static void listing_header(uint8_t* buffer, uint64_t pl_len, int compressed) {
+  buffer[0] = 0x00;
+  buffer[0] = modify_bit(buffer[0], 5, 1);  // type 0x3
+  buffer[0] = modify_bit(buffer[0], 4, 1);
+  buffer[0] = modify_bit(buffer[0], 3, compressed);
+
+  uint64_t pl_len_in64 = htobe64(pl_len);
+  memcpy(&buffer[1], &pl_len_in64, sizeof(uint64_t));
+}
+
+/*
+  Read the regular files of the directory into a new listing,
+  the buffer grows with the names
+*/
+static struct dir_listing* build_listing(struct listing_cache* cache) {
+  // a change while reading makes the new listing stale at once
+  uint64_t gen = dir_watch_generation(cache->watch, 0);
+
+  uint64_t cap = LISTING_INIT_LEN;
+  uint64_t len = 9;
+  uint8_t* raw = (uint8_t*)malloc(cap);
+
+  DIR* d = opendir(cache->directory_path);
+  if (d) {
+    struct dirent* dir;
+    while ((dir = readdir(d)) != NULL) {
+      if (dir->d_type != DT_REG) {
+        continue;
+      }
+      uint64_t name_len = strlen(dir->d_name) + 1;
+      if (len + name_len > cap) {
+        while (len + name_len > cap) {
+          cap *= 2;
+        }
+        raw = (uint8_t*)realloc(raw, cap);
+      }
+      memcpy(&raw[len], dir->d_name, name_len);
+      len += name_len;
+    }
+    closedir(d);
+  }
+
+  struct dir_listing* listing =
+      (struct dir_listing*)calloc(1, sizeof(struct dir_listing));
+
+  // directory is empty, a signle null payload
+  if (len == 9) {
+    raw[len++] = 0x00;
+    listing->empty = 1;
+  }
+  listing_header(raw, len - 9, 0);
+
+  listing->raw = raw;
+  listing->raw_len = len;
+  listing->gen = gen;
+  listing->refs = 1;  // held by the cache
+  return listing;
+}
+
+/*
+  Compress the names of a listing into its compressed response,
+  and decide with pays if it is sent
+*/
+static void build_compressed(struct dir_listing* listing,
+                             struct dict* dict,
+                             int (*pays)(uint64_t plain_len,
+                                         uint64_t encoded_len)) {
+  uint64_t pl_len = listing->raw_len - 9;
+  uint64_t comp_len = compress_len(dict, &listing->raw[9], pl_len);
+  uint8_t* comp = (uint8_t*)malloc(comp_len + 9);
+  pl_len = compress(dict, &comp, &listing->raw, pl_len);
+  listing_header(comp, pl_len, 1);
+
+  listing->comp_len = pl_len + 9;
+  listing->comp = comp;
+  listing->dict_id = dict->id;
+  listing->comp_pays = pays(listing->raw_len - 9, pl_len);
+}
+
+/*
+  Drop a reference of listing, the lock must be held
+  return 1 if it was the last reference
+*/
+static int listing_unref(struct dir_listing* listing) {
+  return --listing->refs == 0;
+}
+
+/*
+  Free a listing that has no reference
+*/
+static void free_listing(struct dir_listing* listing) {
+  free(listing->raw);
+  free(listing->comp);
+  free(listing);
+}
+
+struct listing_cache* listing_cache_init(char* directory_path,
+                                         struct dir_watch* watch) {
+  struct listing_cache* cache =
+      (struct listing_cache*)calloc(1, sizeof(struct listing_cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->directory_path = directory_path;
+  cache->watch = watch;
+  return cache;
+}
+
+struct dir_listing* listing_cache_get(struct listing_cache* cache,
+                                      int compressed,
+                                      struct dict* dict,
+                                      int (*pays)(uint64_t plain_len,
+                                                  uint64_t encoded_len)) {
+  pthread_mutex_lock(&cache->lock);
+
+  // comp is never replaced while it may be sent, the listing is
+  if (cache->current == NULL ||
+      !dir_watch_valid(cache->watch, 0, cache->current->gen) ||
+      (compressed && cache->current->comp != NULL &&
+       cache->current->dict_id != dict->id)) {
+    struct dir_listing* old = cache->current;
+    cache->current = build_listing(cache);
+    if (old != NULL && listing_unref(old)) {
+      free_listing(old);
+    }
+  }
+
+  struct dir_listing* listing = cache->current;
+  if (compressed && !listing->empty && listing->comp == NULL) {
+    build_compressed(listing, dict, pays);
+  }
+  listing->refs++;
+
+  pthread_mutex_unlock(&cache->lock);
+  return listing;
+}
+
+void listing_cache_put(struct listing_cache* cache,
+                       struct dir_listing* listing) {
+  if (listing == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+  int last = listing_unref(listing);
+  pthread_mutex_unlock(&cache->lock);
+
+  if (last) {
+    free_listing(listing);
+  }
+}
+
+void listing_cache_destory(struct listing_cache* cache) {
+  if (cache->current != NULL) {
+    free_listing(cache->current);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
@@ -0,0 +1,82 @@
+#ifndef LISTING_CACHE_H /* guard */
+#define LISTING_CACHE_H
+
+/*
+  Directory listing cache.
+  Keep the listing response of the served directory ready to send,
+  header included, and the compressed response once it is asked for.
+
+  The listing is only rebuilt by the next request after the directory
+  watch sees a name change, or when compression is asked with another
+  dict than the one of the compressed response. Listings are reference
+  counted, so a rebuild does not free a listing that is still being sent.
+  Without an active watch the listing is rebuilt by every request.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "compression.h"
+#include "dir-watch.h"
+
+/*a listing response, never changed once built, except comp*/
+struct dir_listing {
+  uint8_t* raw;     // header and names, each followed by a null byte
+  uint64_t raw_len; // bytes of raw to send
+  uint8_t* comp;    // compressed response, NULL until asked for
+  uint64_t comp_len;
+  uint32_t dict_id; // of the dict comp is compressed with
+  int comp_pays;    // comp is sent, decided once it is built
+  int empty;        // the directory has no regular file
+  uint64_t gen;     // names generation of the watch it was built at
+
+  int refs;  // references held by the cache and callers
+};
+
+/*the current listing of a directory*/
+struct listing_cache {
+  pthread_mutex_t lock;
+  char* directory_path;
+
+  struct dir_watch* watch;
+  struct dir_listing* current;  // NULL until the first request
+};
+
+/*
+  initilize a listing cache of directory_path, kept valid by watch,
+  the listing is built by the first request
+*/
+struct listing_cache* listing_cache_init(char* directory_path,
+                                         struct dir_watch* watch);
+
+/*
+  Get the current listing, rebuilding it if the directory changed.
+  if compressed is 1 the compressed response is built too with dict,
+  unless the directory is empty, which is always sent uncompressed.
+  pays is called once the compressed response is built, with the
+  payload lengths, and decides if it is sent
+  return the listing with a reference held, give it back with
+  listing_cache_put
+*/
+struct dir_listing* listing_cache_get(struct listing_cache* cache,
+                                      int compressed,
+                                      struct dict* dict,
+                                      int (*pays)(uint64_t plain_len,
+                                                  uint64_t encoded_len));
+
+/*
+  Give back a reference of listing, it is freed if it was
+  replaced and this was the last reference
+*/
+void listing_cache_put(struct listing_cache* cache,
+                       struct dir_listing* listing);
+
+/*
+  Free all memory usage of listing cache, no listing may be held,
+  the watch is not freed
+*/
+void listing_cache_destory(struct listing_cache* cache);
+
+#endif //LISTING_CACHE_H
@@ -0,0 +1,781 @@
+/*
+    Load generator for the C socket server!!
+
+    Open connections to a running server, keep a number of requests
+    in flight on each of them, and report the throughput and the
+    latency percentiles of the responses.
+
+    Build:
+        gcc -O2 -pthread -o load-generator load-generator.c \
+            compression.c bitwise.c -lm
+    Run, with the configuration file of the server:
+        ./load-generator -c 8 -d 4 -m echo:4,size:4,retrieve:1 config
+
+    Options:
+        -c conns     connections, each has a sender and a receiver thread
+        -d depth     requests in flight on each connection (pipelining)
+        -t seconds   duration of the run, default 5
+        -n requests  stop each connection after this many requests instead
+        -m mix       request types with weights, e.g. echo:3,list:1,
+                     size:4,retrieve:2,stats:1,dict:1
+                     (a missing weight is 1)
+        -s sizes     echo payload and retrieve range length, one of
+                     N, uniform:A:B or exp:MEAN (bytes), default 64
+        -z           ask the server to compress responses
+        -Z           compress echo and retrieve payloads sent
+        -4           use the multi stream format for -z and -Z
+    Size query and retrieve use the regular files listed by the server,
+    payloads are compressed with the dictionary the server serves.
+*/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <malloc.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "bitwise.h"
+#include "compression.h"
+
+#define DICT_PATH ("compression.dict")  // the path of dictionary
+#define DEPTH_MAX (256)                 // most requests in flight
+#define MIX_MAX (6)                     // request types in a mix
+#define FILES_MAX (1024)                // files used by size and retrieve
+#define FILENAME_LEN (200)              // longest filename, with null byte
+#define HIST_SUB_BITS (4)               // linear buckets per power of 2
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+/* payload size distributions */
+#define DIST_FIXED (0)
+#define DIST_UNIFORM (1)
+#define DIST_EXP (2)
+
+/*a request type of the mix and how often it is sent*/
+struct mix_entry {
+  int type;
+  int weight;
+};
+
+/*distribution of echo payload and retrieve range lengths*/
+struct size_dist {
+  int kind;  // DIST_FIXED, DIST_UNIFORM or DIST_EXP
+  uint64_t a;  // the size, the lowest size or the mean size
+  uint64_t b;  // the highest size of DIST_UNIFORM
+};
+
+/*a regular file of the served directory*/
+struct served_file {
+  char name[FILENAME_LEN];
+  uint64_t size;
+};
+
+/*
+ * log-linear histogram of latencies in ns,
+ * every power of 2 is split into 1 << HIST_SUB_BITS buckets
+ */
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t max;
+};
+
+/*
+ * this is all the options of a run, shared by all threads
+ */
+struct options {
+  struct sockaddr_in address;
+  int conns;
+  int depth;
+  double duration;
+  uint64_t requests;  // per connection, 0 if the run is timed
+
+  struct mix_entry mix[MIX_MAX];
+  int mix_n;
+  int mix_weight;  // sum of weights
+
+  struct size_dist sizes;
+  int req_comp;
+  int send_comp;
+  int multi;
+
+  struct dict* dict;
+  struct served_file* files;
+  int files_n;
+};
+
+/*
+ * this store the state of one connection,
+ * the sender records the start of each request in ring,
+ * and the receiver takes them in the same order
+ */
+struct connection {
+  int sock;
+  uint64_t rng;
+  sem_t credits;  // requests that can still be sent
+
+  uint64_t ring[DEPTH_MAX];  // start time of requests in flight
+  uint64_t sent;             // requests sent
+  uint64_t received;         // responses received
+  int closed;                // set when the server closed the connection
+
+  /* counted by the receiver */
+  struct histogram hist;
+  uint64_t errors;
+  uint64_t bytes_sent;
+  uint64_t bytes_recv;
+};
+
+struct options opts;
+int stop;  // set when the run is over, read atomically
+
+/*
+ * Return the time of a monotonic clock in ns
+ */
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * xorshift64*, one generator per connection
+ */
+uint64_t next_random(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dull;
+}
+
+/*
+ * Given a distribution, return a random size from it
+ */
+uint64_t random_size(struct size_dist* dist, uint64_t* rng) {
+  switch (dist->kind) {
+    case DIST_UNIFORM:
+      return dist->a + next_random(rng) % (dist->b - dist->a + 1);
+    case DIST_EXP: {
+      double u = (double)(next_random(rng) >> 11) / (double)(1ull << 53);
+      return (uint64_t)(-log(1.0 - u) * (double)dist->a);
+    }
+    default:
+      return dist->a;
+  }
+}
+
+/*
+ * Given a latency in ns, return its bucket of the histogram
+ */
+int hist_index(uint64_t ns) {
+  if (ns < (1u << HIST_SUB_BITS)) {
+    return (int)ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int e = msb - HIST_SUB_BITS + 1;
+  return (e << HIST_SUB_BITS) +
+         (int)((ns >> (e - 1)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+/*
+ * Given a bucket of the histogram, return the highest latency in it
+ */
+uint64_t hist_value(int index) {
+  int e = index >> HIST_SUB_BITS;
+  uint64_t m = index & ((1u << HIST_SUB_BITS) - 1);
+  if (e == 0) {
+    return m;
+  }
+  return (((1ull << HIST_SUB_BITS) + m + 1) << (e - 1)) - 1;
+}
+
+void hist_add(struct histogram* hist, uint64_t ns) {
+  hist->counts[hist_index(ns)]++;
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+}
+
+/*
+ * Given a merged histogram, return the latency below which
+ * a fraction q of the responses are
+ */
+uint64_t hist_percentile(struct histogram* hist, uint64_t total, double q) {
+  uint64_t rank = (uint64_t)ceil(q * (double)total);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t value = hist_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+/*
+ * Given a buffer, return the payload length
+ */
+uint64_t get_payload_length(uint8_t* buffer) {
+  uint64_t pl_len_in64;
+  memcpy(&pl_len_in64, &buffer[1], sizeof(uint64_t));
+  return be64toh(pl_len_in64);
+}
+
+/*
+ * Given a size, set up payload length into buffer
+ */
+void modify_payload_len(uint8_t* buffer, uint64_t size) {
+  uint64_t pl_len_in64 = htobe64(size);
+  memcpy(&buffer[1], &pl_len_in64, sizeof(uint64_t));
+}
+
+/*
+ * Send all len bytes of buffer
+ * return 0 if sent, -1 if the connection is broken
+ */
+int send_all(int sock, uint8_t* buffer, uint64_t len) {
+  while (len > 0) {
+    ssize_t n = send(sock, buffer, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buffer += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Receive len bytes into buffer
+ * return 0 if received, -1 if the connection is closed or broken
+ */
+int recv_all(int sock, uint8_t* buffer, uint64_t len) {
+  while (len > 0) {
+    ssize_t n = recv(sock, buffer, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buffer += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Receive one response into *buffer, growing it to the payload
+ * return the payload length, or -1 if the connection is closed
+ */
+int64_t recv_response(int sock, uint8_t** buffer, uint64_t* cap) {
+  if (recv_all(sock, *buffer, 9) < 0) {
+    return -1;
+  }
+  uint64_t pl_len = get_payload_length(*buffer);
+  if (pl_len + 9 > *cap) {
+    *cap = pl_len + 9;
+    *buffer = (uint8_t*)realloc(*buffer, *cap);
+  }
+  if (recv_all(sock, &(*buffer)[9], pl_len) < 0) {
+    return -1;
+  }
+  return (int64_t)pl_len;
+}
+
+/*
+ * Open a connection to the server
+ * return the socket, or -1 if the server can not be reached
+ */
+int connect_server() {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr*)&opts.address,
+              sizeof(opts.address)) < 0) {
+    close(sock);
+    return -1;
+  }
+  int option = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(int));
+  return sock;
+}
+
+/*
+ * Build a request of type into *buffer, growing it if needed
+ * return the number of bytes to send
+ */
+uint64_t build_request(int type,
+                       uint8_t** buffer,
+                       uint64_t* cap,
+                       uint64_t* rng) {
+  uint64_t pl_len = 0;
+  struct served_file* file = NULL;
+  if (type == 0x4 || type == 0x6) {
+    file = &opts.files[next_random(rng) % opts.files_n];
+  }
+
+  // the longest payload, a whole echo or a retrieve with its filename
+  uint64_t size = 0;
+  if (type == 0x0 || type == 0x6) {
+    size = random_size(&opts.sizes, rng);
+  }
+  if (size + 20 + FILENAME_LEN + 9 > *cap) {
+    *cap = size + 20 + FILENAME_LEN + 9;
+    *buffer = (uint8_t*)realloc(*buffer, *cap);
+  }
+  uint8_t* payload = &(*buffer)[9];
+
+  switch (type) {
+    case 0x0:
+      // printable text, so the dict has something to work on
+      for (uint64_t i = 0; i < size; i++) {
+        payload[i] = 'a' + next_random(rng) % 26;
+      }
+      pl_len = size;
+      break;
+    case 0x4:
+      pl_len = strlen(file->name) + 1;
+      memcpy(payload, file->name, pl_len);
+      break;
+    case 0x6: {
+      uint64_t len = size < file->size ? size : file->size;
+      uint64_t offset = next_random(rng) % (file->size - len + 1);
+      uint32_t session_id = htonl((uint32_t)next_random(rng));
+      uint64_t offset_in64 = htobe64(offset);
+      uint64_t len_in64 = htobe64(len);
+      memcpy(&payload[0], &session_id, 4);
+      memcpy(&payload[4], &offset_in64, 8);
+      memcpy(&payload[12], &len_in64, 8);
+      pl_len = 20 + strlen(file->name) + 1;
+      memcpy(&payload[20], file->name, strlen(file->name) + 1);
+      break;
+    }
+  }
+
+  (*buffer)[0] = type << 4;
+  modify_payload_len(*buffer, pl_len);
+
+  if (opts.send_comp && (type == 0x0 || type == 0x6)) {
+    uint8_t* copy = (uint8_t*)malloc(pl_len + 9);
+    memcpy(copy, *buffer, pl_len + 9);
+    if (opts.multi) {
+      pl_len = compress_multi(opts.dict, buffer, &copy, pl_len);
+    } else {
+      pl_len = compress(opts.dict, buffer, &copy, pl_len);
+    }
+    free(copy);
+    (*buffer)[0] = modify_bit(type << 4, 3, 1);
+    if (malloc_usable_size(*buffer) > *cap) {
+      *cap = malloc_usable_size(*buffer);
+    }
+  }
+  if (opts.req_comp) {
+    (*buffer)[0] = modify_bit((*buffer)[0], 2, 1);
+  }
+  if (opts.multi) {
+    (*buffer)[0] = modify_bit((*buffer)[0], 1, 1);
+  }
+  return pl_len + 9;
+}
+
+/*
+ * Given a weighted mix, return a random type from it
+ */
+int random_type(uint64_t* rng) {
+  int pick = next_random(rng) % opts.mix_weight;
+  for (int i = 0; i < opts.mix_n; i++) {
+    if (pick < opts.mix[i].weight) {
+      return opts.mix[i].type;
+    }
+    pick -= opts.mix[i].weight;
+  }
+  return opts.mix[0].type;
+}
+
+/*
+ * Sender thread of a connection, send a request whenever
+ * a response frees a slot, until the run is over.
+ * the write side is shut down at the end, so the receiver
+ * sees the connection close after the last response
+ */
+void* sender(void* arg) {
+  struct connection* conn = (struct connection*)arg;
+  uint64_t cap = 1024;
+  uint8_t* buffer = (uint8_t*)malloc(cap);
+
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) &&
+         !__atomic_load_n(&conn->closed, __ATOMIC_RELAXED)) {
+    if (opts.requests > 0 && conn->sent == opts.requests) {
+      break;
+    }
+    sem_wait(&conn->credits);
+    if (__atomic_load_n(&conn->closed, __ATOMIC_RELAXED)) {
+      break;
+    }
+
+    uint64_t len =
+        build_request(random_type(&conn->rng), &buffer, &cap, &conn->rng);
+    __atomic_store_n(&conn->ring[conn->sent % opts.depth], now_ns(),
+                     __ATOMIC_RELEASE);
+    if (send_all(conn->sock, buffer, len) < 0) {
+      break;
+    }
+    conn->sent++;
+    __atomic_fetch_add(&conn->bytes_sent, len, __ATOMIC_RELAXED);
+  }
+
+  shutdown(conn->sock, SHUT_WR);
+  free(buffer);
+  return NULL;
+}
+
+/*
+ * Connection thread, start the sender and receive responses
+ * until the server closes the connection
+ */
+void* receiver(void* arg) {
+  struct connection* conn = (struct connection*)arg;
+  uint64_t cap = 1024;
+  uint8_t* buffer = (uint8_t*)malloc(cap);
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, sender, conn);
+
+  int64_t pl_len;
+  while ((pl_len = recv_response(conn->sock, &buffer, &cap)) >= 0) {
+    uint64_t start = __atomic_load_n(&conn->ring[conn->received % opts.depth],
+                                     __ATOMIC_ACQUIRE);
+    hist_add(&conn->hist, now_ns() - start);
+    conn->received++;
+    conn->bytes_recv += pl_len + 9;
+    if (buffer[0] == 0xf0) {
+      conn->errors++;
+    }
+    sem_post(&conn->credits);
+  }
+
+  // unblock the sender if the server closed the connection first
+  __atomic_store_n(&conn->closed, 1, __ATOMIC_RELAXED);
+  sem_post(&conn->credits);
+  pthread_join(tid, NULL);
+  free(buffer);
+  return NULL;
+}
+
+/*
+ * Ask the server for the regular files it serves, and their size
+ * return the number of files, or -1 if the server can not be reached
+ */
+int discover_files() {
+  int sock = connect_server();
+  if (sock < 0) {
+    return -1;
+  }
+  uint64_t cap = 1024;
+  uint8_t* buffer = (uint8_t*)malloc(cap);
+
+  // directory listing, names are separated by null bytes
+  memset(buffer, 0, 9);
+  buffer[0] = 0x20;
+  int64_t pl_len = -1;
+  if (send_all(sock, buffer, 9) == 0) {
+    pl_len = recv_response(sock, &buffer, &cap);
+  }
+  char* names = NULL;
+  if (pl_len > 0) {
+    names = (char*)malloc(pl_len);
+    memcpy(names, &buffer[9], pl_len);
+  }
+
+  opts.files = (struct served_file*)calloc(FILES_MAX, sizeof(*opts.files));
+  opts.files_n = 0;
+  for (int64_t i = 0; i < pl_len && opts.files_n < FILES_MAX;) {
+    uint64_t name_len = strnlen(&names[i], pl_len - i);
+    if (name_len == 0 || name_len >= FILENAME_LEN) {
+      i += name_len + 1;
+      continue;
+    }
+    struct served_file* file = &opts.files[opts.files_n];
+    memcpy(file->name, &names[i], name_len);
+    i += name_len + 1;
+
+    // size query
+    buffer[0] = 0x40;
+    modify_payload_len(buffer, name_len + 1);
+    memcpy(&buffer[9], file->name, name_len + 1);
+    if (send_all(sock, buffer, name_len + 10) < 0 ||
+        recv_response(sock, &buffer, &cap) != 8 || buffer[0] != 0x50) {
+      continue;
+    }
+    uint64_t size_in64;
+    memcpy(&size_in64, &buffer[9], 8);
+    file->size = be64toh(size_in64);
+    opts.files_n++;
+  }
+
+  free(names);
+  free(buffer);
+  close(sock);
+  return opts.files_n;
+}
+
+/*
+ * Ask the server for the dictionary it compresses with
+ * return the dict, or NULL if the server can not be reached
+ */
+struct dict* fetch_dict() {
+  int sock = connect_server();
+  if (sock < 0) {
+    return NULL;
+  }
+  uint64_t cap = 1024;
+  uint8_t* buffer = (uint8_t*)malloc(cap);
+
+  // the payload is the dict id followed by the dictionary file
+  memset(buffer, 0, 9);
+  buffer[0] = 0xc0;
+  int64_t pl_len = -1;
+  if (send_all(sock, buffer, 9) == 0) {
+    pl_len = recv_response(sock, &buffer, &cap);
+  }
+  struct dict* dict = NULL;
+  if (pl_len > 4 && buffer[0] == 0xd0) {
+    dict = parse_dict(&buffer[9 + 4], pl_len - 4);
+  }
+
+  free(buffer);
+  close(sock);
+  return dict;
+}
+
+/*
+ * Read the address of the server from its configuration file
+ */
+void read_config(char* arg) {
+  FILE* fp = fopen(arg, "rb");
+  if (fp == NULL) {
+    puts("Config failed!");
+    exit(1);
+  }
+  opts.address.sin_family = AF_INET;
+  if (fread(&opts.address.sin_addr.s_addr, sizeof(uint32_t), 1, fp) != 1 ||
+      fread(&opts.address.sin_port, sizeof(uint16_t), 1, fp) != 1) {
+    puts("Config failed!");
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/*
+ * Parse a mix such as echo:3,size:1 into opts
+ * return 0 if valid, -1 otherwise
+ */
+int parse_mix(char* arg) {
+  const char* names[] = {"echo",     "list",  "size",
+                         "retrieve", "stats", "dict"};
+  const int types[] = {0x0, 0x2, 0x4, 0x6, 0xa, 0xc};
+
+  opts.mix_n = 0;
+  opts.mix_weight = 0;
+  for (char* item = strtok(arg, ","); item != NULL; item = strtok(NULL, ",")) {
+    char* colon = strchr(item, ':');
+    int weight = 1;
+    if (colon != NULL) {
+      *colon = '\0';
+      weight = atoi(colon + 1);
+    }
+
+    int type = -1;
+    for (int i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+      if (strcmp(item, names[i]) == 0) {
+        type = types[i];
+      }
+    }
+    if (type < 0 || weight <= 0 || opts.mix_n == MIX_MAX) {
+      return -1;
+    }
+    opts.mix[opts.mix_n].type = type;
+    opts.mix[opts.mix_n].weight = weight;
+    opts.mix_n++;
+    opts.mix_weight += weight;
+  }
+  return opts.mix_n > 0 ? 0 : -1;
+}
+
+/*
+ * Parse a size distribution into opts
+ * return 0 if valid, -1 otherwise
+ */
+int parse_sizes(char* arg) {
+  unsigned long long a, b;
+  if (sscanf(arg, "uniform:%llu:%llu", &a, &b) == 2 && a <= b) {
+    opts.sizes.kind = DIST_UNIFORM;
+  } else if (sscanf(arg, "exp:%llu", &a) == 1) {
+    opts.sizes.kind = DIST_EXP;
+  } else if (sscanf(arg, "%llu", &a) == 1) {
+    opts.sizes.kind = DIST_FIXED;
+  } else {
+    return -1;
+  }
+  opts.sizes.a = a;
+  opts.sizes.b = b;
+  return 0;
+}
+
+void usage() {
+  puts("Usage: load-generator [-c conns] [-d depth] [-t seconds] "
+       "[-n requests] [-m mix] [-s sizes] [-z] [-Z] [-4] <config>");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  opts.conns = 1;
+  opts.depth = 1;
+  opts.duration = 5;
+  opts.sizes.a = 64;
+  char default_mix[] = "echo";
+  parse_mix(default_mix);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:d:t:n:m:s:zZ4")) != -1) {
+    switch (opt) {
+      case 'c':
+        opts.conns = atoi(optarg);
+        break;
+      case 'd':
+        opts.depth = atoi(optarg);
+        break;
+      case 't':
+        opts.duration = atof(optarg);
+        break;
+      case 'n':
+        opts.requests = strtoull(optarg, NULL, 10);
+        break;
+      case 'm':
+        if (parse_mix(optarg) < 0) {
+          usage();
+        }
+        break;
+      case 's':
+        if (parse_sizes(optarg) < 0) {
+          usage();
+        }
+        break;
+      case 'z':
+        opts.req_comp = 1;
+        break;
+      case 'Z':
+        opts.send_comp = 1;
+        break;
+      case '4':
+        opts.multi = 1;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (optind != argc - 1 || opts.conns < 1 || opts.depth < 1 ||
+      opts.depth > DEPTH_MAX) {
+    usage();
+  }
+  read_config(argv[optind]);
+
+  opts.dict = fetch_dict();
+  if (opts.dict == NULL) {
+    opts.dict = generate_dict(DICT_PATH);
+  }
+  if (opts.send_comp && opts.dict == NULL) {
+    puts("Dict failed!");
+    exit(1);
+  }
+
+  // size query and retrieve need files to ask for
+  for (int i = 0; i < opts.mix_n; i++) {
+    if ((opts.mix[i].type == 0x4 || opts.mix[i].type == 0x6) &&
+        opts.files_n == 0 && discover_files() <= 0) {
+      puts("No file to query!");
+      exit(1);
+    }
+  }
+
+  struct connection* conns =
+      (struct connection*)calloc(opts.conns, sizeof(struct connection));
+  pthread_t* tids = (pthread_t*)calloc(opts.conns, sizeof(pthread_t));
+  for (int i = 0; i < opts.conns; i++) {
+    conns[i].sock = connect_server();
+    if (conns[i].sock < 0) {
+      puts("Connect failed!");
+      exit(1);
+    }
+    conns[i].rng = 0x9e3779b97f4a7c15ull * (i + 1) ^ (uint64_t)now_ns();
+    sem_init(&conns[i].credits, 0, opts.depth);
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < opts.conns; i++) {
+    pthread_create(&tids[i], NULL, receiver, &conns[i]);
+  }
+  if (opts.requests == 0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)opts.duration;
+    ts.tv_nsec = (long)((opts.duration - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  }
+
+  // merge the connections
+  struct histogram* hist = (struct histogram*)calloc(1, sizeof(*hist));
+  uint64_t received = 0, errors = 0, bytes_sent = 0, bytes_recv = 0;
+  for (int i = 0; i < opts.conns; i++) {
+    pthread_join(tids[i], NULL);
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+      hist->counts[j] += conns[i].hist.counts[j];
+    }
+    if (conns[i].hist.max > hist->max) {
+      hist->max = conns[i].hist.max;
+    }
+    received += conns[i].received;
+    errors += conns[i].errors;
+    bytes_sent += conns[i].bytes_sent;
+    bytes_recv += conns[i].bytes_recv;
+    close(conns[i].sock);
+    sem_destroy(&conns[i].credits);
+  }
+  double seconds = (double)(now_ns() - start) / 1e9;
+
+  printf("requests:     %llu in %.2f s, %llu errors\n",
+         (unsigned long long)received, seconds, (unsigned long long)errors);
+  printf("throughput:   %.0f req/s, sent %.2f MB/s, received %.2f MB/s\n",
+         received / seconds, bytes_sent / seconds / 1e6,
+         bytes_recv / seconds / 1e6);
+  printf("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+         hist_percentile(hist, received, 0.5) / 1e3,
+         hist_percentile(hist, received, 0.99) / 1e3,
+         hist_percentile(hist, received, 0.999) / 1e3, hist->max / 1e3);
+
+  free(hist);
+  free(tids);
+  free(conns);
+  free(opts.files);
+  free(opts.dict);
+  return 0;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "range-cache.h"
+
+/*
+  Hash of the identity of a range
+*/
+static uint32_t hash_range(ino_t ino, uint64_t offset, uint64_t len) {
+  uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ull;
+  h ^= offset + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  h ^= len + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/*
+  Return 1 if range is the range of file encoded with dict
+*/
+static int same_range(struct cached_range* range,
+                      struct cached_file* file,
+                      uint64_t offset,
+                      uint64_t len,
+                      struct dict* dict) {
+  return range->ino == file->ino && range->dev == file->dev &&
+         range->offset == offset && range->len == len &&
+         range->dict_id == dict->id && range->file_size == file->size &&
+         range->mtime.tv_sec == file->mtime.tv_sec &&
+         range->mtime.tv_nsec == file->mtime.tv_nsec;
+}
+
+/*
+  Bytes of bits kept by a range, a count only is charged its entry
+*/
+static uint64_t range_bytes(struct cached_range* range) {
+  if (range->bits == NULL) {
+    return sizeof(struct cached_range);
+  }
+  return (range->nbits + 7) / 8;
+}
+
+/*
+  Free a range and its bits
+*/
+static void free_range(struct cached_range* range) {
+  free(range->bits);
+  free(range);
+}
+
+/*
+  Move a cached range to the front of LRU list, the lock must be held
+*/
+static void lru_push_front(struct range_cache* cache,
+                           struct cached_range* range) {
+  range->lru_prev = NULL;
+  range->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL) {
+    cache->lru_head->lru_prev = range;
+  }
+  cache->lru_head = range;
+  if (cache->lru_tail == NULL) {
+    cache->lru_tail = range;
+  }
+}
+
+static void lru_unlink(struct range_cache* cache, struct cached_range* range) {
+  if (range->lru_prev != NULL) {
+    range->lru_prev->lru_next = range->lru_next;
+  } else {
+    cache->lru_head = range->lru_next;
+  }
+  if (range->lru_next != NULL) {
+    range->lru_next->lru_prev = range->lru_prev;
+  } else {
+    cache->lru_tail = range->lru_prev;
+  }
+}
+
+/*
+  Remove a range from the cache, the lock must be held.
+  it is freed now if nobody holds it, otherwise by the last put
+*/
+static void evict(struct range_cache* cache, struct cached_range* range) {
+  struct cached_range** link =
+      &cache->buckets[hash_range(range->ino, range->offset, range->len) &
+                      (RANGE_CACHE_BUCKETS - 1)];
+  while (*link != range) {
+    link = &(*link)->hash_next;
+  }
+  *link = range->hash_next;
+  lru_unlink(cache, range);
+
+  range->cached = 0;
+  cache->bytes -= range_bytes(range);
+  if (range->refs == 0) {
+    free_range(range);
+  }
+}
+
+/*
+  Find the cached range of file, the lock must be held
+*/
+static struct cached_range* lookup(struct range_cache* cache,
+                                   struct cached_file* file,
+                                   uint64_t offset,
+                                   uint64_t len,
+                                   struct dict* dict) {
+  struct cached_range* range =
+      cache->buckets[hash_range(file->ino, offset, len) &
+                     (RANGE_CACHE_BUCKETS - 1)];
+  while (range != NULL && !same_range(range, file, offset, len, dict)) {
+    range = range->hash_next;
+  }
+  return range;
+}
+
+/*
+  initilize a range cache keeping at most capacity bytes of bits
+*/
+struct range_cache* range_cache_init(uint64_t capacity) {
+  struct range_cache* cache =
+      (struct range_cache*)calloc(1, sizeof(struct range_cache));
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->capacity = capacity;
+  return cache;
+}
+
+/*
+  Get the range of file encoded with dict
+  return NULL if it is not cached
+  return the range with a reference held, give it back with range_cache_put
+*/
+struct cached_range* range_cache_get(struct range_cache* cache,
+                                     struct cached_file* file,
+                                     uint64_t offset,
+                                     uint64_t len,
+                                     struct dict* dict) {
+  pthread_mutex_lock(&cache->lock);
+  struct cached_range* range = lookup(cache, file, offset, len, dict);
+  if (range != NULL) {
+    range->refs++;
+    lru_unlink(cache, range);
+    lru_push_front(cache, range);
+    cache->hits++;
+  } else {
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return range;
+}
+
+/*
+  Add the encoded bits of a range of file, bits is owned by the cache
+  from now on, or only nbits if bits is NULL. a range larger than the
+  capacity is not kept, but still returned.
+  return the range with a reference held, give it back with range_cache_put
+*/
+struct cached_range* range_cache_add(struct range_cache* cache,
+                                     struct cached_file* file,
+                                     uint64_t offset,
+                                     uint64_t len,
+                                     struct dict* dict,
+                                     uint8_t* bits,
+                                     uint64_t nbits) {
+  struct cached_range* added =
+      (struct cached_range*)calloc(1, sizeof(struct cached_range));
+  added->dev = file->dev;
+  added->ino = file->ino;
+  added->mtime = file->mtime;
+  added->file_size = file->size;
+  added->offset = offset;
+  added->len = len;
+  added->dict_id = dict->id;
+  added->bits = bits;
+  added->nbits = nbits;
+  added->refs = 1;
+  if (range_bytes(added) > cache->capacity) {
+    return added;
+  }
+
+  // another thread may have added the same range meanwhile
+  pthread_mutex_lock(&cache->lock);
+  struct cached_range* range = lookup(cache, file, offset, len, dict);
+  if (range != NULL) {
+    evict(cache, range);
+  }
+  added->cached = 1;
+  uint32_t bucket = hash_range(added->ino, offset, len) &
+                    (RANGE_CACHE_BUCKETS - 1);
+  added->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = added;
+  lru_push_front(cache, added);
+  cache->bytes += range_bytes(added);
+
+  while (cache->bytes > cache->capacity) {
+    evict(cache, cache->lru_tail);
+    cache->evictions++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return added;
+}
+
+/*
+  Give back a reference of range, it is freed if it was
+  evicted and this was the last reference
+*/
+void range_cache_put(struct range_cache* cache, struct cached_range* range) {
+  pthread_mutex_lock(&cache->lock);
+  range->refs--;
+  int unused = range->refs == 0 && !range->cached;
+  pthread_mutex_unlock(&cache->lock);
+
+  if (unused) {
+    free_range(range);
+  }
+}
+
+/*
+  Read the hit, miss and eviction counters of the cache
+*/
+void range_cache_counters(struct range_cache* cache,
+                          uint64_t* hits,
+                          uint64_t* misses,
+                          uint64_t* evictions) {
+  pthread_mutex_lock(&cache->lock);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  *evictions = cache->evictions;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+  Free all memory usage of range cache, no range may be held
+*/
+void range_cache_destory(struct range_cache* cache) {
+  while (cache->lru_head != NULL) {
+    evict(cache, cache->lru_head);
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
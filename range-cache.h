@@ -0,0 +1,117 @@
+#ifndef RANGE_CACHE_H /* guard */
+#define RANGE_CACHE_H
+
+/*
+  Compressed range cache.
+  Keep the encoded bits of recently retrieved file ranges, so a
+  range asked again with compression is neither read nor encoded.
+
+  A range is keyed by the identity of the file it was read from,
+  its offset and length, and the id of the dict it was encoded with,
+  so a changed file or a reloaded dict never hits an old range.
+  A range too large to keep its bits may be kept with its bit count only,
+  so its compressed length is known without reading it again.
+  Ranges are reference counted and shared by all threads, the least
+  recently used are dropped beyond the byte capacity.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "compression.h"
+#include "file-cache.h"
+
+#define RANGE_CACHE_BUCKETS (1024)  // hash buckets, power of 2
+
+/*the encoded bits of a file range, valid until its last reference*/
+struct cached_range {
+  /* identity of the file and the range */
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  uint64_t file_size;
+  uint64_t offset;
+  uint64_t len;
+  uint32_t dict_id;
+
+  uint8_t* bits;   // codes of the range, packed from the highest bit,
+                   // NULL if only the count is kept
+  uint64_t nbits;  // number of bits, without padding
+
+  int refs;    // references held by callers
+  int cached;  // 1 while the range is in the cache
+
+  struct cached_range* hash_next;
+  struct cached_range* lru_prev;  // more recently used
+  struct cached_range* lru_next;  // less recently used
+};
+
+/*hash table of ranges with a LRU list, bounded by bytes of bits*/
+struct range_cache {
+  pthread_mutex_t lock;
+  uint64_t capacity;  // maximum bytes of bits kept
+  uint64_t bytes;     // bytes of bits kept
+
+  struct cached_range* buckets[RANGE_CACHE_BUCKETS];
+  struct cached_range* lru_head;  // most recently used
+  struct cached_range* lru_tail;  // least recently used
+
+  /* read with range_cache_counters */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+/*
+  initilize a range cache keeping at most capacity bytes of bits
+*/
+struct range_cache* range_cache_init(uint64_t capacity);
+
+/*
+  Get the range of file encoded with dict
+  return NULL if it is not cached
+  return the range with a reference held, give it back with range_cache_put
+*/
+struct cached_range* range_cache_get(struct range_cache* cache,
+                                     struct cached_file* file,
+                                     uint64_t offset,
+                                     uint64_t len,
+                                     struct dict* dict);
+
+/*
+  Add the encoded bits of a range of file, bits is owned by the cache
+  from now on, or only nbits if bits is NULL. a range larger than the
+  capacity is not kept, but still returned.
+  return the range with a reference held, give it back with range_cache_put
+*/
+struct cached_range* range_cache_add(struct range_cache* cache,
+                                     struct cached_file* file,
+                                     uint64_t offset,
+                                     uint64_t len,
+                                     struct dict* dict,
+                                     uint8_t* bits,
+                                     uint64_t nbits);
+
+/*
+  Give back a reference of range, it is freed if it was
+  evicted and this was the last reference
+*/
+void range_cache_put(struct range_cache* cache, struct cached_range* range);
+
+/*
+  Read the hit, miss and eviction counters of the cache
+*/
+void range_cache_counters(struct range_cache* cache,
+                          uint64_t* hits,
+                          uint64_t* misses,
+                          uint64_t* evictions);
+
+/*
+  Free all memory usage of range cache, no range may be held
+*/
+void range_cache_destory(struct range_cache* cache);
+
+#endif //RANGE_CACHE_H
@@ -1,36 +1,134 @@
 /*
     C  socket server!!
 
-    Handler multiple connection useing threads
+    Handler multiple connection useing threads,
+    or a single epoll event loop with option -e,
+    or a single io_uring loop with option -u,
+    or a single epoll loop feeding a pool of N workers with option -w N.
+    Large multi stream payloads are encoded by a pool of N threads,
+    option -b N.
+    Option -s runs that many shards instead, each pinned to a CPU
+    with its own listening socket on the port.
+    Compression asked for is skipped when it would not pay, or when the
+    server uses more than option -c percent of its CPUs.
+    Sessions expire after option -t seconds, and connections idle for
+    option -i seconds are closed, both timed by a timer wheel.
+    Served files are kept open by a file cache, and mapped with option -m.
+    A mapped file truncated while it is read fails that request only.
+    The directory listing and file sizes are cached until inotify
+    reports a change.
+    The dictionary is read again on SIGHUP, option -T trains a new one
+    from the served files.
+    Buffers are kept by each connection between requests
 
     Provide main operations including: 
         echo,
         directory listing,
         file size query,
-        retrieve file
+        retrieve file,
+        statistics,
+        dictionary
 */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdint.h>
 
 #include "bitwise.h"
+#include "block-codec.h"
+#include "buffer-pool.h"
 #include "compression.h"
+#include "dict-store.h"
+#include "dir-watch.h"
+#include "file-cache.h"
 #include "id-storage.h"
+#include "listing-cache.h"
+#include "range-cache.h"
+#include "size-cache.h"
+#include "stats.h"
+#include "timer-wheel.h"
+#include "uring.h"
+#include "work-pool.h"
 
 #define BUFLEN (1024)                   // initial buffer length
-#define PTHREAD_N (100)                 // maximum thread nunmber
 #define DIRECTORY_PATH_LEN (50)         // direction path length
-#define DICT_PATH ("compression.dict")  // the path of dictionary
+#define DICT_PATH ("compression.dict")  // default path of dictionary
+#define EPOLL_EVENTS_N (256)            // events handled per epoll_wait
+#define FILE_CACHE_N (128)              // open files kept by the file cache
+#define STREAM_CHUNK_LEN (1 << 16)      // file bytes encoded at once
+#define SEND_CHUNK_LEN (1 << 16)        // most bytes sent by one call
+#define RANGE_CACHE_BYTES (64 << 20)    // encoded ranges kept in memory
+#define RANGE_CACHE_MAX (RANGE_CACHE_BYTES / 16)  // longest range kept
+#define THREAD_IN_LEN (1 << 16)         // bytes read at once by a thread
+#define THREAD_OUT_LEN (1 << 16)        // small responses sent at once
+#define URING_ENTRIES (256)             // submission entries of the ring
+#define URING_FILES (4096)              // sockets registered, by fd
+#define URING_BUFFERS (64)              // registered file chunk buffers
+#define URING_IN_LEN (4096)             // bytes received ahead of a request
+#define URING_OUT_LEN (1 << 16)         // small responses sent at once
+#define RANGE_BLOCKS_AHEAD (2)          // streams encoded ahead per thread
+#define SESSION_TTL (300)               // default seconds a session is kept
+#define IDLE_TIMEOUT (300)              // default seconds of an idle client
+#define CPU_SAMPLE_TICKS (10)           // timer ticks between CPU samples
+#define COMPRESS_MIN_SAVING (16)        // compress if saving 1/16 of bytes
+
+/* how connections are served */
+#define MODE_THREAD (0)  // one blocking thread per connection
+#define MODE_EPOLL (1)   // one event loop with non-blocking sockets
+#define MODE_URING (2)   // one io_uring loop, batched system calls
+#define MODE_POOL (3)    // one epoll loop feeding a pool of workers
+
+/* states of a connection in the event loop */
+#define CONN_READ_HEADER (0)   // reading the 9 bytes header
+#define CONN_READ_PAYLOAD (1)  // reading the payload
+#define CONN_SEND (2)          // sending the response
+
+/* operations of the io_uring loop, in the low bits of user_data */
+#define RING_ACCEPT (0)  // no connection
+#define RING_RECV (1)
+#define RING_SEND (2)
+#define RING_READ (3)
+#define RING_OP_MASK (3)
+
+/* what the send in flight of the io_uring loop sends */
+#define RING_SEND_BATCH (0)     // small responses copied to out
+#define RING_SEND_RESPONSE (1)  // buffer_send or a listing, and a slice
+#define RING_SEND_ENCODED (2)   // encoded chunk of a file range
+#define RING_SEND_MAPPED (3)    // raw file range, from the mapping
+#define RING_SEND_CHUNK (4)     // raw file range, from a chunk read
+
+/*
+ * the CPU time used by the server, sampled by a timer
+ */
+struct cpu_load {
+  struct timer timer;
+  int cpus;          // the server may run on
+  uint64_t cpu_ns;   // of the process at the last sample
+  uint64_t wall_ns;  // of the last sample
+  uint64_t percent;  // of the CPUs used between the last two samples
+};
 
 /*
  * this is all the configruation needed by the server
@@ -40,10 +138,70 @@ struct configuration {
   uint16_t port;
   uint32_t ip;
   char directory_path[DIRECTORY_PATH_LEN];
+  char* dict_path;  // option -d, or DICT_PATH
 
-  struct dict* dict;
-  struct decode_tree* decode_tree;
+  struct dict_store* dicts;
   struct sessions* sessions;
+  struct file_cache* files;
+  struct dir_watch* watch;
+  struct listing_cache* listings;
+  struct size_cache* sizes;
+  struct range_cache* ranges;
+  struct block_codec* blocks;
+  struct timer_wheel* timers;
+
+  int mode;      // MODE_THREAD, MODE_EPOLL, MODE_URING or MODE_POOL
+  int use_mmap;  // map cached files, option -m
+  int train;     // write a dictionary trained on the files, option -T
+  int shards;    // option -s, 0 for one per CPU, -1 for no shards
+  int workers;   // pool size of option -w, 0 for one per CPU
+  int block_threads;  // option -b, 0 for one per CPU
+  uint64_t session_ttl;   // ticks of option -t, 0 to keep sessions
+  uint64_t idle_ticks;    // ticks of option -i, 0 to keep idle clients
+  int shed_load;  // option -c, CPU percent compression is shed above, or 0
+  struct cpu_load load;
+};
+
+/*
+ * a file range sent after the response in buffer_send,
+ * either raw with sendfile, or encoded with the dict chunk by chunk.
+ * an encoded range is the whole retrieve payload, the 20 bytes of
+ * fields followed by the file data, in one stream or the streams of the
+ * multi stream format, encoded ahead by the block codec
+ */
+struct file_range {
+  struct cached_file* file;  // NULL if there is no range to send
+  uint64_t offset;           // next byte of the file to send, if raw,
+                             // the first byte of the data, if encoded
+  uint64_t left;             // bytes of the file left to send, if raw
+
+  int compress;  // encode the range while sending
+  struct dict* dict;   // of the request, held until the range is sent
+  uint8_t fields[20];  // payload before the file data
+  int streams;         // streams of the payload, 1 or multi_stream_count()
+  int stream_index;    // stream being encoded
+  uint64_t* bounds;    // first payload byte of each stream, and the end
+  uint64_t pos;        // next payload byte to encode
+  struct compress_stream stream;
+  uint8_t* in;         // chunk read from the file, unless file is mapped
+  uint8_t* out;        // encoded chunk
+  uint64_t out_len;    // bytes of out to send
+  uint64_t out_sent;   // bytes of out already sent
+  int finished;        // the padding byte is in out
+
+  /* multi stream only, a job per stream of the block codec */
+  struct block_job* jobs;
+  struct block_batch batch;  // of the jobs submitted to encode
+  int submitted;             // streams submitted to encode
+};
+
+/*
+ * a shard serves the connections of its own listening socket,
+ * pinned to one CPU
+ */
+struct shard {
+  int sock;  // listening socket, bound with SO_REUSEPORT
+  int cpu;
 };
 
 /*
@@ -53,10 +211,140 @@ struct conc_data {
   int type;      // type
   int compd;     // compressed
   int req_comp;  // required compresse
+  int multi;     // multi stream format, of the payload if compressed,
+                 // and preferred for a compressed response
+  int dict_id;   // a dict id precedes compressed payloads
 
-  uint8_t* payload;      // payload content
+  /* dictionary of the request, held until the response is sent */
+  struct dict_version* codec;
+  int codec_epoch;
+
+  uint8_t* payload;      // payload content, inside the received buffer
   uint64_t payload_len;  // payload length
   uint64_t total_len;    // buffer total length
+
+  /* the request as received, before any decompression, for stats */
+  uint64_t wire_len;
+  int wire_compd;
+  uint64_t plain_len;  // response payload length before compression, or 0
+
+  struct buffer_pool* pool;  // buffers of the connection, for copies
+
+  /* file range to send after the response in buffer_send */
+  struct file_range range;
+
+  /* cached listing sent instead of buffer_send, NULL if none */
+  struct dir_listing* listing;
+  uint8_t* response;  // bytes of the listing to send
+
+  /* payload bytes sent after the response without a copy, in the
+     received buffer, the dictionary or a listing held until sent */
+  uint8_t* slice;
+  uint64_t slice_len;
+};
+
+/*
+ * the idle timer of a connection, its socket is shut down once nothing
+ * was received or sent for config->idle_ticks, unless a request is
+ * being processed. a response the client does not read makes no
+ * progress, so its connection is shut down too.
+ * the timer only reads active and busy, so they are set without the
+ * wheel lock
+ */
+struct idle_timer {
+  struct timer timer;
+  int sock;
+  uint64_t active;  // tick of the last request data received or sent
+  int busy;         // a request is being processed
+};
+
+/*
+ * this store the state of a connection served by the event loop,
+ * one request is read and answered at a time
+ */
+struct connection {
+  int sock;
+  int state;  // CONN_READ_HEADER, CONN_READ_PAYLOAD or CONN_SEND
+
+  uint8_t header[9];
+  uint64_t received;  // bytes received of the current header or payload
+
+  struct conc_data recv_data;
+  uint8_t* buffer_recv;
+  struct buffer_pool pool;
+
+  uint8_t* buffer_send;
+  uint8_t* response;  // buffer_send, or a cached listing response
+  uint64_t send_len;  // bytes of response to send, before slice
+  uint8_t* slice;     // sent after the response, see conc_data
+  uint64_t slice_len;
+  uint64_t sent;      // bytes already sent, of response then slice
+  struct dir_listing* listing;  // listing held while it is sent
+  uint64_t start_ns;  // when the request was read, for stats
+  int close_after_send;
+
+  /* file range still to send after buffer_send */
+  struct file_range range;
+
+  int epoll_fd;  // loop the connection is registered with
+  int worker;    // pool worker that served it last, or -1
+  struct idle_timer idle;
+};
+
+/*
+ * a chunk of a raw file range read by the io_uring loop,
+ * one chunk is sent while the next one is read
+ */
+struct ring_chunk {
+  uint8_t* buffer;  // NULL until first read
+  int index;        // registered buffer, or -1 if from the pool
+  uint64_t len;     // bytes read
+  uint64_t sent;    // bytes already sent
+  int ready;        // read and not fully sent
+};
+
+/*
+ * a connection served by the io_uring loop, requests are parsed from
+ * the bytes received ahead, so pipelined requests take no receive,
+ * and their small responses are copied to out and sent at once
+ */
+struct ring_connection {
+  struct connection conn;
+  int fixed;  // the socket is registered, in the slot of its fd
+
+  uint8_t in[URING_IN_LEN];  // bytes received ahead
+  uint64_t in_start;         // first byte not parsed
+  uint64_t in_end;
+  int receiving;    // a receive is in flight
+  int recv_direct;  // receiving the payload straight into buffer_recv
+
+  uint8_t* out;  // URING_OUT_LEN bytes of responses, NULL until used
+  uint64_t out_len;
+  uint64_t out_sent;
+
+  int inflight;  // operations submitted and not completed
+  int closing;   // released once nothing is in flight
+
+  struct ring_chunk chunks[2];
+  int read_chunk;   // chunk read next
+  int send_chunk;   // chunk sent next
+  int reading;      // a read is in flight
+  int sending;      // a send is in flight
+  int send_target;  // RING_SEND_*, what it sends
+  struct msghdr msg;  // of a RING_SEND_RESPONSE in flight
+  struct iovec iovs[2];
+};
+
+/*
+ * the ring of the io_uring loop and its registered buffers
+ */
+struct ring_loop {
+  struct uring ring;
+  int files;  // slots of the registered file table, 0 if none
+
+  uint8_t* buffers;  // URING_BUFFERS chunks of STREAM_CHUNK_LEN
+  int free[URING_BUFFERS];
+  int free_n;
 };
 
 /*
@@ -68,7 +356,7 @@ struct configuration* config;
 /*
  * Given a buffer, return the payload length
  */
-int get_payload_length(uint8_t* buffer) {
+uint64_t get_payload_length(uint8_t* buffer) {
   uint8_t arr[8];
   for (int i = 0; i < 8; i++) {
     arr[i] = buffer[8 - i];
@@ -81,7 +369,7 @@ int get_payload_length(uint8_t* buffer) {
  * Given a size, set up payload length into buffer
  * which is the 1st byte to 9th byte
  */
-void modify_payload_len(uint8_t* buffer, int size) {
+void modify_payload_len(uint8_t* buffer, uint64_t size) {
   uint64_t pl_len_in64 = htobe64(size);
   uint8_t* ptr = (uint8_t*)&pl_len_in64;
   for (int i = 1; i < 9; i++) {
@@ -89,6 +377,15 @@ void modify_payload_len(uint8_t* buffer, int size) {
   }
 }
 
+/*
+ * Given a type, return 1 if it is a known request type
+ */
+int is_valid_type(int type) {
+  return type == (int)0x0 || type == (int)0x2 || type == (int)0x4 ||
+         type == (int)0x6 || type == (int)0x8 || type == (int)0xa ||
+         type == (int)0xc;
+}
+
 /*
  * Given a buffer, set up all info into data
  */
@@ -96,30 +393,96 @@ void setup_recv_size(struct conc_data* data, uint8_t* buffer) {
   data->type = buffer[0] >> 4;
 
   data->payload_len = get_payload_length(buffer);
-  if (data->type != (int)0x0 && data->type != (int)0x2 &&
-      data->type != (int)0x4 && data->type != (int)0x6 &&
-      data->type != (int)0x8) {
+  if (!is_valid_type(data->type)) {
     data->payload_len = 0;
   }
 
   data->compd = ith_bit(buffer[0], 3);     // 5th bit (8-5)
   data->req_comp = ith_bit(buffer[0], 2);  // 6th bit (8-6)
+  data->multi = ith_bit(buffer[0], 1);     // 7th bit (8-7)
+  data->dict_id = ith_bit(buffer[0], 0);   // 8th bit (8-8)
 
   data->total_len = data->payload_len + 9;
+  memset(&data->range, 0, sizeof(struct file_range));
+  data->listing = NULL;
+  data->response = NULL;
+  data->slice = NULL;
+  data->slice_len = 0;
+  data->plain_len = 0;
 }
 
 /*
- * Given the received buffer, set up payload content into data
+ * Given the received buffer, set up payload content into data,
+ * the payload is not copied and is valid as long as buffer
  */
 void setup_recv_payload(struct conc_data* data, uint8_t* buffer) {
-  data->payload = (uint8_t*)malloc(sizeof(uint8_t) * (data->payload_len));
-  for (int i = 0; i < data->payload_len; i++) {
-    data->payload[i] = buffer[i + 9];
+  data->payload = &buffer[9];
+}
+
+/*
+ * Compress the payload of a response with dict straight into
+ * buffer_send, and set its payload length
+ * return the payload length after compress
+ */
+int compress_response(uint8_t** buffer_send,
+                      uint8_t* payload,
+                      uint64_t pl_len,
+                      struct dict* dict) {
+  int send_pl_len = compress_len(dict, payload, pl_len);
+  pool_reserve(buffer_send, send_pl_len + 9);
+
+  struct compress_stream stream;
+  compress_stream_init(&stream);
+  uint8_t* out = &(*buffer_send)[9];
+  out += compress_stream_update(dict, &stream, payload, pl_len, out);
+  compress_stream_finish(&stream, out);
+  modify_payload_len(*buffer_send, send_pl_len);
+
+  return send_pl_len;
+}
+
+/*
+ * Insert the dict id before the compressed payload in buffer_send,
+ * pl_len bytes of it are in buffer_send, the rest is a slice or a
+ * file range
+ * return the new length of buffer_send payload
+ */
+int add_dict_id(uint8_t** buffer_send, int pl_len, uint32_t id) {
+  pool_reserve(buffer_send, pl_len + 4 + 9);
+  memmove(&(*buffer_send)[9 + 4], &(*buffer_send)[9], pl_len);
+  uint32_t id_in32 = htonl(id);
+  memcpy(&(*buffer_send)[9], &id_in32, sizeof(uint32_t));
+
+  modify_payload_len(*buffer_send, get_payload_length(*buffer_send) + 4);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 0, 1);
+  return pl_len + 4;
+}
+
+/*
+ * Count the CPUs the process may run on, and list them in cpus
+ * if not NULL
+ */
+int allowed_cpus(int* cpus) {
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+    CPU_SET(0, &allowed);
+  }
+
+  int n = 0;
+  for (int i = 0; i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &allowed)) {
+      if (cpus != NULL) {
+        cpus[n] = i;
+      }
+      n++;
+    }
   }
+  return n;
 }
 
 /*
- * Read all the configurations into config argument
+ * Read the configuration file into config argument
  */
 void read_config(char* arg, struct configuration* config) {
   config = (struct configuration*)config;
@@ -139,18 +502,221 @@ void read_config(char* arg, struct configuration* config) {
   }
   config->directory_path[i] = '\0';
   fclose(fp);
+}
+
+/*
+ * return the CPU time used by all threads of the process in ns
+ */
+uint64_t process_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-  /* init dict*/
-  struct dict* dict = generate_dict(DICT_PATH);
-  config->dict = dict;
+/*
+ * Timer of the CPU load, the percent of the CPUs used since it last ran
+ */
+uint64_t cpu_sampled(struct timer* timer) {
+  struct cpu_load* load = (struct cpu_load*)timer->arg;
+  uint64_t cpu_ns = process_cpu_ns();
+  uint64_t wall_ns = stats_now_ns();
+  if (wall_ns > load->wall_ns) {
+    uint64_t percent = (cpu_ns - load->cpu_ns) * 100 /
+                       ((wall_ns - load->wall_ns) * load->cpus);
+    __atomic_store_n(&load->percent, percent, __ATOMIC_RELAXED);
+  }
+  load->cpu_ns = cpu_ns;
+  load->wall_ns = wall_ns;
+  return CPU_SAMPLE_TICKS;
+}
 
-  /*init decode treee*/
-  struct decode_tree* tree = generate_decode_tree(dict);
-  config->decode_tree = tree;
+/*
+ * Initilize everything the requests are served with
+ */
+void setup_config(struct configuration* config) {
+  /* init dict and decode tree*/
+  config->dicts = dict_store_init(config->dict_path);
+  if (config->dicts == NULL) {
+    puts("Dict failed!");
+    exit(1);
+  }
 
   /*init decode treee*/
   struct sessions* sessions = session_id_storage_init();
   config->sessions = sessions;
+
+  /* init file cache*/
+  config->files =
+      file_cache_init(config->directory_path, FILE_CACHE_N, config->use_mmap);
+  if (config->files == NULL) {
+    puts("Directory failed!");
+    exit(1);
+  }
+
+  /* init caches kept valid by the directory watch*/
+  config->watch = dir_watch_init(config->directory_path);
+  config->listings = listing_cache_init(config->directory_path, config->watch);
+  config->sizes = size_cache_init(config->directory_path, config->watch);
+  if (config->sizes == NULL) {
+    puts("Directory failed!");
+    exit(1);
+  }
+
+  /* init compressed range cache*/
+  config->ranges = range_cache_init(RANGE_CACHE_BYTES);
+
+  /* init block codec*/
+  int threads =
+      config->block_threads > 0 ? config->block_threads : allowed_cpus(NULL);
+  config->blocks = block_codec_init(threads);
+
+  /* init timers of sessions and idle connections*/
+  config->timers = timer_wheel_init();
+
+  /* init CPU load sampling*/
+  struct cpu_load* load = &config->load;
+  load->cpus = allowed_cpus(NULL);
+  load->cpu_ns = process_cpu_ns();
+  load->wall_ns = stats_now_ns();
+  timer_init(&load->timer, cpu_sampled, load);
+  timer_wheel_arm(config->timers, &load->timer, CPU_SAMPLE_TICKS);
+}
+
+/*
+ * Shed compression if the CPU load is above option -c, and count it
+ *  return 1 if the response is sent raw
+ */
+int compress_shed() {
+  if (config->shed_load > 0 &&
+      __atomic_load_n(&config->load.percent, __ATOMIC_RELAXED) >
+          (uint64_t)config->shed_load) {
+    stats_compress(STATS_SHED);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Decide if plain_len bytes are compressed, given their encoded length.
+ * compression pays if it saves 1/COMPRESS_MIN_SAVING of the bytes
+ *  return 1 if they are compressed
+ */
+int compress_saves(uint64_t plain_len, uint64_t encoded_len) {
+  return encoded_len + plain_len / COMPRESS_MIN_SAVING < plain_len;
+}
+
+/*
+ * Decide if plain_len bytes are compressed like compress_saves(), and
+ * count the decision
+ *  return 1 if they are compressed
+ */
+int compress_pays(uint64_t plain_len, uint64_t encoded_len) {
+  if (compress_saves(plain_len, encoded_len)) {
+    stats_compress(STATS_COMPRESSED);
+    return 1;
+  }
+  stats_compress(STATS_BYPASSED);
+  return 0;
+}
+
+/*
+ * return the bytes the multi stream format adds to an encoded payload
+ * of len bytes, its jump table and the padding bytes of its streams,
+ * or 0 if multi is 0
+ */
+uint64_t multi_overhead(uint64_t len, int multi) {
+  if (multi == 0) {
+    return 0;
+  }
+  return multi_table_len(len) + multi_stream_count(len) - 1;
+}
+
+/*
+ * Decide if a payload in memory asked to be compressed is compressed,
+ * from its encoded length estimated by compress_estimate()
+ * multi - 1 if it is encoded in the multi stream format
+ *  return 1 if it is compressed
+ */
+int should_compress(struct dict* dict,
+                    uint8_t* payload,
+                    uint64_t len,
+                    int multi) {
+  if (compress_shed()) {
+    return 0;
+  }
+  return compress_pays(len, compress_estimate(dict, payload, len) +
+                                multi_overhead(len, multi));
+}
+
+/*
+ * Timer of a session, remove it once its TTL is over
+ */
+uint64_t session_expired(struct timer* timer) {
+  struct id_entry* session = (struct id_entry*)timer->arg;
+  session_id_storage_remove(config->sessions, session->session_id);
+  return 0;
+}
+
+/*
+ * Timer of a connection, shut its socket down if idle for too long,
+ * the blocked receive or send, or the loop then closes it.
+ * it is reset once closed, so the response its client did not read
+ * is dropped rather than kept queued by the kernel
+ *  return the ticks until it may be idle for too long
+ */
+uint64_t idle_expired(struct timer* timer) {
+  struct idle_timer* idle = (struct idle_timer*)timer->arg;
+  if (__atomic_load_n(&idle->busy, __ATOMIC_RELAXED)) {
+    return config->idle_ticks;
+  }
+  uint64_t idle_for = timer_wheel_now(config->timers) -
+                      __atomic_load_n(&idle->active, __ATOMIC_RELAXED);
+  if (idle_for < config->idle_ticks) {
+    return config->idle_ticks - idle_for;
+  }
+  struct linger reset = {1, 0};
+  setsockopt(idle->sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+  shutdown(idle->sock, SHUT_RDWR);
+  return 0;
+}
+
+/*
+ * Start timing a new connection, if idle connections are closed
+ */
+void idle_start(struct idle_timer* idle, int sock) {
+  idle->sock = sock;
+  idle->active = timer_wheel_now(config->timers);
+  idle->busy = 0;
+  timer_init(&idle->timer, idle_expired, idle);
+  if (config->idle_ticks > 0) {
+    timer_wheel_arm(config->timers, &idle->timer, config->idle_ticks);
+  }
+}
+
+/*
+ * Note that request data was received or response bytes were sent,
+ * the timer is not moved, it checks active when it runs
+ */
+void idle_touch(struct idle_timer* idle) {
+  __atomic_store_n(&idle->active, timer_wheel_now(config->timers),
+                   __ATOMIC_RELAXED);
+}
+
+/*
+ * Mark a connection processing a request or done with it,
+ * it is never idle in between. its response is then timed by
+ * the bytes sent
+ */
+void idle_busy(struct idle_timer* idle, int busy) {
+  idle_touch(idle);
+  __atomic_store_n(&idle->busy, busy, __ATOMIC_RELAXED);
+}
+
+/*
+ * Stop timing a connection, before its socket is closed
+ */
+void idle_stop(struct idle_timer* idle) {
+  timer_wheel_cancel(config->timers, &idle->timer);
 }
 
 /*
@@ -162,18 +728,30 @@ int echo(uint8_t** buffer_send,
          uint8_t** buffer_recv,
          struct conc_data* recv_data) {
 
-  // check if request compression
-  if (recv_data->compd == 0 && recv_data->req_comp == 1) {
-    int pl_len = compress(config->dict, buffer_send, buffer_recv,
+  // check if request compression, and if it pays
+  struct dict* dict = recv_data->codec->dict;
+  if (recv_data->compd == 0 && recv_data->req_comp == 1 &&
+      should_compress(dict, recv_data->payload, recv_data->payload_len,
+                      recv_data->multi)) {
+    recv_data->plain_len = recv_data->payload_len;
+    if (recv_data->multi == 1) {
+      return block_compress_multi(config->blocks, dict, buffer_send,
+                                  buffer_recv, recv_data->payload_len);
+    }
+    pool_reserve(buffer_send, compress_len(dict, recv_data->payload,
+                                           recv_data->payload_len) + 9);
+    int pl_len = compress(dict, buffer_send, buffer_recv,
                           recv_data->payload_len);
 
     return pl_len;
   }
 
-  // send back the same message, but change the type
-  (*buffer_send) =
-      realloc((*buffer_send), sizeof(uint8_t) * recv_data->total_len);
-  memcpy(*buffer_send, *buffer_recv, sizeof(uint8_t) * recv_data->total_len);
+  // send back the same message, but change the type.
+  // only the header is in buffer_send, the payload is sent from
+  // buffer_recv
+  memcpy(*buffer_send, *buffer_recv, 9);
+  recv_data->slice = recv_data->payload;
+  recv_data->slice_len = recv_data->payload_len;
 
   // modify type
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);
@@ -181,106 +759,60 @@ int echo(uint8_t** buffer_send,
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 6, 0);
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 7, 0);
 
-  // modify require compression
+  // modify require compression, a raw payload is never multi stream
+  // and names no dict
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
+  if (recv_data->compd == 0) {
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 1, 0);
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 0, 0);
+  }
 
-  return recv_data->payload_len;
+  return 0;
 }
 
 /*
  *  Provide directory listing operation in thread handler
- *  Modify the buffer to send
+ *  The response is the cached listing, sent instead of buffer_send,
+ *  and the caller gives it back when it is sent
  *  return the new payload length as int
  */
 int directory_listing(uint8_t** buffer_send,
                       uint8_t** buffer_recv,
-                      char* directory_path) {
-  DIR* d;
-  struct dirent* dir;
-  int ctr = 0;  // count regular file number
-  int payload_index = 0;
-
-  // read file name
-  d = opendir(directory_path);
-  if (d) {
-    while ((dir = readdir(d)) != NULL) {
-      if (dir->d_type == DT_REG) {
-        for (int i = 0; i < strlen(dir->d_name); i++) {
-          (*buffer_send)[payload_index + 9] = dir->d_name[i];
-          payload_index++;
-        }
-        (*buffer_send)[payload_index + 9] = 0x00;
-        payload_index++;
-        ctr++;
-      }
+                      struct conc_data* recv_data,
+                      struct listing_cache* listings) {
+  struct dir_listing* listing = listing_cache_get(
+      listings, recv_data->req_comp, recv_data->codec->dict, compress_pays);
+  recv_data->listing = listing;
+
+  // an empty directory is never compressed, nor a listing that does
+  // not get shorter. it is compressed and decided once for all
+  // requests, so never shed
+  if (recv_data->req_comp == 1 && listing->comp != NULL &&
+      listing->comp_pays) {
+    recv_data->plain_len = listing->raw_len - 9;
+    if (recv_data->dict_id == 1) {
+      // the header is in buffer_send for the dict id to follow it,
+      // the payload is sent from the listing
+      memcpy(*buffer_send, listing->comp, 9);
+      recv_data->slice = &listing->comp[9];
+      recv_data->slice_len = listing->comp_len - 9;
+      return 0;
     }
-    closedir(d);
-  }
-
-  // directory is empty, return a signle null payload
-  if (ctr == 0) {
-    modify_payload_len((*buffer_send), 1);
-    (*buffer_send)[9] = 0x00;
-
-    // modify type
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 5, 1);
-
-    // modify compression state
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 0);
-
-    // modify require compression state
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
-    return 1;
-  }
-
-  // modify buffer payload len
-  modify_payload_len((*buffer_send), payload_index);
-
-  // require compression
-  if ((ith_bit((*buffer_recv[0]), 2)) == 1) {
-    uint8_t* copy = (uint8_t*)malloc(payload_index + 9);
-    memcpy(copy, (*buffer_send), payload_index + 9);
-    payload_index = compress(config->dict, buffer_send, &copy,
-                             get_payload_length(*buffer_send));
-    free(copy);
-
-    // modify compression state
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);
-
-    // modify require compression state
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
+    recv_data->response = listing->comp;
+    return listing->comp_len - 9;
   }
-
-  // modify type
-  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);
-  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 5, 1);
-
-  return payload_index;
+  recv_data->response = listing->raw;
+  return listing->raw_len - 9;
 }
 
 /*
- *  The helper function of size query
+ *  The helper function of size query,
+ *  the size is taken from the size cache, or a statx of the file
  *   return file size: if found the file
- *          0: if file not found
+ *          -1: if file not found
  */
-int size_query_helper(char* base_dir_path, char* filename) {
-  // generate file path
-  char file_path[FILENAME_LEN];
-  strcpy(file_path, base_dir_path);
-  strcat(file_path, "/");
-  strcat(file_path, filename);
-  FILE* fp = fopen(file_path, "r");
-  if (fp) {
-    // found file! calculate size
-    fseek(fp, 0, SEEK_END);
-    int size = ftell(fp);
-
-    fclose(fp);
-    return size;
-  }
-
-  return -1;  // not found
+int64_t size_query_helper(struct size_cache* sizes, char* filename) {
+  return size_cache_get(sizes, filename);
 }
 
 /*
@@ -291,42 +823,42 @@ int size_query_helper(char* base_dir_path, char* filename) {
 int size_query(uint8_t** buffer_send,
                uint8_t** buffer_recv,
                struct conc_data* recv_data) {
-  char* filename = (char*)recv_data->payload;
+  // the payload may not end with a null byte
+  char filename[FILENAME_LEN];
+  uint64_t filename_len = recv_data->payload_len;
+  if (filename_len > FILENAME_LEN - 1) {
+    filename_len = FILENAME_LEN - 1;
+  }
+  memcpy(filename, recv_data->payload, filename_len);
+  filename[filename_len] = '\0';
 
   // Use helper function to find file,
   // if not found, modify buffer to error
-  int size = size_query_helper(config->directory_path, filename);
+  int64_t size = size_query_helper(config->sizes, filename);
   if (size < 0) {
     (*buffer_send)[0] = 0xf0;
     return 0;
   }
 
-  // update payload len
-  modify_payload_len((*buffer_send), 8);
-
-  // update file size into buffer
+  // payload size is defaultly 8 byte, the file size
   uint64_t pl_in64 = htobe64(size);
-  uint8_t* ptr = (uint8_t*)&pl_in64;
-  for (int i = 0; i < 8; i++) {
-    (*buffer_send)[i + 9] = ptr[i];
-  }
-
-  // payload size is defaultly 8 byte
   int pl_size = 8;
 
-  // check compression request
-  if (recv_data->req_comp == 1) {
-    uint8_t* copy = (uint8_t*)malloc(pl_size + 9);
-    memcpy(copy, *buffer_send, pl_size + 9);
-
+  // check compression request, and if it pays
+  struct dict* dict = recv_data->codec->dict;
+  if (recv_data->req_comp == 1 &&
+      should_compress(dict, (uint8_t*)&pl_in64, pl_size, 0)) {
     // update payload length after compressed
-    pl_size = compress(config->dict, buffer_send, &copy,
-                       get_payload_length(*buffer_send));
-    free(copy);
+    recv_data->plain_len = pl_size;
+    pl_size = compress_response(buffer_send, (uint8_t*)&pl_in64, pl_size,
+                                dict);
 
     // modify compression state
     (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
     (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);
+  } else {
+    memcpy(&(*buffer_send)[9], &pl_in64, pl_size);
+    modify_payload_len(*buffer_send, pl_size);
   }
 
   // modify type
@@ -337,233 +869,2042 @@ int size_query(uint8_t** buffer_send,
 }
 
 /*
- *  Provide retrieve file operation in thread handler
- *  Modify the buffer to send
+ *  Provide statistics operation in thread handler
+ *  Modify the buffer to send, the payload is STATS_FIELDS big endian
+ *  uint64 in the order of enum stats_field
  *  return the new payload length as int
  */
-int retrieve_file(uint8_t** buffer_send,
-                  uint8_t** buffer_recv,
-                  struct conc_data* recv_data) {
-  if (recv_data->payload_len < 20) {
-    return -1;
-  }
-  int pl_len = (int)recv_data->payload_len;
-
-  // decompress
-  if (recv_data->compd == 1) {
-    uint8_t* copy =
-        (uint8_t*)malloc(sizeof(uint8_t) * (recv_data->payload_len + 9));
-    memcpy(copy, *buffer_recv, recv_data->payload_len + 9);
-    pl_len = decompress(config->decode_tree, buffer_recv, &copy,
-                        recv_data->payload_len);
-    setup_recv_size(recv_data, *buffer_recv);
-    setup_recv_payload(recv_data, *buffer_recv);
-  }
-
-  // create new session entry
-  struct id_entry* session =
-      new_id_entry(buffer_recv, (int)get_payload_length(*buffer_recv));
-  int res = session_id_storage_add(&(config->sessions->root), session);
-  if (res < 0) {
-    (*buffer_send)[0] = 0x70;
-    modify_payload_len(*buffer_send, 0);
-    return 0;
-  }
-
-  // adjust buffer size
-  *buffer_send = realloc(*buffer_send, session->data_len + 20 + 9);
-
-  // generate file path
-  char file_path[FILENAME_LEN];
-  strcpy(file_path, config->directory_path);
-  strcat(file_path, "/");
-  strcat(file_path, session->filename);
-
-  // write data into buffer_send,
-  // change buffer to error type if  file not found,
-  FILE* fp = fopen(file_path, "r");
-  if (!fp) {
-    (*buffer_send)[0] = 0xf0;
-    return 0;
-  }
-  fseek(fp, session->start_offset, SEEK_SET);
-  uint8_t* ptr = &(*buffer_send)[20 + 9];
-  uint64_t bytes_read = fread(ptr, sizeof(uint8_t), session->data_len, fp);
-  fclose(fp);
-
-  // send error type if bad range
-  if (bytes_read != session->data_len) {
-    (*buffer_send)[0] = 0xf0;
-    return 0;
+int statistics(uint8_t** buffer_send,
+               uint8_t** buffer_recv,
+               struct conc_data* recv_data) {
+  uint64_t fields[STATS_FIELDS];
+  stats_snapshot(fields);
+  fields[STAT_SESSIONS] = session_id_storage_count(config->sessions);
+  fields[STAT_POOL_HEAP_ALLOCS] = pool_heap_allocs();
+  range_cache_counters(config->ranges, &fields[STAT_RANGE_HITS],
+                       &fields[STAT_RANGE_MISSES],
+                       &fields[STAT_RANGE_EVICTIONS]);
+  fields[STAT_DICT_ID] = recv_data->codec->id;
+  fields[STAT_DICT_RELOADS] = dict_store_reloads(config->dicts);
+  fields[STAT_CPU_LOAD] =
+      __atomic_load_n(&config->load.percent, __ATOMIC_RELAXED);
+
+  int pl_size = STATS_FIELDS * sizeof(uint64_t);
+  for (int i = 0; i < STATS_FIELDS; i++) {
+    fields[i] = htobe64(fields[i]);
   }
-  pl_len = bytes_read + 20;
 
-  // copy id, star_offs, data_len into buffer_send,
-  // and overwrite payload length
-  memcpy(*buffer_send, *buffer_recv, 20 + 9);
-  modify_payload_len((*buffer_send), bytes_read + 20);
-
-  // compress
-  if (recv_data->req_comp == 1) {
-    uint8_t* copy = (uint8_t*)malloc(bytes_read + 20 + 9);
-    memcpy(copy, (*buffer_send), bytes_read + 20 + 9);
+  // check compression request, and if it pays
+  struct dict* dict = recv_data->codec->dict;
+  if (recv_data->req_comp == 1 &&
+      should_compress(dict, (uint8_t*)fields, pl_size, 0)) {
+    recv_data->plain_len = pl_size;
+    pl_size = compress_response(buffer_send, (uint8_t*)fields, pl_size,
+                                dict);
 
-    // update payload length
-    pl_len = compress(config->dict, buffer_send, &copy,
-                      get_payload_length(*buffer_send));
-    free(copy);
     // modify compression state
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);  // compressed
-    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);  // req_compr
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);
+  } else {
+    pool_reserve(buffer_send, pl_size + 9);
+    memcpy(&(*buffer_send)[9], fields, pl_size);
+    modify_payload_len(*buffer_send, pl_size);
   }
 
   // modify type
-  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 6, 1);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 7, 1);
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 5, 1);
   (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);
 
-  return pl_len;
+  return pl_size;
 }
 
 /*
- *  Thread handler
- * agr - client socket or new socket generated from accept()
+ *  Provide dictionary operation in thread handler
+ *  Modify the buffer to send, the payload is the dict id,
+ *  4 bytes big endian, followed by the dictionary file, sent from
+ *  the dictionary held by the request
+ *  return the new payload length as int
  */
-void* connection_handler(void* arg) {
-  uint8_t buffer[9];
+int dictionary(uint8_t** buffer_send,
+               uint8_t** buffer_recv,
+               struct conc_data* recv_data) {
+  struct dict_version* codec = recv_data->codec;
+  int pl_size = sizeof(uint32_t);
 
-  int client_sock = *(int*)arg;
+  uint32_t id_in32 = htonl(codec->id);
+  memcpy(&(*buffer_send)[9], &id_in32, sizeof(uint32_t));
+  modify_payload_len(*buffer_send, pl_size + codec->file_len);
+  recv_data->slice = codec->file;
+  recv_data->slice_len = codec->file_len;
 
-  while (1) {
-    ssize_t to_read;
-    ssize_t recvd;
-    uint8_t* ptr = &buffer[0];
+  // modify type, never compressed
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 7, 1);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 6, 1);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);
 
-    // Get 9 bytes header
-    recvd = recv(client_sock, ptr, 9, 0);
-    if (recvd <= 0) {
-      break;
-    }
+  return pl_size;
+}
 
-    // malloc some sapce to store recv info
-    struct conc_data* recv_data =
-        (struct conc_data*)malloc(sizeof(struct conc_data));
+/*
+ * Count an answered request into the stats of this thread,
+ * response is its header, as sent
+ */
+void count_request(struct conc_data* recv_data,
+                   uint8_t* response,
+                   uint64_t start_ns) {
+  stats_request(stats_type_index(recv_data->type), recv_data->wire_len,
+                recv_data->wire_compd, get_payload_length(response) + 9,
+                ith_bit(response[0], 3), recv_data->plain_len,
+                stats_now_ns() - start_ns);
+}
 
-    // read and payload length
-    setup_recv_size(recv_data, buffer);
+/*
+ * Bytes read by one of the map_* functions, run with file_map_read()
+ * as they may be in the mapping of a file truncated since it was mapped
+ */
+struct mapped_bytes {
+  uint8_t* in;
+  uint64_t len;
+  struct dict* dict;
+  struct compress_stream* stream;  // of map_encode
+  uint8_t* out;                    // of map_copy and map_encode
+  uint64_t* hist;                  // of map_histogram
+  uint64_t result;                 // bits counted, or bytes encoded
+};
 
-    // now we know the length, generate a speicic size of buffer
-    uint8_t* buffer_recv =
-        (uint8_t*)malloc(sizeof(uint8_t) * recv_data->total_len);
+int map_copy(void* arg) {
+  struct mapped_bytes* bytes = (struct mapped_bytes*)arg;
+  memcpy(bytes->out, bytes->in, bytes->len);
+  return 0;
+}
 
-    // copy the first 9 byte
-    memcpy(buffer_recv, buffer, 9);
+int map_count(void* arg) {
+  struct mapped_bytes* bytes = (struct mapped_bytes*)arg;
+  bytes->result = compress_bits(bytes->dict, bytes->in, bytes->len);
+  return 0;
+}
 
-    // Get the rest of all data
-    ptr = &buffer_recv[9];
-    to_read = recv_data->payload_len;
-    while (to_read) {
-      recvd = recv(client_sock, ptr, to_read, 0);
+int map_encode(void* arg) {
+  struct mapped_bytes* bytes = (struct mapped_bytes*)arg;
+  bytes->result = compress_stream_update(bytes->dict, bytes->stream,
+                                         bytes->in, bytes->len, bytes->out);
+  return 0;
+}
 
-      if (recvd < 0) {
-        free(buffer_recv);
-        free(recv_data);
-        close(client_sock);
-        pthread_exit(NULL);
-        return NULL;
+int map_histogram(void* arg) {
+  struct mapped_bytes* bytes = (struct mapped_bytes*)arg;
+  compress_histogram(bytes->in, bytes->len, bytes->hist);
+  return 0;
+}
+
+/*
+ * Count the bits of the codes of len bytes with dict
+ *  return bits: if the bytes are read
+ *         -1: if the file mapped under them was truncated
+ */
+int64_t mapped_bits(struct dict* dict, uint8_t* in, uint64_t len) {
+  struct mapped_bytes bytes = {0};
+  bytes.in = in;
+  bytes.len = len;
+  bytes.dict = dict;
+  if (file_map_read(map_count, &bytes) < 0) {
+    return -1;
+  }
+  return bytes.result;
+}
+
+/*
+ * Encode len bytes with dict and stream into out
+ *  return bytes written to out: if the bytes are read
+ *         -1: if the file mapped under them was truncated
+ */
+int64_t mapped_encode(struct dict* dict,
+                      struct compress_stream* stream,
+                      uint8_t* in,
+                      uint64_t len,
+                      uint8_t* out) {
+  struct mapped_bytes bytes = {0};
+  bytes.in = in;
+  bytes.len = len;
+  bytes.dict = dict;
+  bytes.stream = stream;
+  bytes.out = out;
+  if (file_map_read(map_encode, &bytes) < 0) {
+    return -1;
+  }
+  return bytes.result;
+}
+
+/*
+ * Read len bytes of a cached file from offset into buffer,
+ * copied from the mapping if the file is mapped
+ *  return 0: if all bytes are read
+ *        -1: if the file is shorter or can not be read
+ */
+int read_file_range(struct cached_file* file,
+                    uint8_t* buffer,
+                    uint64_t offset,
+                    uint64_t len) {
+  if (file->map != NULL) {
+    if (offset > file->size || len > file->size - offset) {
+      return -1;
+    }
+    struct mapped_bytes bytes = {0};
+    bytes.in = &file->map[offset];
+    bytes.len = len;
+    bytes.out = buffer;
+    return file_map_read(map_copy, &bytes);
+  }
+
+  uint64_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t n = pread(file->fd, buffer + bytes_read, len - bytes_read,
+                      offset + bytes_read);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    bytes_read += n;
+  }
+  return 0;
+}
+
+/*
+ * Get the bytes of an encoded range payload from pos,
+ * the fields or the file data, at most *len bytes and one chunk.
+ * *len is set to the bytes returned
+ *  return the bytes: valid until the next call
+ *         NULL: if the file can not be read
+ */
+uint8_t* file_range_chunk(struct file_range* range,
+                          uint64_t pos,
+                          uint64_t* len,
+                          struct buffer_pool* pool) {
+  if (pos < 20) {
+    if (*len > 20 - pos) {
+      *len = 20 - pos;
+    }
+    return &range->fields[pos];
+  }
+
+  if (*len > STREAM_CHUNK_LEN) {
+    *len = STREAM_CHUNK_LEN;
+  }
+  uint64_t offset = range->offset + pos - 20;
+  if (range->file->map != NULL) {
+    return &range->file->map[offset];
+  }
+  if (range->in == NULL) {
+    range->in = pool_get(pool, STREAM_CHUNK_LEN);
+  }
+  if (read_file_range(range->file, range->in, offset, *len) < 0) {
+    return NULL;
+  }
+  return range->in;
+}
+
+/*
+ * Read the bytes of the stream of a job of an encoded range,
+ * on a thread of the block codec
+ *  return 0: if the bytes are read
+ *        -1: if the file can not be read
+ */
+int file_range_load(struct block_job* job, uint8_t* buffer) {
+  struct file_range* range = (struct file_range*)job->arg;
+  uint64_t pos = job->start;
+  uint64_t len = job->len;
+  if (pos < 20) {
+    uint64_t n = len < 20 - pos ? len : 20 - pos;
+    memcpy(buffer, &range->fields[pos], n);
+    buffer += n;
+    pos += n;
+    len -= n;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  return read_file_range(range->file, buffer, range->offset + pos - 20,
+                         len);
+}
+
+/*
+ * Set up a job per stream of a multi stream range, and count the bits
+ * of every stream on the block codec, into stream_lens
+ *  return 0: if the range is read
+ *        -1: if the file can not be read
+ */
+int file_range_blocks(struct file_range* range, uint64_t* stream_lens) {
+  range->jobs =
+      (struct block_job*)calloc(range->streams, sizeof(struct block_job));
+  for (int i = 0; i < range->streams; i++) {
+    struct block_job* job = &range->jobs[i];
+    job->dict = range->dict;
+    job->start = range->bounds[i];
+    job->len = range->bounds[i + 1] - range->bounds[i];
+    job->load = file_range_load;
+    job->arg = range;
+  }
+  if (block_codec_run(config->blocks, range->jobs, range->streams) < 0) {
+    return -1;
+  }
+  for (int i = 0; i < range->streams; i++) {
+    stream_lens[i] = (range->jobs[i].bits + 7) / 8 + 1;
+  }
+  return 0;
+}
+
+/*
+ * Count the bits of the codes of the file data of a single stream range,
+ * the len bytes after its fields, in blocks on the block codec.
+ * the count is kept in the range cache, so a range asked again is only
+ * read to be encoded
+ *  return bits: if the range is read
+ *         -1: if the file can not be read
+ */
+int64_t file_range_bits(struct file_range* range, uint64_t len) {
+  struct cached_range* cached = range_cache_get(
+      config->ranges, range->file, range->offset, len, range->dict);
+  if (cached != NULL) {
+    int64_t nbits = cached->nbits;
+    range_cache_put(config->ranges, cached);
+    return nbits;
+  }
+
+  uint64_t blocks = (len + MULTI_BLOCK_LEN - 1) / MULTI_BLOCK_LEN;
+  struct block_job* jobs =
+      (struct block_job*)calloc(blocks, sizeof(struct block_job));
+  for (uint64_t i = 0; i < blocks; i++) {
+    jobs[i].dict = range->dict;
+    jobs[i].start = 20 + i * MULTI_BLOCK_LEN;
+    jobs[i].len = i + 1 < blocks ? MULTI_BLOCK_LEN : len - i * MULTI_BLOCK_LEN;
+    jobs[i].load = file_range_load;
+    jobs[i].arg = range;
+  }
+  int res = block_codec_run(config->blocks, jobs, blocks);
+  int64_t nbits = 0;
+  for (uint64_t i = 0; i < blocks; i++) {
+    nbits += jobs[i].bits;
+  }
+  free(jobs);
+  if (res < 0) {
+    return -1;
+  }
+
+  cached = range_cache_add(config->ranges, range->file, range->offset, len,
+                           range->dict, NULL, nbits);
+  range_cache_put(config->ranges, cached);
+  return nbits;
+}
+
+/*
+ * Give back the file handle and buffers held by a file range,
+ * once the streams still encoded ahead for it are done
+ */
+void file_range_release(struct file_range* range, struct buffer_pool* pool) {
+  if (range->jobs != NULL) {
+    if (range->submitted > 0) {
+      block_batch_wait(&range->batch);
+      block_batch_destory(&range->batch);
+    }
+    for (int i = range->stream_index; i < range->submitted; i++) {
+      free(range->jobs[i].out);
+    }
+    free(range->out);
+    range->out = NULL;
+    free(range->jobs);
+  }
+  if (range->file != NULL) {
+    file_cache_put(config->files, range->file);
+  }
+  free(range->bounds);
+  pool_put(pool, range->in);
+  pool_put(pool, range->out);
+  memset(range, 0, sizeof(struct file_range));
+}
+
+/*
+ * Encode a file range longer than a chunk in blocks on the block codec,
+ * and join the bits of the blocks
+ *  return the range added to the range cache, with a reference held
+ *         NULL: if the file can not be read
+ */
+struct cached_range* encoded_file_blocks(struct cached_file* file,
+                                         uint64_t offset,
+                                         uint64_t len,
+                                         struct dict* dict) {
+  // the blocks are loaded from after the fields, which are not encoded
+  struct file_range range;
+  memset(&range, 0, sizeof(struct file_range));
+  range.file = file;
+  range.offset = offset;
+
+  uint64_t blocks = (len + MULTI_BLOCK_LEN - 1) / MULTI_BLOCK_LEN;
+  struct block_job* jobs =
+      (struct block_job*)calloc(blocks, sizeof(struct block_job));
+  for (uint64_t i = 0; i < blocks; i++) {
+    jobs[i].dict = dict;
+    jobs[i].start = 20 + i * MULTI_BLOCK_LEN;
+    jobs[i].len = i + 1 < blocks ? MULTI_BLOCK_LEN : len - i * MULTI_BLOCK_LEN;
+    jobs[i].load = file_range_load;
+    jobs[i].arg = &range;
+    jobs[i].out = (uint8_t*)malloc(compress_stream_bound(jobs[i].len));
+  }
+  int res = block_codec_run(config->blocks, jobs, blocks);
+
+  uint64_t nbits = 0;
+  for (uint64_t i = 0; i < blocks; i++) {
+    nbits += jobs[i].bits;
+  }
+  uint8_t* bits = NULL;
+  if (res == 0) {
+    bits = (uint8_t*)malloc(nbits / 8 + 4 + compress_stream_bound(0));
+    struct compress_stream stream;
+    compress_stream_init(&stream);
+    uint8_t* out = bits;
+    for (uint64_t i = 0; i < blocks; i++) {
+      out += compress_stream_append(&stream, jobs[i].out, jobs[i].bits, out);
+    }
+    compress_stream_finish(&stream, out);
+  }
+  for (uint64_t i = 0; i < blocks; i++) {
+    free(jobs[i].out);
+  }
+  free(jobs);
+  if (res < 0) {
+    return NULL;
+  }
+  return range_cache_add(config->ranges, file, offset, len, dict, bits,
+                         nbits);
+}
+
+/*
+ * Get the encoded bits of a file range with dict from the range cache,
+ * the range is read and encoded on a miss, and added to the cache
+ *  return the range with a reference held, give it back with
+ *         range_cache_put
+ *         NULL: if the file can not be read
+ */
+struct cached_range* encoded_file_range(struct cached_file* file,
+                                        uint64_t offset,
+                                        uint64_t len,
+                                        struct dict* dict,
+                                        struct buffer_pool* pool) {
+  struct cached_range* range =
+      range_cache_get(config->ranges, file, offset, len, dict);
+  if (range != NULL && range->bits != NULL) {
+    return range;
+  }
+  if (range != NULL) {
+    range_cache_put(config->ranges, range);  // its count only
+  }
+  if (len > STREAM_CHUNK_LEN) {
+    return encoded_file_blocks(file, offset, len, dict);
+  }
+
+  // encode from the mapping if the file is mapped
+  uint8_t* data = NULL;
+  uint8_t* copy = NULL;
+  if (file->map != NULL) {
+    data = &file->map[offset];
+  } else {
+    copy = pool_get(pool, len);
+    if (read_file_range(file, copy, offset, len) < 0) {
+      pool_put(pool, copy);
+      return NULL;
+    }
+    data = copy;
+  }
+
+  // the padding byte written by compress_stream_finish is not kept
+  int64_t nbits = mapped_bits(dict, data, len);
+  if (nbits < 0) {
+    pool_put(pool, copy);
+    return NULL;
+  }
+  uint8_t* bits = (uint8_t*)malloc((nbits + 7) / 8 + 1);
+  struct compress_stream stream;
+  compress_stream_init(&stream);
+  int64_t n = mapped_encode(dict, &stream, data, len, bits);
+  pool_put(pool, copy);
+  if (n < 0) {
+    free(bits);
+    return NULL;
+  }
+  compress_stream_finish(&stream, &bits[n]);
+
+  return range_cache_add(config->ranges, file, offset, len, dict, bits,
+                         nbits);
+}
+
+/*
+ * Decide if a file range asked to be compressed is compressed, from
+ * its encoded length estimated on blocks of it like compress_estimate().
+ * the decision is not counted, the caller counts it
+ * multi - 1 if it is encoded in the multi stream format
+ *  return 1 if it is compressed, or if it can not be read
+ */
+int file_range_pays(struct cached_file* file,
+                    uint64_t offset,
+                    uint64_t len,
+                    struct dict* dict,
+                    struct buffer_pool* pool,
+                    int multi) {
+  uint64_t blocks = 1;
+  uint64_t block_len = len;
+  if (len > COMPRESS_SAMPLE_LEN) {
+    blocks = COMPRESS_SAMPLE_BLOCKS;
+    block_len = COMPRESS_SAMPLE_LEN / COMPRESS_SAMPLE_BLOCKS;
+  }
+
+  // sampled from the mapping if the file is mapped
+  uint64_t hist[DICT_SIZE] = {0};
+  uint8_t* buffer = file->map == NULL ? pool_get(pool, block_len) : NULL;
+  for (uint64_t i = 0; i < blocks; i++) {
+    uint64_t start = offset;
+    if (blocks > 1) {
+      start += (len - block_len) * i / (blocks - 1);
+    }
+    struct mapped_bytes bytes = {0};
+    bytes.in = buffer;
+    bytes.len = block_len;
+    bytes.hist = hist;
+    if (file->map != NULL) {
+      bytes.in = &file->map[start];
+    } else if (read_file_range(file, buffer, start, block_len) < 0) {
+      pool_put(pool, buffer);
+      return 1;  // fails when it is read to be sent
+    }
+    if (file_map_read(map_histogram, &bytes) < 0) {
+      pool_put(pool, buffer);
+      return 1;
+    }
+  }
+  pool_put(pool, buffer);
+
+  uint64_t encoded_len =
+      compress_estimate_histogram(dict, hist, blocks * block_len, len);
+  return compress_saves(len, encoded_len + multi_overhead(len + 20, multi));
+}
+
+/*
+ *  Provide retrieve file operation in thread handler
+ *  Modify the buffer to send
+ *  return the new payload length as int
+ */
+int retrieve_file(uint8_t** buffer_send,
+                  uint8_t** buffer_recv,
+                  struct conc_data* recv_data) {
+  if (recv_data->payload_len < 20) {
+    return -1;
+  }
+  int pl_len = (int)recv_data->payload_len;
+  struct dict* dict = recv_data->codec->dict;
+  struct decode_tree* tree = recv_data->codec->tree;
+
+  // decompress
+  if (recv_data->compd == 1) {
+    // a payload encoded with another dict can not be decoded
+    uint64_t skip = 0;
+    if (recv_data->dict_id == 1) {
+      uint32_t id_in32;
+      memcpy(&id_in32, recv_data->payload, sizeof(uint32_t));
+      if (ntohl(id_in32) != recv_data->codec->id) {
+        return -1;
+      }
+      skip = sizeof(uint32_t);
+    }
+    // decoded into a buffer of the pool, which replaces buffer_recv,
+    // the payload is read where it was received
+    uint64_t src_pl_len = recv_data->payload_len - skip;
+    uint8_t* src = &(*buffer_recv)[skip];
+    uint8_t* plain =
+        pool_get(recv_data->pool, decompress_bound(tree, src_pl_len) + 9);
+    memcpy(plain, *buffer_recv, 9);
+    if (recv_data->multi == 1) {
+      pl_len = block_decompress_multi(config->blocks, tree, &plain, &src,
+                                      src_pl_len);
+    } else {
+      pl_len = decompress(tree, &plain, &src, src_pl_len);
+    }
+    pool_put(recv_data->pool, *buffer_recv);
+    *buffer_recv = plain;
+    if (pl_len < 20) {
+      return -1;
+    }
+    modify_payload_len(*buffer_recv, pl_len);
+    setup_recv_size(recv_data, *buffer_recv);
+    setup_recv_payload(recv_data, *buffer_recv);
+  }
+
+  // create new session entry, served from a copy as the entry may
+  // expire before the request is done
+  struct id_entry* session = new_id_entry(
+      config->sessions, buffer_recv, (int)get_payload_length(*buffer_recv));
+  struct id_entry request = *session;
+  int res = session_id_storage_add(config->sessions, session);
+  if (res < 0) {
+    destory_id_entry(config->sessions, session);
+    (*buffer_send)[0] = 0x70;
+    modify_payload_len(*buffer_send, 0);
+    return 0;
+  }
+  if (config->session_ttl > 0) {
+    timer_init(&session->timer, session_expired, session);
+    timer_wheel_arm(config->timers, &session->timer, config->session_ttl);
+  }
+  session = &request;
+
+  // change buffer to error type if  file not found,
+  struct cached_file* file = file_cache_get(config->files, session->filename);
+  if (!file) {
+    (*buffer_send)[0] = 0xf0;
+    return 0;
+  }
+
+  // send error type if bad range
+  if (session->start_offset > file->size ||
+      session->data_len > file->size - session->start_offset) {
+    file_cache_put(config->files, file);
+    (*buffer_send)[0] = 0xf0;
+    return 0;
+  }
+
+  // a range asked to be compressed is sent raw if compression is shed
+  // or would not pay, as estimated from blocks of a multi stream range
+  // or of a range over a chunk. a single stream range up to
+  // RANGE_CACHE_MAX is then encoded and cached, so its encoded length
+  // is exact. one decision is counted per range
+  int cached = recv_data->multi == 0 && session->data_len <= RANGE_CACHE_MAX;
+  struct cached_range* encoded = NULL;
+  if (recv_data->req_comp == 1 && compress_shed()) {
+    recv_data->req_comp = 0;
+  } else if (recv_data->req_comp == 1 &&
+             (!cached || session->data_len > STREAM_CHUNK_LEN) &&
+             !file_range_pays(file, session->start_offset, session->data_len,
+                              dict, recv_data->pool, recv_data->multi)) {
+    stats_compress(STATS_BYPASSED);
+    recv_data->req_comp = 0;
+  } else if (recv_data->req_comp == 1 && cached) {
+    encoded = encoded_file_range(file, session->start_offset,
+                                 session->data_len, dict, recv_data->pool);
+    if (encoded == NULL) {
+      file_cache_put(config->files, file);
+      (*buffer_send)[0] = 0xf0;
+      return 0;
+    }
+    if (!compress_pays(session->data_len, (encoded->nbits + 7) / 8 + 1)) {
+      range_cache_put(config->ranges, encoded);
+      recv_data->req_comp = 0;
+    }
+  } else if (recv_data->req_comp == 1) {
+    stats_compress(STATS_COMPRESSED);
+  }
+
+  pl_len = 20;
+  if (recv_data->req_comp == 1) {
+    recv_data->plain_len = session->data_len + 20;
+  }
+
+  // copy id, star_offs, data_len into buffer_send,
+  // and overwrite payload length. raw unless compressed below, the
+  // dict id is added once compressed
+  memcpy(*buffer_send, *buffer_recv, 20 + 9);
+  modify_payload_len((*buffer_send), session->data_len + 20);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 1, 0);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 0, 0);
+
+  // compress a cached range in memory, the codes of the range are
+  // appended and only the 20 bytes before them are encoded each time
+  if (recv_data->req_comp == 1 && cached) {
+    file_cache_put(config->files, file);
+
+    uint8_t fields[20];
+    memcpy(fields, &(*buffer_send)[9], 20);
+    pool_reserve(buffer_send, compress_stream_bound(20) +
+                                  encoded->nbits / 8 + 4 +
+                                  compress_stream_bound(0) + 9);
+
+    struct compress_stream stream;
+    compress_stream_init(&stream);
+    uint8_t* out = &(*buffer_send)[9];
+    out += compress_stream_update(dict, &stream, fields, 20, out);
+    out += compress_stream_append(&stream, encoded->bits, encoded->nbits,
+                                  out);
+    out += compress_stream_finish(&stream, out);
+    range_cache_put(config->ranges, encoded);
+
+    // update payload length
+    pl_len = out - &(*buffer_send)[9];
+    modify_payload_len(*buffer_send, pl_len);
+
+    // modify compression state
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);  // compressed
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);  // req_compr
+  } else if (recv_data->req_comp == 1) {
+    // a longer or multi stream range is encoded by the caller while it
+    // is sent, with the fields. only the jump table of the multi
+    // stream format is in buffer_send.
+    // the payload length is counted ahead from the code lengths
+    struct file_range* range = &recv_data->range;
+    range->file = file;
+    range->offset = session->start_offset;
+    range->compress = 1;
+    range->dict = dict;
+    memcpy(range->fields, &(*buffer_send)[9], 20);
+    compress_stream_init(&range->stream);
+
+    uint64_t total = session->data_len + 20;
+    range->streams = recv_data->multi == 1 ? multi_stream_count(total) : 1;
+    range->bounds =
+        (uint64_t*)malloc((range->streams + 1) * sizeof(uint64_t));
+    uint64_t* stream_lens =
+        (uint64_t*)malloc(range->streams * sizeof(uint64_t));
+    int res = 0;
+    if (recv_data->multi == 1) {
+      multi_stream_bounds(total, range->bounds);
+      res = file_range_blocks(range, stream_lens);
+    } else {
+      range->bounds[0] = 0;
+      range->bounds[1] = total;
+      int64_t bits = file_range_bits(range, session->data_len);
+      res = bits < 0 ? -1 : 0;
+      bits += compress_bits(dict, range->fields, 20);
+      stream_lens[0] = (bits + 7) / 8 + 1;
+    }
+    if (res < 0) {
+      free(stream_lens);
+      file_range_release(range, recv_data->pool);
+      (*buffer_send)[0] = 0xf0;
+      modify_payload_len(*buffer_send, 0);
+      return 0;
+    }
+
+    uint64_t send_pl_len = 0;
+    for (int i = 0; i < range->streams; i++) {
+      send_pl_len += stream_lens[i];
+    }
+
+    pl_len = 0;
+    if (recv_data->multi == 1) {
+      pl_len = multi_table_len(total);
+      pool_reserve(buffer_send, pl_len + 9);
+      compress_multi_table(&(*buffer_send)[9], total, stream_lens);
+      send_pl_len += pl_len;
+      (*buffer_send)[0] = modify_bit((*buffer_send)[0], 1, 1);
+    }
+    free(stream_lens);
+    modify_payload_len(*buffer_send, send_pl_len);
+
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 2, 0);
+    (*buffer_send)[0] = modify_bit((*buffer_send)[0], 3, 1);
+  } else {
+    // the data is sent by the caller straight from the file after
+    // the 20 bytes in buffer_send, see send_file_range().
+    // the caller gives back the file handle when it is sent
+    recv_data->range.file = file;
+    recv_data->range.offset = session->start_offset;
+    recv_data->range.left = session->data_len;
+  }
+
+  // modify type
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 6, 1);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 5, 1);
+  (*buffer_send)[0] = modify_bit((*buffer_send)[0], 4, 1);
+
+  return pl_len;
+}
+
+/*
+ * Take the next stream of a multi stream range from the block codec,
+ * after submitting the streams up to RANGE_BLOCKS_AHEAD per thread
+ * after it, so they are encoded while it is sent
+ *  return 0: if out holds the stream
+ *        -1: if the file can not be read
+ */
+int file_range_next_block(struct file_range* range) {
+  if (range->submitted == 0) {
+    block_batch_init(&range->batch);
+  }
+  int ahead = RANGE_BLOCKS_AHEAD * config->blocks->threads;
+  while (range->submitted < range->streams &&
+         range->submitted <= range->stream_index + ahead) {
+    struct block_job* job = &range->jobs[range->submitted++];
+    job->arg = range;  // the range may have been copied since counted
+    job->out = (uint8_t*)malloc((job->bits + 7) / 8 + 1);
+    block_codec_submit(config->blocks, job, &range->batch);
+  }
+
+  struct block_job* job = &range->jobs[range->stream_index];
+  block_job_wait(job);
+  free(range->out);
+  range->out = job->out;
+  range->out_len = job->out_len;
+  range->out_sent = 0;
+  range->stream_index++;
+  range->finished = range->stream_index == range->streams;
+  return job->failed ? -1 : 0;
+}
+
+/*
+ * Encode the next chunk of a compressed range into out,
+ * or the last bits and padding of a stream once its data is encoded.
+ * the range is finished when the padding of the last stream is in out
+ *  return 0: if out holds the chunk
+ *        -1: if the file can not be read
+ */
+int file_range_encode(struct file_range* range, struct buffer_pool* pool) {
+  if (range->jobs != NULL) {
+    return file_range_next_block(range);
+  }
+  if (range->out == NULL) {
+    range->out = pool_get(pool, compress_stream_bound(STREAM_CHUNK_LEN));
+  }
+  range->out_sent = 0;
+  uint64_t end = range->bounds[range->stream_index + 1];
+  if (range->pos == end) {
+    range->out_len = compress_stream_finish(&range->stream, range->out);
+    compress_stream_init(&range->stream);
+    range->stream_index++;
+    range->finished = range->stream_index == range->streams;
+    return 0;
+  }
+
+  uint64_t n = end - range->pos;
+  uint8_t* chunk = file_range_chunk(range, range->pos, &n, pool);
+  if (chunk == NULL) {
+    return -1;
+  }
+  int64_t out_len =
+      mapped_encode(range->dict, &range->stream, chunk, n, range->out);
+  if (out_len < 0) {
+    return -1;
+  }
+  range->out_len = out_len;
+  range->pos += n;
+  return 0;
+}
+
+/*
+ * Send a file range after the response.
+ * a raw range is sent with sendfile, straight from the page cache.
+ * a compressed range is read and encoded one chunk at a time, and
+ * each chunk is sent before the next is read.
+ * at most SEND_CHUNK_LEN bytes are sent by a call, so the idle timer
+ * sees a slow client on a blocking socket making progress.
+ * the range is advanced by the bytes sent, so it can be resumed
+ *  return 1: if the range is fully sent
+ *         0: if the socket is full (non-blocking socket only)
+ *        -1: if the connection or the file is broken
+ */
+int send_file_range(int sock,
+                    struct file_range* range,
+                    struct buffer_pool* pool,
+                    struct idle_timer* idle) {
+  while (!range->compress && range->left > 0) {
+    off_t off = range->offset;
+    uint64_t len = range->left < SEND_CHUNK_LEN ? range->left : SEND_CHUNK_LEN;
+    ssize_t n = sendfile(sock, range->file->fd, &off, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    } else if (n == 0) {
+      return -1;  // file shrunk under us
+    }
+    range->offset += n;
+    range->left -= n;
+    idle_touch(idle);
+  }
+
+  while (range->compress) {
+    // send the pending encoded chunk, held back with MSG_MORE until
+    // the last one so a short one does not wait for a delayed ACK
+    while (range->out_sent < range->out_len) {
+      uint64_t len = range->out_len - range->out_sent;
+      len = len < SEND_CHUNK_LEN ? len : SEND_CHUNK_LEN;
+      int more = !range->finished || range->out_sent + len < range->out_len;
+      ssize_t n = send(sock, &range->out[range->out_sent], len,
+                       MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+      }
+      range->out_sent += n;
+      idle_touch(idle);
+    }
+    if (range->finished) {
+      break;
+    }
+    if (file_range_encode(range, pool) < 0) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Dispatch a complete request in buffer_recv to its operation,
+ * the response is left in buffer_send.
+ * return the number of bytes of buffer_send to send
+ */
+int process_request(uint8_t** buffer_send,
+                    uint8_t** buffer_recv,
+                    struct conc_data* recv_data) {
+  int send_payload_len;  // length of payload to send
+
+  // the dictionary of the whole request, even if a reload publishes
+  // another one meanwhile. given back by release_codec()
+  recv_data->codec = dict_store_get(config->dicts, &recv_data->codec_epoch);
+
+  switch (recv_data->type) {
+    case (int)0x0:
+      // echo
+      send_payload_len = echo(buffer_send, buffer_recv, recv_data);
+      break;
+    case (int)0x2:
+      // directory listing
+      send_payload_len = directory_listing(buffer_send, buffer_recv, recv_data,
+                                           config->listings);
+      break;
+    case (int)0x4:
+      // file size query
+      send_payload_len = size_query(buffer_send, buffer_recv, recv_data);
+      break;
+    case (int)0x6:
+      // retrieve file
+      send_payload_len = retrieve_file(buffer_send, buffer_recv, recv_data);
+      break;
+    case (int)0xa:
+      // statistics
+      send_payload_len = statistics(buffer_send, buffer_recv, recv_data);
+      break;
+    case (int)0xc:
+      // dictionary
+      send_payload_len = dictionary(buffer_send, buffer_recv, recv_data);
+      break;
+    default:
+      send_payload_len = -1;
+      break;
+  }
+
+  // error, send a header of error type only
+  if (send_payload_len < 0) {
+    (*buffer_send)[0] = 0xf0;  // or 0xf<<4
+    modify_payload_len(*buffer_send, 0);
+    send_payload_len = 0;
+  }
+
+  // name the dict a payload compressed by the server is encoded with,
+  // a compressed payload echoed back already names its own
+  if (recv_data->dict_id == 1 && recv_data->compd == 0 &&
+      recv_data->response == NULL && ith_bit((*buffer_send)[0], 3)) {
+    send_payload_len = add_dict_id(buffer_send, send_payload_len,
+                                   recv_data->codec->id);
+  }
+
+  return send_payload_len + 9;
+}
+
+/*
+ * Give back the dictionary of a request once its response is sent
+ */
+void release_codec(struct conc_data* recv_data) {
+  if (recv_data->codec != NULL) {
+    dict_store_put(config->dicts, recv_data->codec_epoch);
+    recv_data->codec = NULL;
+  }
+}
+
+/*
+ * Send all bytes of iovs on a blocking socket, resuming after short
+ * writes. iovs is advanced past the bytes sent.
+ * at most SEND_CHUNK_LEN bytes are sent by a call, so the idle timer
+ * sees a slow client making progress.
+ * flags - MSG_MORE if more of the response follows
+ * idle - timer of the connection, touched by every write
+ *  return 0: if everything is sent
+ *        -1: if the connection is broken
+ */
+int send_iovs(int sock,
+              struct iovec* iovs,
+              int n,
+              int flags,
+              struct idle_timer* idle) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(struct msghdr));
+  while (n > 0) {
+    // the iov crossing SEND_CHUNK_LEN is cut short for the call
+    int parts = 0;
+    uint64_t len = 0;
+    while (parts < n && len + iovs[parts].iov_len <= SEND_CHUNK_LEN) {
+      len += iovs[parts++].iov_len;
+    }
+    size_t cut = 0;
+    if (parts < n) {
+      cut = iovs[parts].iov_len - (SEND_CHUNK_LEN - len);
+      iovs[parts++].iov_len -= cut;
+    }
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = parts;
+    ssize_t sent = sendmsg(sock, &msg, flags | MSG_NOSIGNAL);
+    iovs[parts - 1].iov_len += cut;
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    idle_touch(idle);
+    while (n > 0 && (size_t)sent >= iovs->iov_len) {
+      sent -= iovs->iov_len;
+      iovs++;
+      n--;
+    }
+    if (n > 0) {
+      iovs->iov_base = (uint8_t*)iovs->iov_base + sent;
+      iovs->iov_len -= sent;
+    }
+  }
+  return 0;
+}
+
+/*
+ *  Thread handler
+ * agr - pointer to client socket generated from accept(),
+ *       freed by the handler
+ *
+ * requests are parsed from a read buffer filled by large reads, so
+ * pipelined requests take one recv for many. small responses are
+ * queued in an out buffer and sent together, with the next response
+ * that can not be queued or before waiting for more requests
+ */
+void* connection_handler(void* arg) {
+  int client_sock = *(int*)arg;
+  free(arg);
+
+  // info of the current request and buffers kept between requests
+  struct conc_data data;
+  struct conc_data* recv_data = &data;
+  struct buffer_pool pool = {0};
+  uint8_t* in = (uint8_t*)malloc(THREAD_IN_LEN);
+  uint64_t in_start = 0;  // first byte not parsed
+  uint64_t in_end = 0;
+  uint8_t* out = (uint8_t*)malloc(THREAD_OUT_LEN);
+  uint64_t out_len = 0;
+  struct idle_timer idle;
+  idle_start(&idle, client_sock);
+  stats_connection(1);
+
+  while (1) {
+    // Get 9 bytes header, reading more once the buffer is parsed
+    if (in_end - in_start < 9) {
+      struct iovec queued = {out, out_len};
+      if (send_iovs(client_sock, &queued, 1, 0, &idle) < 0) {
+        break;
+      }
+      out_len = 0;
+
+      memmove(in, &in[in_start], in_end - in_start);
+      in_end -= in_start;
+      in_start = 0;
+      ssize_t recvd = recv(client_sock, &in[in_end], THREAD_IN_LEN - in_end,
+                           0);
+      if (recvd < 0 && errno == EINTR) {
+        continue;
+      }
+      if (recvd <= 0) {
+        break;
+      }
+      in_end += recvd;
+      idle_touch(&idle);
+      continue;
+    }
+
+    // read and payload length
+    setup_recv_size(recv_data, &in[in_start]);
+    recv_data->pool = &pool;
+    recv_data->wire_len = recv_data->total_len;
+    recv_data->wire_compd = recv_data->compd;
+
+    // now we know the length, get a buffer of at least this size
+    uint8_t* buffer_recv = pool_get(&pool, recv_data->total_len);
+
+    // copy the header and the payload bytes already read
+    uint64_t avail = in_end - in_start;
+    uint64_t n = avail < recv_data->total_len ? avail : recv_data->total_len;
+    memcpy(buffer_recv, &in[in_start], n);
+    in_start += n;
+
+    // Get the rest of all data, after sending what is queued
+    if (n < recv_data->total_len) {
+      struct iovec queued = {out, out_len};
+      ssize_t recvd = 0;
+      if (send_iovs(client_sock, &queued, 1, 0, &idle) == 0) {
+        out_len = 0;
+        recvd = recv(client_sock, &buffer_recv[n], recv_data->total_len - n,
+                     MSG_WAITALL);
+      }
+      if (recvd < (ssize_t)(recv_data->total_len - n)) {
+        pool_put(&pool, buffer_recv);
+        break;
+      }
+    }
+
+    // read and store payload
+    setup_recv_payload(recv_data, buffer_recv);
+    uint64_t start_ns = stats_now_ns();
+
+    // get a send buffer and initilize all as 0
+    uint8_t* buffer_send = pool_get(&pool, BUFLEN + 9);
+    memset(buffer_send, 0x00, BUFLEN + 9);
+
+    if (recv_data->type == (int)0x8) {
+      // shutdown, after the responses queued before it
+      struct iovec queued = {out, out_len};
+      send_iovs(client_sock, &queued, 1, 0, &idle);
+      pool_put(&pool, buffer_send);
+      pool_put(&pool, buffer_recv);
+      pool_destory(&pool);
+      idle_stop(&idle);
+      close(client_sock);
+      pthread_exit(NULL);
+      exit(0);
+    }
+
+    idle_busy(&idle, 1);
+    int send_len = process_request(&buffer_send, &buffer_recv, recv_data);
+    idle_busy(&idle, 0);
+    uint8_t* response =
+        recv_data->response != NULL ? recv_data->response : buffer_send;
+
+    // queue a small response, otherwise send it with the queued ones
+    // and its slice at once, the header of a file range is held until
+    // the range follows
+    int res = 0;
+    uint64_t slice_len = recv_data->slice_len;
+    if (recv_data->range.file == NULL &&
+        send_len + slice_len <= THREAD_OUT_LEN - out_len) {
+      memcpy(&out[out_len], response, send_len);
+      out_len += send_len;
+      if (slice_len > 0) {
+        memcpy(&out[out_len], recv_data->slice, slice_len);
+        out_len += slice_len;
+      }
+    } else {
+      struct iovec iovs[3] = {{out, out_len},
+                              {response, send_len},
+                              {recv_data->slice, slice_len}};
+      int flags = recv_data->range.file != NULL ? MSG_MORE : 0;
+      res = send_iovs(client_sock, iovs, 3, flags, &idle);
+      out_len = 0;
+    }
+
+    if (recv_data->range.file != NULL) {
+      if (res == 0 && send_file_range(client_sock, &recv_data->range,
+                                      &pool, &idle) < 0) {
+        res = -1;
+      }
+      file_range_release(&recv_data->range, &pool);
+    }
+    count_request(recv_data, response, start_ns);
+    listing_cache_put(config->listings, recv_data->listing);
+    release_codec(recv_data);
+
+    // keep buffers for the next request
+    pool_put(&pool, buffer_send);
+    pool_put(&pool, buffer_recv);
+
+    // unknown type, close the connection after the error
+    if (!is_valid_type(recv_data->type) || res < 0) {
+      struct iovec queued = {out, out_len};
+      send_iovs(client_sock, &queued, 1, 0, &idle);
+      break;
+    }
+  }
+  free(in);
+  free(out);
+  pool_destory(&pool);
+  stats_connection(-1);
+  idle_stop(&idle);
+  close(client_sock);
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/*
+ * Raise the open file limit to its hard limit,
+ * so the event loop can hold as many connections as allowed
+ */
+void raise_fd_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+/*
+ * Close the socket of a connection and release everything it holds,
+ * the connection itself is freed by the caller
+ */
+void conn_release(struct connection* conn) {
+  idle_stop(&conn->idle);
+  close(conn->sock);
+
+  file_range_release(&conn->range, &conn->pool);
+  listing_cache_put(config->listings, conn->listing);
+  release_codec(&conn->recv_data);
+  pool_put(&conn->pool, conn->buffer_recv);
+  stats_connection(-1);
+  pool_put(&conn->pool, conn->buffer_send);
+  pool_destory(&conn->pool);
+}
+
+/*
+ * Release everything held by a connection of the event loop
+ */
+void conn_close(int epoll_fd, struct connection* conn) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+  conn_release(conn);
+  free(conn);
+}
+
+/*
+ * Count a fully sent response and give back what it held
+ */
+void conn_finish(struct connection* conn) {
+  count_request(&conn->recv_data, conn->response, conn->start_ns);
+  listing_cache_put(config->listings, conn->listing);
+  conn->listing = NULL;
+  release_codec(&conn->recv_data);
+  pool_put(&conn->pool, conn->buffer_send);
+  conn->buffer_send = NULL;
+  pool_put(&conn->pool, conn->buffer_recv);
+  conn->buffer_recv = NULL;
+}
+
+/*
+ * Fill iovs with what is left to send of the response of a
+ * connection and its slice
+ *  return the number of iovs, at most 2
+ */
+int response_iovs(struct connection* conn, struct iovec* iovs) {
+  int n = 0;
+  if (conn->sent < conn->send_len) {
+    iovs[n].iov_base = &conn->response[conn->sent];
+    iovs[n].iov_len = conn->send_len - conn->sent;
+    n++;
+  }
+  if (conn->slice_len > 0) {
+    uint64_t skip = conn->sent > conn->send_len ? conn->sent - conn->send_len
+                                                : 0;
+    iovs[n].iov_base = &conn->slice[skip];
+    iovs[n].iov_len = conn->slice_len - skip;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Send as much of the pending response as the socket takes,
+ * first buffer_send, then the file range if any
+ *  return 1: if the response is fully sent
+ *         0: if the socket is full, wait for EPOLLOUT
+ *        -1: if the connection is broken
+ */
+int conn_send(struct connection* conn) {
+  // the header of a file range is held until the range follows
+  int flags = MSG_NOSIGNAL | (conn->range.file != NULL ? MSG_MORE : 0);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(struct msghdr));
+  while (conn->sent < conn->send_len + conn->slice_len) {
+    struct iovec iovs[2];
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = response_iovs(conn, iovs);
+    ssize_t n = sendmsg(conn->sock, &msg, flags);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    conn->sent += n;
+    idle_touch(&conn->idle);
+  }
+
+  if (conn->range.file != NULL) {
+    int res =
+        send_file_range(conn->sock, &conn->range, &conn->pool, &conn->idle);
+    if (res != 1) {
+      return res;
+    }
+    file_range_release(&conn->range, &conn->pool);
+  }
+
+  conn_finish(conn);
+  return 1;
+}
+
+/*
+ * Run the request read by a connection,
+ * the response is left to send from conn->response
+ */
+void conn_prepare(struct connection* conn) {
+  struct conc_data* recv_data = &conn->recv_data;
+
+  // read and store payload
+  setup_recv_payload(recv_data, conn->buffer_recv);
+  conn->start_ns = stats_now_ns();
+
+  if (recv_data->type == (int)0x8) {
+    // shutdown
+    exit(0);
+  }
+
+  // get a send buffer and initilize all as 0
+  conn->buffer_send = pool_get(&conn->pool, BUFLEN + 9);
+  memset(conn->buffer_send, 0x00, BUFLEN + 9);
+
+  idle_busy(&conn->idle, 1);
+  conn->send_len =
+      process_request(&conn->buffer_send, &conn->buffer_recv, recv_data);
+  idle_busy(&conn->idle, 0);
+  conn->sent = 0;
+  conn->range = recv_data->range;
+  conn->listing = recv_data->listing;
+  conn->response =
+      recv_data->response != NULL ? recv_data->response : conn->buffer_send;
+  conn->slice = recv_data->slice;
+  conn->slice_len = recv_data->slice_len;
+
+  // unknown type, close the connection after the error,
+  // buffer_recv is given back once the response is sent
+  conn->close_after_send = !is_valid_type(recv_data->type);
+  conn->state = CONN_SEND;
+}
+
+/*
+ * Run the request read by a connection and start sending the response
+ *  return 1: if the response is fully sent
+ *         0: if the socket is full, wait for EPOLLOUT
+ *        -1: if the connection should be closed
+ */
+int conn_process(struct connection* conn) {
+  conn_prepare(conn);
+  int res = conn_send(conn);
+  if (res == 1 && conn->close_after_send) {
+    return -1;
+  }
+  return res;
+}
+
+/*
+ * Start reading the payload once the header of a connection is complete,
+ * now the payload length is known
+ */
+void conn_header(struct connection* conn) {
+  setup_recv_size(&conn->recv_data, conn->header);
+  conn->recv_data.pool = &conn->pool;
+  conn->recv_data.wire_len = conn->recv_data.total_len;
+  conn->recv_data.wire_compd = conn->recv_data.compd;
+  conn->buffer_recv = pool_get(&conn->pool, conn->recv_data.total_len);
+  memcpy(conn->buffer_recv, conn->header, 9);
+  conn->received = 0;
+  conn->state = CONN_READ_PAYLOAD;
+}
+
+/*
+ * Read whatever is available on a connection, advancing its state
+ * from header to payload, and process every complete request.
+ *  return 0: if waiting for more data or EPOLLOUT
+ *        -1: if the connection should be closed
+ */
+int conn_read(struct connection* conn) {
+  while (conn->state != CONN_SEND) {
+    uint8_t* ptr;
+    uint64_t to_read;
+    if (conn->state == CONN_READ_HEADER) {
+      ptr = &conn->header[conn->received];
+      to_read = 9 - conn->received;
+    } else {
+      ptr = &conn->buffer_recv[9 + conn->received];
+      to_read = conn->recv_data.payload_len - conn->received;
+    }
+
+    ssize_t recvd = 0;
+    if (to_read > 0) {
+      recvd = recv(conn->sock, ptr, to_read, 0);
+      if (recvd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
       } else if (recvd == 0) {
-        break;
+        return -1;  // closed by client
+      }
+      conn->received += recvd;
+      idle_touch(&conn->idle);
+      if ((uint64_t)recvd < to_read) {
+        continue;
       }
-      to_read -= recvd;
-      ptr += recvd;
     }
 
-    // read and store payload
-    setup_recv_payload(recv_data, buffer_recv);
+    conn->received = 0;
+    if (conn->state == CONN_READ_HEADER) {
+      conn_header(conn);
+    } else {
+      int res = conn_process(conn);
+      if (res != 1) {
+        return res;
+      }
+      conn->state = CONN_READ_HEADER;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Create the epoll instance of a loop, with the listening socket
+ * made non-blocking as its only entry without a connection
+ *  return the epoll fd
+ */
+int loop_init(int server_sock) {
+  struct epoll_event event;
 
-    // generate a send buffer and initilize all as 0
-    uint8_t* buffer_send = (uint8_t*)malloc(sizeof(uint8_t) * (BUFLEN + 9));
-    memset(buffer_send, 0x00, 1024 + 9);
+  raise_fd_limit();
+  fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL, 0) | O_NONBLOCK);
 
-    int send_payload_len;  // length of payload to send
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    puts("Epoll failed!");
+    exit(1);
+  }
 
-    switch (recv_data->type) {
-      case (int)0x0:
-        // echo
-        send_payload_len = echo(&buffer_send, &buffer_recv, recv_data);
-        send(client_sock, buffer_send, send_payload_len + 9, 0);
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &event);
+  return epoll_fd;
+}
 
-        break;
-      case (int)0x2:
-        // directory listing
-        send_payload_len = directory_listing(&buffer_send, &buffer_recv,
-                                             config->directory_path);
+/*
+ * Send the last part of a response at once. the parts before it are
+ * held back with MSG_MORE, or queued, so Nagle's algorithm would only
+ * delay that last segment until the delayed ACK of the client
+ */
+void set_nodelay(int sock) {
+  int option = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(int));
+}
 
-        send(client_sock, buffer_send, send_payload_len + 9, 0);
+/*
+ * Accept all pending connections and add them to the loop
+ * flags - epoll flags added to EPOLLIN
+ */
+void loop_accept(int epoll_fd, int server_sock, uint32_t flags) {
+  struct epoll_event event;
+  int client_sock;
+  while ((client_sock = accept4(server_sock, NULL, NULL, SOCK_NONBLOCK)) >=
+         0) {
+    struct connection* conn =
+        (struct connection*)calloc(1, sizeof(struct connection));
+    set_nodelay(client_sock);
+    conn->sock = client_sock;
+    conn->state = CONN_READ_HEADER;
+    conn->epoll_fd = epoll_fd;
+    conn->worker = -1;
+    idle_start(&conn->idle, client_sock);
+    stats_connection(1);
+
+    event.events = EPOLLIN | flags;
+    event.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &event);
+  }
+}
 
-        break;
-      case (int)0x4:
-        // file size query
-        send_payload_len = size_query(&buffer_send, &buffer_recv, recv_data);
+/*
+ * Serve a ready connection of a loop: finish sending the response,
+ * then read and process the requests available
+ *  return 0: if it waits for data, or for EPOLLOUT in CONN_SEND
+ *        -1: if the connection should be closed
+ */
+int conn_ready(struct connection* conn) {
+  int res = 0;
+  if (conn->state == CONN_SEND) {
+    res = conn_send(conn);
+    if (res == 1) {
+      if (conn->close_after_send) {
+        return -1;
+      }
+      conn->state = CONN_READ_HEADER;
+      res = conn_read(conn);
+    }
+  } else {
+    res = conn_read(conn);
+  }
+  return res < 0 ? -1 : 0;
+}
 
-        send(client_sock, buffer_send, send_payload_len + 9, 0);
+/*
+ * Event loop handler, serve every connection from this thread
+ * with non-blocking sockets and epoll.
+ * server_sock - listening socket
+ */
+void event_loop(int server_sock) {
+  struct epoll_event event;
+  struct epoll_event events[EPOLL_EVENTS_N];
+  int epoll_fd = loop_init(server_sock);
 
-        break;
-        break;
-      case (int)0x6:
-        // retrieve file
-        send_payload_len = retrieve_file(&buffer_send, &buffer_recv, recv_data);
-        send(client_sock, buffer_send, send_payload_len + 9, 0);
-        break;
-      case (int)0x8:
-        // shutdown
-        free(recv_data->payload);
-        free(recv_data);
-        free(buffer_send);
-        free(buffer_recv);
-        close(client_sock);
-        pthread_exit(NULL);
-        exit(0);
-        break;
-      default:
-        // error
-        buffer[0] = 0xf0;  // or 0xf<<4
-        for (int i = 1; i < 9; i++) {
-          buffer[i] = 0x00;
-        }
-        // send error type
-        send(client_sock, buffer, recv_data->total_len, 0);
-        close(client_sock);
-        break;
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, EPOLL_EVENTS_N, -1);
+
+    for (int i = 0; i < n; i++) {
+      struct connection* conn = (struct connection*)events[i].data.ptr;
+      if (conn == NULL) {
+        loop_accept(epoll_fd, server_sock, 0);
+        continue;
+      }
+
+      if (conn_ready(conn) < 0) {
+        conn_close(epoll_fd, conn);
+        continue;
+      }
+
+      // wait for the socket to drain while sending, otherwise for data
+      event.events = (conn->state == CONN_SEND) ? EPOLLOUT : EPOLLIN;
+      event.data.ptr = conn;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
     }
+  }
+}
 
-    //free memory
-    free(recv_data->payload);
-    free(recv_data);
-    free(buffer_send);
-    free(buffer_recv);
+/*
+ * Worker of the pool mode, serve a ready connection.
+ * the connection is registered with EPOLLONESHOT, so only this worker
+ * has it until it is armed again
+ */
+void pool_run(void* task, int worker) {
+  struct connection* conn = (struct connection*)task;
+  __atomic_store_n(&conn->worker, worker, __ATOMIC_RELAXED);
+  if (conn_ready(conn) < 0) {
+    conn_close(conn->epoll_fd, conn);
+    return;
   }
-  close(client_sock);
-  pthread_exit(NULL);
-  return NULL;
+
+  struct epoll_event event;
+  event.events =
+      ((conn->state == CONN_SEND) ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  event.data.ptr = conn;
+  epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->sock, &event);
 }
 
-int main(int argc, char** argv) {
-  // There should be a configuration file at argv[1]
-  if (argc != 2) {
-    puts("Invalid input");
+/*
+ * Pool loop handler, wait for ready connections with epoll on this
+ * thread and hand them to a fixed pool of workers.
+ * a connection goes to the deque of the worker that served it last,
+ * idle workers steal from the others
+ * server_sock - listening socket
+ */
+void pool_loop(int server_sock) {
+  struct epoll_event events[EPOLL_EVENTS_N];
+  int workers = config->workers > 0 ? config->workers : allowed_cpus(NULL);
+  struct work_pool* pool = work_pool_init(workers, pool_run);
+  int epoll_fd = loop_init(server_sock);
+
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, EPOLL_EVENTS_N, -1);
+
+    for (int i = 0; i < n; i++) {
+      struct connection* conn = (struct connection*)events[i].data.ptr;
+      if (conn == NULL) {
+        loop_accept(epoll_fd, server_sock, EPOLLONESHOT);
+        continue;
+      }
+      work_pool_submit(pool, conn,
+                       __atomic_load_n(&conn->worker, __ATOMIC_RELAXED));
+    }
+  }
+}
+
+/*
+ * Queue an operation of a connection, or of the listening socket if
+ * rc is NULL. a registered socket is named by its slot
+ *  return the entry to fill
+ */
+struct io_uring_sqe* ring_op(struct ring_loop* loop,
+                             struct ring_connection* rc,
+                             int op) {
+  struct io_uring_sqe* sqe = uring_get_sqe(&loop->ring);
+  if (sqe == NULL) {
+    puts("Uring failed!");
     exit(1);
   }
+  sqe->user_data = (uint64_t)(uintptr_t)rc | op;
+  if (rc != NULL) {
+    sqe->fd = rc->conn.sock;
+    if (rc->fixed) {
+      sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    rc->inflight++;
+  }
+  return sqe;
+}
 
-  // read config file
-  config = (struct configuration*)malloc(sizeof(struct configuration));
-  read_config(argv[1], config);
+/*
+ * Give back the buffer of a file chunk
+ */
+void ring_chunk_release(struct ring_loop* loop,
+                        struct ring_chunk* chunk,
+                        struct buffer_pool* pool) {
+  if (chunk->buffer == NULL) {
+    return;
+  }
+  if (chunk->index >= 0) {
+    loop->free[loop->free_n++] = chunk->index;
+  } else {
+    pool_put(pool, chunk->buffer);
+  }
+  memset(chunk, 0, sizeof(struct ring_chunk));
+}
+
+/*
+ * Close a connection of the io_uring loop,
+ * it is released once no operation is in flight
+ */
+void ring_close(struct ring_loop* loop, struct ring_connection* rc) {
+  if (rc->inflight > 0) {
+    // a receive in flight only completes once the socket is shut down
+    if (!rc->closing) {
+      shutdown(rc->conn.sock, SHUT_RDWR);
+    }
+    rc->closing = 1;
+    return;
+  }
+
+  if (rc->fixed) {
+    uring_set_file(&loop->ring, rc->conn.sock, -1);
+  }
+  for (int i = 0; i < 2; i++) {
+    ring_chunk_release(loop, &rc->chunks[i], &rc->conn.pool);
+  }
+  conn_release(&rc->conn);
+  free(rc->out);
+  free(rc);
+}
+
+/*
+ * Receive more of the request, a payload larger than the read ahead
+ * buffer is received straight into buffer_recv
+ */
+void ring_recv(struct ring_loop* loop, struct ring_connection* rc) {
+  struct connection* conn = &rc->conn;
+  struct io_uring_sqe* sqe = ring_op(loop, rc, RING_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  rc->receiving = 1;
+
+  uint64_t need = conn->recv_data.payload_len - conn->received;
+  rc->recv_direct = conn->state == CONN_READ_PAYLOAD && need > URING_IN_LEN;
+  if (rc->recv_direct) {
+    sqe->addr = (uint64_t)(uintptr_t)&conn->buffer_recv[9 + conn->received];
+    sqe->len = need;
+    return;
+  }
+
+  // keep the bytes not parsed yet at the front
+  memmove(rc->in, &rc->in[rc->in_start], rc->in_end - rc->in_start);
+  rc->in_end -= rc->in_start;
+  rc->in_start = 0;
+  sqe->addr = (uint64_t)(uintptr_t)&rc->in[rc->in_end];
+  sqe->len = URING_IN_LEN - rc->in_end;
+}
+
+/*
+ * Read the next chunk of a raw file range while the previous one
+ * is sent, into a registered buffer if one is free
+ */
+void ring_read_ahead(struct ring_loop* loop, struct ring_connection* rc) {
+  struct file_range* range = &rc->conn.range;
+  struct ring_chunk* chunk = &rc->chunks[rc->read_chunk];
+  if (rc->reading || range->left == 0 || chunk->ready) {
+    return;
+  }
+
+  if (chunk->buffer == NULL) {
+    chunk->index = -1;
+    if (loop->free_n > 0) {
+      chunk->index = loop->free[--loop->free_n];
+      chunk->buffer = loop->buffers + chunk->index * STREAM_CHUNK_LEN;
+    } else {
+      chunk->buffer = pool_get(&rc->conn.pool, STREAM_CHUNK_LEN);
+    }
+  }
+
+  struct io_uring_sqe* sqe = ring_op(loop, rc, RING_READ);
+  sqe->opcode = IORING_OP_READ;
+  if (chunk->index >= 0) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = chunk->index;
+  }
+  sqe->flags = 0;  // the file is not registered, only sockets are
+  sqe->fd = range->file->fd;
+  sqe->addr = (uint64_t)(uintptr_t)chunk->buffer;
+  sqe->len = range->left < STREAM_CHUNK_LEN ? range->left : STREAM_CHUNK_LEN;
+  sqe->off = range->offset;
+  rc->reading = 1;
+}
+
+void ring_parse(struct ring_loop* loop, struct ring_connection* rc);
+
+/*
+ * Send the next part of the response: the responses batched before it,
+ * buffer_send, then the file range chunk by chunk.
+ * once all is sent the next request is read
+ */
+void ring_send(struct ring_loop* loop, struct ring_connection* rc) {
+  struct connection* conn = &rc->conn;
+  struct file_range* range = &conn->range;
+  uint8_t* data = NULL;
+  uint64_t len = 0;
+  int more = 0;  // more of the response follows, not worth a packet alone
+
+  // the first chunk is read while the batch is sent
+  if (range->file != NULL && !range->compress && range->file->map == NULL) {
+    ring_read_ahead(loop, rc);
+  }
+
+  if (rc->out_sent < rc->out_len) {
+    rc->send_target = RING_SEND_BATCH;
+    data = &rc->out[rc->out_sent];
+    len = rc->out_len - rc->out_sent;
+    more = conn->state == CONN_SEND && range->file != NULL;
+  } else if (conn->sent < conn->send_len + conn->slice_len) {
+    // the response and its slice in one message
+    rc->send_target = RING_SEND_RESPONSE;
+    memset(&rc->msg, 0, sizeof(struct msghdr));
+    rc->msg.msg_iov = rc->iovs;
+    rc->msg.msg_iovlen = response_iovs(conn, rc->iovs);
+    struct io_uring_sqe* sqe = ring_op(loop, rc, RING_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&rc->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (range->file != NULL ? MSG_MORE : 0);
+    rc->sending = 1;
+    return;
+  } else if (range->file != NULL && range->compress) {
+    while (range->out_sent == range->out_len && !range->finished) {
+      if (file_range_encode(range, &conn->pool) < 0) {
+        ring_close(loop, rc);
+        return;
+      }
+    }
+    rc->send_target = RING_SEND_ENCODED;
+    data = &range->out[range->out_sent];
+    len = range->out_len - range->out_sent;
+    more = !range->finished;
+  } else if (range->file != NULL && range->file->map != NULL) {
+    rc->send_target = RING_SEND_MAPPED;
+    data = &range->file->map[range->offset];
+    len = range->left;
+  } else if (range->file != NULL) {
+    struct ring_chunk* chunk = &rc->chunks[rc->send_chunk];
+    if (!chunk->ready && rc->reading) {
+      return;  // sent when read
+    }
+    rc->send_target = RING_SEND_CHUNK;
+    data = &chunk->buffer[chunk->sent];
+    len = chunk->len - chunk->sent;
+    more = range->left > 0 || rc->reading;
+  }
+
+  if (len > 0) {
+    struct io_uring_sqe* sqe = ring_op(loop, rc, RING_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    rc->sending = 1;
+    return;
+  }
+
+  // the whole response is sent
+  for (int i = 0; i < 2; i++) {
+    ring_chunk_release(loop, &rc->chunks[i], &conn->pool);
+  }
+  rc->read_chunk = 0;
+  rc->send_chunk = 0;
+  file_range_release(range, &conn->pool);
+  conn_finish(conn);
+  if (conn->close_after_send) {
+    ring_close(loop, rc);
+    return;
+  }
+  conn->state = CONN_READ_HEADER;
+  ring_parse(loop, rc);
+}
+
+/*
+ * Parse the requests received ahead and process the complete ones.
+ * a small response is batched and the next request parsed, a file
+ * range or a large response is sent first. once more data is needed
+ * the batch is sent while more is received
+ */
+void ring_parse(struct ring_loop* loop, struct ring_connection* rc) {
+  struct connection* conn = &rc->conn;
+  while (conn->state != CONN_SEND) {
+    uint64_t avail = rc->in_end - rc->in_start;
+    if (conn->state == CONN_READ_HEADER) {
+      if (avail < 9) {
+        break;
+      }
+      memcpy(conn->header, &rc->in[rc->in_start], 9);
+      rc->in_start += 9;
+      conn_header(conn);
+      continue;
+    }
+
+    uint64_t need = conn->recv_data.payload_len - conn->received;
+    uint64_t n = avail < need ? avail : need;
+    memcpy(&conn->buffer_recv[9 + conn->received], &rc->in[rc->in_start],
+           n);
+    rc->in_start += n;
+    conn->received += n;
+    if (n < need) {
+      break;
+    }
+    if (rc->sending) {
+      return;  // out is in use, parsed again once it is sent
+    }
+
+    conn_prepare(conn);
+    uint64_t total = conn->send_len + conn->slice_len;
+    if (total <= URING_OUT_LEN - rc->out_len) {
+      if (rc->out == NULL) {
+        rc->out = (uint8_t*)malloc(URING_OUT_LEN);
+      }
+      memcpy(&rc->out[rc->out_len], conn->response, conn->send_len);
+      if (conn->slice_len > 0) {
+        memcpy(&rc->out[rc->out_len + conn->send_len], conn->slice,
+               conn->slice_len);
+      }
+      rc->out_len += total;
+      conn->sent = total;
+    }
+    if (conn->range.file != NULL || conn->close_after_send ||
+        conn->sent < total) {
+      ring_send(loop, rc);
+      return;
+    }
+    conn_finish(conn);
+    conn->state = CONN_READ_HEADER;
+  }
+
+  if (!rc->sending && rc->out_len > 0) {
+    ring_send(loop, rc);
+  }
+  if (!rc->receiving) {
+    ring_recv(loop, rc);
+  }
+}
+
+/*
+ * Accept the next connection
+ */
+void ring_accept(struct ring_loop* loop, int server_sock) {
+  struct io_uring_sqe* sqe = ring_op(loop, NULL, RING_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server_sock;
+}
+
+/*
+ * Handle the completion of an operation of a connection
+ */
+void ring_complete(struct ring_loop* loop,
+                   struct ring_connection* rc,
+                   int op,
+                   int res) {
+  struct connection* conn = &rc->conn;
+  rc->inflight--;
+  if (rc->closing) {
+    ring_close(loop, rc);
+    return;
+  }
+
+  if (op == RING_RECV) {
+    rc->receiving = 0;
+    if (res <= 0) {
+      ring_close(loop, rc);  // closed by client, or broken
+      return;
+    }
+    if (rc->recv_direct) {
+      conn->received += res;
+    } else {
+      rc->in_end += res;
+    }
+    idle_touch(&conn->idle);
+    ring_parse(loop, rc);
+  } else if (op == RING_READ) {
+    rc->reading = 0;
+    if (res <= 0) {
+      ring_close(loop, rc);  // file shrunk under us
+      return;
+    }
+    struct ring_chunk* chunk = &rc->chunks[rc->read_chunk];
+    chunk->len = res;
+    chunk->sent = 0;
+    chunk->ready = 1;
+    conn->range.offset += res;
+    conn->range.left -= res;
+    rc->read_chunk ^= 1;
+    ring_read_ahead(loop, rc);
+    if (!rc->sending) {
+      ring_send(loop, rc);
+    }
+  } else {
+    rc->sending = 0;
+    if (res < 0) {
+      ring_close(loop, rc);
+      return;
+    }
+    idle_touch(&conn->idle);
+    if (rc->send_target == RING_SEND_BATCH) {
+      rc->out_sent += res;
+      if (rc->out_sent == rc->out_len) {
+        rc->out_sent = 0;
+        rc->out_len = 0;
+      }
+    } else if (rc->send_target == RING_SEND_RESPONSE) {
+      conn->sent += res;
+    } else if (rc->send_target == RING_SEND_ENCODED) {
+      conn->range.out_sent += res;
+    } else if (rc->send_target == RING_SEND_MAPPED) {
+      conn->range.offset += res;
+      conn->range.left -= res;
+    } else {
+      struct ring_chunk* chunk = &rc->chunks[rc->send_chunk];
+      chunk->sent += res;
+      if (chunk->sent == chunk->len) {
+        chunk->ready = 0;
+        rc->send_chunk ^= 1;
+      }
+    }
+    if (conn->state == CONN_SEND) {
+      ring_send(loop, rc);
+    } else {
+      ring_parse(loop, rc);
+    }
+  }
+}
+
+/*
+ * io_uring loop, serve every connection from this thread.
+ * receives, file reads and sends are queued to the ring and submitted
+ * together with the wait for completions, one system call per batch.
+ * falls back to the event loop if io_uring is not available
+ * server_sock - listening socket
+ */
+void uring_loop(int server_sock) {
+  struct ring_loop* loop =
+      (struct ring_loop*)calloc(1, sizeof(struct ring_loop));
+  if (uring_init(&loop->ring, URING_ENTRIES) < 0) {
+    puts("Uring failed, using epoll");
+    free(loop);
+    event_loop(server_sock);
+    return;
+  }
+  raise_fd_limit();
+
+  // registration is optional, it may exceed the locked memory limit
+  if (uring_register_files(&loop->ring, URING_FILES) == 0) {
+    loop->files = URING_FILES;
+  }
+  if (posix_memalign((void**)&loop->buffers, 4096,
+                     URING_BUFFERS * STREAM_CHUNK_LEN) == 0) {
+    struct iovec iovs[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+      iovs[i].iov_base = loop->buffers + i * STREAM_CHUNK_LEN;
+      iovs[i].iov_len = STREAM_CHUNK_LEN;
+    }
+    if (uring_register_buffers(&loop->ring, iovs, URING_BUFFERS) == 0) {
+      for (int i = 0; i < URING_BUFFERS; i++) {
+        loop->free[loop->free_n++] = i;
+      }
+    }
+  }
+
+  ring_accept(loop, server_sock);
+  while (1) {
+    if (uring_submit(&loop->ring, 1) < 0) {
+      puts("Uring failed!");
+      exit(1);
+    }
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+      uint64_t user_data = cqe->user_data;
+      int res = cqe->res;
+      uring_cqe_seen(&loop->ring);
+
+      int op = user_data & RING_OP_MASK;
+      struct ring_connection* rc =
+          (struct ring_connection*)(uintptr_t)(user_data & ~RING_OP_MASK);
+      if (op != RING_ACCEPT) {
+        ring_complete(loop, rc, op, res);
+        continue;
+      }
+
+      ring_accept(loop, server_sock);
+      if (res < 0) {
+        continue;
+      }
+      set_nodelay(res);
+      rc = (struct ring_connection*)calloc(1, sizeof(struct ring_connection));
+      rc->conn.sock = res;
+      rc->conn.state = CONN_READ_HEADER;
+      rc->fixed = res < loop->files &&
+                  uring_set_file(&loop->ring, res, res) == 0;
+      idle_start(&rc->conn.idle, res);
+      stats_connection(1);
+      ring_parse(loop, rc);
+    }
+  }
+}
+
+/*
+ * Reload thread, publish the dictionary file again on every SIGHUP.
+ * requests in flight finish with the dictionary they started with
+ */
+void* reload_handler(void* arg) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+
+  while (1) {
+    int sig;
+    if (sigwait(&signals, &sig) != 0) {
+      continue;
+    }
+    if (dict_store_reload(config->dicts) < 0) {
+      puts("Dict failed!");
+    }
+  }
+  return NULL;
+}
 
-  // socket
-  int serverSock = -1;
+/*
+ * Open the listening socket of the configured address,
+ * reuseport - 1 if other shards listen on the same port
+ *  return the socket, exit if it can not be bound
+ */
+int open_listener(int reuseport) {
   int option = 1;
   struct sockaddr_in address;
-  serverSock = socket(AF_INET, SOCK_STREAM, 0);
+  int serverSock = socket(AF_INET, SOCK_STREAM, 0);
   if (serverSock < 0) {
     puts("Sock failed!");
     exit(1);
@@ -573,8 +2914,10 @@ int main(int argc, char** argv) {
   address.sin_addr.s_addr = config->ip;
   address.sin_port = htons(config->port);
 
-  setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &option,
-             sizeof(int));
+  setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(int));
+  if (reuseport) {
+    setsockopt(serverSock, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(int));
+  }
 
   // bind
   if (bind(serverSock, (struct sockaddr*)&address, sizeof(address)) < 0) {
@@ -583,33 +2926,213 @@ int main(int argc, char** argv) {
   }
 
   // listen
-  listen(serverSock, 10);
+  listen(serverSock, SOMAXCONN);
+  return serverSock;
+}
+
+/*
+ * Accept loop of the thread mode, one thread per connection
+ * server_sock - listening socket
+ */
+void accept_loop(int server_sock) {
+  while (1) {
+    // accept
+    int* client_sock = (int*)malloc(sizeof(int));
+    *client_sock = accept(server_sock, NULL, NULL);
+    if (*client_sock < 0) {
+      free(client_sock);
+      continue;
+    }
+    set_nodelay(*client_sock);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, connection_handler, (void*)client_sock);
+    pthread_detach(tid);
+  }
+}
+
+/*
+ * Serve the connections of a listening socket in the configured mode
+ */
+void serve(int server_sock) {
+  if (config->mode == MODE_EPOLL) {
+    event_loop(server_sock);
+  } else if (config->mode == MODE_POOL) {
+    pool_loop(server_sock);
+  } else if (config->mode == MODE_URING) {
+    uring_loop(server_sock);
+  } else {
+    accept_loop(server_sock);
+  }
+}
 
-  // thread index
-  int tid_idx = 0;
+/*
+ * Shard thread, pin itself to the CPU of the shard and serve its
+ * listening socket. threads it creates inherit the CPU
+ */
+void* shard_handler(void* arg) {
+  struct shard* shard = (struct shard*)arg;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(shard->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+
+  serve(shard->sock);
+  return NULL;
+}
 
-  // thread array
-  pthread_t tids[PTHREAD_N];
+/*
+ * Serve with n shards, one per CPU the process may run on if n is 0.
+ * every shard has its own listening socket on the port, and the kernel
+ * spreads new connections over them. main serves the first shard
+ */
+void start_shards(int n) {
+  int cpus[CPU_SETSIZE];
+  int cpus_n = allowed_cpus(cpus);
+  if (n == 0) {
+    n = cpus_n;
+  }
 
-  // client sockat array
-  int client_socks[PTHREAD_N];
+  // all sockets are bound before any shard accepts
+  struct shard* shards = (struct shard*)calloc(n, sizeof(struct shard));
+  for (int i = 0; i < n; i++) {
+    shards[i].sock = open_listener(1);
+    shards[i].cpu = cpus[i % cpus_n];
+  }
+  for (int i = 1; i < n; i++) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, shard_handler, &shards[i]);
+    pthread_detach(tid);
+  }
+  shard_handler(&shards[0]);
+}
 
-  while (1) {
-    // accept
-    uint32_t addrlen = sizeof(struct sockaddr_in);
-    client_socks[tid_idx] =
-        accept(serverSock, (struct sockaddr*)&address, &addrlen);
+int main(int argc, char** argv) {
+  // There should be a configuration file after the options
+  config = (struct configuration*)calloc(1, sizeof(struct configuration));
+  config->mode = MODE_THREAD;
+  config->dict_path = DICT_PATH;
+  config->shards = -1;
+  int session_ttl = SESSION_TTL;
+  int idle_timeout = IDLE_TIMEOUT;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "emuw:b:c:d:s:t:i:T")) != -1) {
+    switch (opt) {
+      case 'e':
+        config->mode = MODE_EPOLL;
+        break;
+      case 'u':
+        config->mode = MODE_URING;
+        break;
+      case 'b':
+        config->block_threads = atoi(optarg);
+        if (config->block_threads < 0) {
+          puts("Invalid input");
+          exit(1);
+        }
+        break;
+      case 'c':
+        config->shed_load = atoi(optarg);
+        if (config->shed_load < 0) {
+          puts("Invalid input");
+          exit(1);
+        }
+        break;
+      case 'w':
+        config->mode = MODE_POOL;
+        config->workers = atoi(optarg);
+        if (config->workers < 0) {
+          puts("Invalid input");
+          exit(1);
+        }
+        break;
+      case 'm':
+        config->use_mmap = 1;
+        break;
+      case 'd':
+        config->dict_path = optarg;
+        break;
+      case 's':
+        config->shards = atoi(optarg);
+        if (config->shards < 0) {
+          puts("Invalid input");
+          exit(1);
+        }
+        break;
+      case 't':
+        session_ttl = atoi(optarg);
+        if (session_ttl < 0) {
+          puts("Invalid input");
+          exit(1);
+        }
+        break;
+      case 'i':
+        idle_timeout = atoi(optarg);
+        if (idle_timeout < 0) {
+          puts("Invalid input");
+          exit(1);
+        }
+        break;
+      case 'T':
+        config->train = 1;
+        break;
+      default:
+        puts("Invalid input");
+        exit(1);
+    }
+  }
+  if (optind != argc - 1) {
+    puts("Invalid input");
+    exit(1);
+  }
+  config->session_ttl = (uint64_t)session_ttl * 1000 / TIMER_TICK_MS;
+  config->idle_ticks = (uint64_t)idle_timeout * 1000 / TIMER_TICK_MS;
+
+  // read config file
+  read_config(argv[optind], config);
+  if (config->train) {
+    int64_t id = dict_store_train(config->directory_path, config->dict_path);
+    if (id < 0) {
+      puts("Dict failed!");
+      exit(1);
+    }
+    printf("Dict %08x written to %s\n", (uint32_t)id, config->dict_path);
+    exit(0);
+  }
+
+  // SIGHUP is only taken by the reload thread, every thread inherits
+  // the mask of main
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // sendfile has no MSG_NOSIGNAL, a closed client is seen as EPIPE
+  signal(SIGPIPE, SIG_IGN);
+
+  stats_init();
+  setup_config(config);
+
+  pthread_t reload_tid;
+  pthread_create(&reload_tid, NULL, reload_handler, NULL);
+  pthread_detach(reload_tid);
 
-    pthread_create(&tids[tid_idx], NULL, connection_handler,
-                   (void*)(&client_socks[tid_idx]));
-    pthread_detach(tids[tid_idx]);
-    tid_idx += 1;
+  if (config->shards >= 0) {
+    start_shards(config->shards);
+  } else {
+    serve(open_listener(0));
   }
 
   // free memopoy, but this part will not be reached
+  timer_wheel_destory(config->timers);
   session_id_storage_destory(config->sessions);
-  destory_decode_tree(config->decode_tree);
-  free(config->dict);
+  file_cache_destory(config->files);
+  listing_cache_destory(config->listings);
+  size_cache_destory(config->sizes);
+  dir_watch_destory(config->watch);
+  range_cache_destory(config->ranges);
+  dict_store_destory(config->dicts);
   free(config);
 
   return 0;
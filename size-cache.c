@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "size-cache.h"
+
+/*
+  FNV-1a hash of a filename
+*/
+static uint32_t hash_filename(char* filename) {
+  uint32_t h = 2166136261u;
+  for (char* c = filename; *c != '\0'; c++) {
+    h ^= (uint8_t)*c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+  Stat filename relative to the directory
+  return the size: if it is a regular file
+         -1: otherwise
+*/
+static int64_t stat_size(struct size_cache* cache, char* filename) {
+  struct statx stx;
+  if (statx(cache->dir_fd, filename, AT_STATX_SYNC_AS_STAT,
+            STATX_TYPE | STATX_SIZE, &stx) < 0) {
+    return -1;
+  }
+  if (!(stx.stx_mask & STATX_TYPE) || !S_ISREG(stx.stx_mode)) {
+    return -1;
+  }
+  return (int64_t)stx.stx_size;
+}
+
+struct size_cache* size_cache_init(char* directory_path,
+                                   struct dir_watch* watch) {
+  int dir_fd = open(directory_path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return NULL;
+  }
+
+  struct size_cache* cache =
+      (struct size_cache*)calloc(1, sizeof(struct size_cache));
+  cache->dir_fd = dir_fd;
+  cache->watch = watch;
+  for (int i = 0; i < SIZE_CACHE_STRIPES; i++) {
+    pthread_mutex_init(&cache->stripes[i].lock, NULL);
+  }
+  return cache;
+}
+
+int64_t size_cache_get(struct size_cache* cache, char* filename) {
+  // an empty name marks an unused slot
+  if (filename[0] == '\0') {
+    return -1;
+  }
+
+  // names longer than an entry are never cached
+  if (strlen(filename) >= FILENAME_LEN) {
+    return stat_size(cache, filename);
+  }
+
+  uint32_t slot = hash_filename(filename) & (SIZE_CACHE_SLOTS - 1);
+  struct size_entry* entry = &cache->slots[slot];
+  pthread_mutex_t* lock =
+      &cache->stripes[slot & (SIZE_CACHE_STRIPES - 1)].lock;
+
+  pthread_mutex_lock(lock);
+  if (dir_watch_valid(cache->watch, 1, entry->gen) &&
+      strcmp(entry->filename, filename) == 0) {
+    int64_t size = entry->size;
+    pthread_mutex_unlock(lock);
+    return size;
+  }
+  pthread_mutex_unlock(lock);
+
+  // a write during the stat makes the new entry invalid at once
+  uint64_t gen = dir_watch_generation(cache->watch, 1);
+  int64_t size = stat_size(cache, filename);
+  if (size < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(lock);
+  strcpy(entry->filename, filename);
+  entry->size = size;
+  entry->gen = gen;
+  pthread_mutex_unlock(lock);
+
+  return size;
+}
+
+void size_cache_destory(struct size_cache* cache) {
+  for (int i = 0; i < SIZE_CACHE_STRIPES; i++) {
+    pthread_mutex_destroy(&cache->stripes[i].lock);
+  }
+  close(cache->dir_fd);
+  free(cache);
+}
@@ -0,0 +1,68 @@
+#ifndef SIZE_CACHE_H /* guard */
+#define SIZE_CACHE_H
+
+/*
+  File size cache.
+  Answer size queries from a table of recent sizes, without any
+  syscall, and stat the file relative to the held directory fd on
+  a miss.
+
+  Entries are valid while the files generation of the directory watch
+  is the one they were read at, so any write in the directory drops
+  them all. The table is direct mapped, a new entry replaces the one
+  in its slot, and slots are locked by stripes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dir-watch.h"
+#include "id-storage.h"
+
+#define SIZE_CACHE_SLOTS (1024)  // cached sizes, power of 2
+#define SIZE_CACHE_STRIPES (64)  // independently locked stripes, power of 2
+
+/*the size of a file, at a files generation of the watch*/
+struct size_entry {
+  char filename[FILENAME_LEN];  // empty if the slot is not used
+  uint64_t size;
+  uint64_t gen;
+};
+
+/*lock of the slots whose index is the stripe index modulo stripes*/
+struct size_stripe {
+  pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+/*direct mapped table of sizes*/
+struct size_cache {
+  int dir_fd;  // the served directory, files are stat relative to it
+  struct dir_watch* watch;
+
+  struct size_stripe stripes[SIZE_CACHE_STRIPES];
+  struct size_entry slots[SIZE_CACHE_SLOTS];
+};
+
+/*
+  initilize a size cache for files under directory_path, kept valid
+  by watch
+  return NULL if the directory can not be opened
+*/
+struct size_cache* size_cache_init(char* directory_path,
+                                   struct dir_watch* watch);
+
+/*
+  Get the size of a regular file under the directory
+  return the size: if found the file
+         -1: if the file is not found or not a regular file
+*/
+int64_t size_cache_get(struct size_cache* cache, char* filename);
+
+/*
+  Free all memory usage of size cache, the watch is not freed
+*/
+void size_cache_destory(struct size_cache* cache);
+
+#endif //SIZE_CACHE_H
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include "stats.h"
+
+/* counters of a slot are the uint64 before its links */
+#define SLOT_COUNTERS (offsetof(struct stats_slot, prev) / sizeof(uint64_t))
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slot* slots;     // slots of running threads
+static struct stats_slot retired;    // totals of exited threads
+static pthread_key_t slot_key;       // folds the slot of an exiting thread
+static uint64_t start_ns;
+static __thread struct stats_slot* thread_slot;
+
+/*
+  Add v to a counter of the slot of this thread,
+  a plain add, the store is atomic only so snapshots read whole values
+*/
+static inline void slot_add(uint64_t* counter, uint64_t v) {
+  __atomic_store_n(counter, *counter + v, __ATOMIC_RELAXED);
+}
+
+/*
+  Fold the slot of an exiting thread into the retired totals
+*/
+static void retire_slot(void* arg) {
+  struct stats_slot* slot = (struct stats_slot*)arg;
+  uint64_t* from = (uint64_t*)slot;
+  uint64_t* to = (uint64_t*)&retired;
+
+  pthread_mutex_lock(&slots_lock);
+  for (size_t i = 0; i < SLOT_COUNTERS; i++) {
+    to[i] += from[i];
+  }
+  if (slot->prev != NULL) {
+    slot->prev->next = slot->next;
+  } else {
+    slots = slot->next;
+  }
+  if (slot->next != NULL) {
+    slot->next->prev = slot->prev;
+  }
+  pthread_mutex_unlock(&slots_lock);
+
+  free(slot);
+}
+
+/*
+  Return the slot of this thread, created by the first count
+*/
+static struct stats_slot* get_slot() {
+  if (thread_slot != NULL) {
+    return thread_slot;
+  }
+
+  struct stats_slot* slot;
+  if (posix_memalign((void**)&slot, 64, sizeof(struct stats_slot)) != 0) {
+    return NULL;
+  }
+  memset(slot, 0, sizeof(struct stats_slot));
+
+  pthread_mutex_lock(&slots_lock);
+  slot->next = slots;
+  if (slots != NULL) {
+    slots->prev = slot;
+  }
+  slots = slot;
+  pthread_mutex_unlock(&slots_lock);
+
+  pthread_setspecific(slot_key, slot);
+  thread_slot = slot;
+  return slot;
+}
+
+void stats_init() {
+  pthread_key_create(&slot_key, retire_slot);
+  start_ns = stats_now_ns();
+}
+
+uint64_t stats_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int stats_type_index(int type) {
+  switch (type) {
+    case 0x0:
+      return STATS_ECHO;
+    case 0x2:
+      return STATS_LISTING;
+    case 0x4:
+      return STATS_SIZE;
+    case 0x6:
+      return STATS_RETRIEVE;
+    case 0xa:
+      return STATS_STATS;
+    case 0xc:
+      return STATS_DICT;
+    default:
+      return STATS_OTHER;
+  }
+}
+
+void stats_connection(int delta) {
+  struct stats_slot* slot = get_slot();
+  if (slot == NULL) {
+    return;
+  }
+  slot_add(&slot->connections, (uint64_t)(int64_t)delta);
+  if (delta > 0) {
+    slot_add(&slot->accepted, 1);
+  }
+}
+
+void stats_compress(int decision) {
+  struct stats_slot* slot = get_slot();
+  if (slot == NULL) {
+    return;
+  }
+  slot_add(&slot->decisions[decision], 1);
+}
+
+void stats_request(int index,
+                   uint64_t bytes_in,
+                   int compd_in,
+                   uint64_t bytes_out,
+                   int compd_out,
+                   uint64_t plain_len,
+                   uint64_t latency_ns) {
+  struct stats_slot* slot = get_slot();
+  if (slot == NULL) {
+    return;
+  }
+
+  slot_add(&slot->requests[index], 1);
+  slot_add(&slot->bytes_in, bytes_in);
+  slot_add(&slot->bytes_out, bytes_out);
+  if (compd_in) {
+    slot_add(&slot->bytes_in_compressed, bytes_in);
+  }
+  if (compd_out) {
+    slot_add(&slot->bytes_out_compressed, bytes_out);
+  }
+  if (compd_out && plain_len > 0) {
+    slot_add(&slot->plain_bytes, plain_len);
+    slot_add(&slot->encoded_bytes, bytes_out - 9);
+  }
+
+  uint64_t us = latency_ns / 1000;
+  int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+  if (bucket >= STATS_HIST_BUCKETS) {
+    bucket = STATS_HIST_BUCKETS - 1;
+  }
+  slot_add(&slot->latency[index][bucket], 1);
+}
+
+void stats_snapshot(uint64_t* fields) {
+  struct stats_slot total_slot;
+  struct stats_slot* total = &total_slot;
+  uint64_t* sum = (uint64_t*)total;
+
+  pthread_mutex_lock(&slots_lock);
+  memcpy(sum, &retired, SLOT_COUNTERS * sizeof(uint64_t));
+  for (struct stats_slot* slot = slots; slot != NULL; slot = slot->next) {
+    uint64_t* counters = (uint64_t*)slot;
+    for (size_t i = 0; i < SLOT_COUNTERS; i++) {
+      sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&slots_lock);
+
+  memset(fields, 0, STATS_FIELDS * sizeof(uint64_t));
+  fields[STAT_VERSION] = STATS_VERSION;
+  fields[STAT_UPTIME_MS] = (stats_now_ns() - start_ns) / 1000000;
+  fields[STAT_CONNECTIONS] = total->connections;
+  fields[STAT_ACCEPTED] = total->accepted;
+  for (int i = 0; i < STATS_TYPES; i++) {
+    fields[STAT_REQUESTS + i] = total->requests[i];
+    memcpy(&fields[STAT_LATENCY + i * STATS_HIST_BUCKETS],
+           total->latency[i], sizeof(total->latency[i]));
+  }
+  fields[STAT_BYTES_IN] = total->bytes_in;
+  fields[STAT_BYTES_IN_COMPRESSED] = total->bytes_in_compressed;
+  fields[STAT_BYTES_OUT] = total->bytes_out;
+  fields[STAT_BYTES_OUT_COMPRESSED] = total->bytes_out_compressed;
+  fields[STAT_PLAIN_BYTES] = total->plain_bytes;
+  fields[STAT_ENCODED_BYTES] = total->encoded_bytes;
+  memcpy(&fields[STAT_COMPRESSED], total->decisions,
+         sizeof(total->decisions));
+  if (total->plain_bytes > 0) {
+    fields[STAT_RATIO_PPM] =
+        total->encoded_bytes * 1000000 / total->plain_bytes;
+  }
+}
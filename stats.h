@@ -0,0 +1,135 @@
+#ifndef STATS_H /* guard */
+#define STATS_H
+
+/*
+  Server statistics.
+  Every thread counts its requests in its own slot, aligned to a cache
+  line and only written by that thread, so counting takes no lock and
+  shares no line. A slot is created by the first count of a thread and
+  folded into the retired totals when the thread exits.
+  A snapshot adds up all slots.
+
+  The stats response payload is STATS_FIELDS big endian uint64,
+  in the order of enum stats_field.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define STATS_VERSION (3)       // layout of the snapshot
+#define STATS_TYPES (7)  // echo, listing, size, retrieve, stats, dict, other
+#define STATS_HIST_BUCKETS (32) // latency buckets, powers of 2 of us
+
+/* request type indexes of the counters */
+#define STATS_ECHO (0)
+#define STATS_LISTING (1)
+#define STATS_SIZE (2)
+#define STATS_RETRIEVE (3)
+#define STATS_STATS (4)
+#define STATS_DICT (5)
+#define STATS_OTHER (6)  // unknown types
+
+/* decisions on a response payload asked to be compressed */
+#define STATS_COMPRESSED (0)
+#define STATS_BYPASSED (1)  // sent raw, compression would not pay
+#define STATS_SHED (2)      // sent raw, the CPU load is too high
+#define STATS_DECISIONS (3)
+
+/*
+ * fields of a snapshot.
+ * latency bucket 0 counts responses under 1 us,
+ * bucket i counts [2^(i-1), 2^i) us and the last one everything above
+ */
+enum stats_field {
+  STAT_VERSION,
+  STAT_UPTIME_MS,
+  STAT_CONNECTIONS,  // open now
+  STAT_ACCEPTED,     // connections since start
+  STAT_SESSIONS,     // sessions stored
+  STAT_REQUESTS,     // STATS_TYPES counts, by type index
+  STAT_BYTES_IN = STAT_REQUESTS + STATS_TYPES,
+  STAT_BYTES_IN_COMPRESSED,   // of compressed requests
+  STAT_BYTES_OUT,             // responses, with file ranges
+  STAT_BYTES_OUT_COMPRESSED,  // of compressed responses
+  STAT_PLAIN_BYTES,           // payloads compressed by the server, before
+  STAT_ENCODED_BYTES,         // and after compression
+  STAT_RATIO_PPM,             // encoded / plain, in parts per million
+  STAT_POOL_HEAP_ALLOCS,
+  STAT_RANGE_HITS,
+  STAT_RANGE_MISSES,
+  STAT_RANGE_EVICTIONS,
+  STAT_DICT_ID,       // of the dictionary published now
+  STAT_DICT_RELOADS,
+  STAT_COMPRESSED,  // STATS_DECISIONS counts, by decision
+  STAT_CPU_LOAD = STAT_COMPRESSED + STATS_DECISIONS,  // percent used now
+  STAT_LATENCY,  // STATS_TYPES * STATS_HIST_BUCKETS counts
+  STATS_FIELDS = STAT_LATENCY + STATS_TYPES * STATS_HIST_BUCKETS
+};
+
+/*counters of one thread*/
+struct stats_slot {
+  uint64_t requests[STATS_TYPES];
+  uint64_t latency[STATS_TYPES][STATS_HIST_BUCKETS];
+  uint64_t bytes_in;
+  uint64_t bytes_in_compressed;
+  uint64_t bytes_out;
+  uint64_t bytes_out_compressed;
+  uint64_t plain_bytes;
+  uint64_t encoded_bytes;
+  uint64_t connections;  // opened minus closed, may wrap in a slot
+  uint64_t accepted;
+  uint64_t decisions[STATS_DECISIONS];
+
+  struct stats_slot* prev;
+  struct stats_slot* next;
+} __attribute__((aligned(64)));
+
+/*
+  initilize the statistics, before any thread counts
+*/
+void stats_init();
+
+/*
+  Given a request type, return its type index
+*/
+int stats_type_index(int type);
+
+/*
+  Count a connection opened (delta 1) or closed (delta -1)
+*/
+void stats_connection(int delta);
+
+/*
+  Count a decision on compressing a response, STATS_COMPRESSED,
+  STATS_BYPASSED or STATS_SHED
+*/
+void stats_compress(int decision);
+
+/*
+  Count one answered request of type index
+  bytes_in - request bytes received, compd_in 1 if it was compressed
+  bytes_out - response bytes sent, compd_out 1 if it was compressed
+  plain_len - payload length before the server compressed it, or 0
+  latency_ns - from the request received to the response sent
+*/
+void stats_request(int index,
+                   uint64_t bytes_in,
+                   int compd_in,
+                   uint64_t bytes_out,
+                   int compd_out,
+                   uint64_t plain_len,
+                   uint64_t latency_ns);
+
+/*
+  Add up all slots into fields, STATS_FIELDS values in host order.
+  fields owned by other modules are left 0
+*/
+void stats_snapshot(uint64_t* fields);
+
+/*
+  Return the time of a monotonic clock in ns
+*/
+uint64_t stats_now_ns();
+
+#endif //STATS_H
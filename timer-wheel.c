@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "timer-wheel.h"
+
+#define LEVEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/*
+  Link a timer into the slot of its expiry tick, at the lowest level
+  whose turn holds both now and the expiry tick.
+  a timer beyond the last level goes to the slot of the last level
+  reached last, and is placed again from there
+*/
+static void place(struct timer_wheel* wheel, struct timer* timer) {
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         (timer->expires ^ wheel->now) >> (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  int shift = TIMER_WHEEL_BITS * level;
+  uint64_t slot = (timer->expires >> shift) & LEVEL_MASK;
+  if ((timer->expires >> shift) - (wheel->now >> shift) >= TIMER_WHEEL_SLOTS) {
+    slot = ((wheel->now >> shift) - 1) & LEVEL_MASK;
+  }
+
+  struct timer* head = &wheel->slots[level][slot];
+  timer->next = head->next;
+  timer->prev = head;
+  head->next->prev = timer;
+  head->next = timer;
+}
+
+static void unlink_timer(struct timer* timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+/*
+  Place again every timer of a slot, relative to now
+*/
+static void cascade(struct timer_wheel* wheel, int level, uint64_t slot) {
+  struct timer* head = &wheel->slots[level][slot];
+  struct timer* timer = head->next;
+  head->next = head;
+  head->prev = head;
+  while (timer != head) {
+    struct timer* next = timer->next;
+    place(wheel, timer);
+    timer = next;
+  }
+}
+
+/*
+  Advance the wheel by one tick and run the timers due,
+  the wheel lock must be held
+*/
+static void tick(struct timer_wheel* wheel) {
+  __atomic_store_n(&wheel->now, wheel->now + 1, __ATOMIC_RELAXED);
+
+  // higher levels first, their timers may land in a lower level slot
+  // reached at this same tick
+  for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    uint64_t low = wheel->now & ((1ull << (TIMER_WHEEL_BITS * level)) - 1);
+    if (low == 0) {
+      cascade(wheel, level,
+              (wheel->now >> (TIMER_WHEEL_BITS * level)) & LEVEL_MASK);
+    }
+  }
+
+  struct timer* head = &wheel->slots[0][wheel->now & LEVEL_MASK];
+  while (head->next != head) {
+    struct timer* timer = head->next;
+    unlink_timer(timer);
+    timer->armed = 0;
+
+    uint64_t again = timer->fn(timer);
+    if (again > 0) {
+      timer->expires = wheel->now + again;
+      timer->armed = 1;
+      place(wheel, timer);
+    }
+  }
+}
+
+/*
+  return the time of a monotonic clock in milliseconds
+*/
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+  The thread of the wheel, tick once per TIMER_TICK_MS, catching up
+  on the ticks missed if it slept longer
+*/
+static void* wheel_thread(void* arg) {
+  struct timer_wheel* wheel = (struct timer_wheel*)arg;
+  uint64_t start = now_ms();
+
+  while (1) {
+    struct timespec ts = {0, TIMER_TICK_MS * 1000000L};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+
+    uint64_t due = (now_ms() - start) / TIMER_TICK_MS;
+    pthread_mutex_lock(&wheel->lock);
+    if (wheel->stop) {
+      pthread_mutex_unlock(&wheel->lock);
+      return NULL;
+    }
+    while (wheel->now < due) {
+      tick(wheel);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+  }
+}
+
+struct timer_wheel* timer_wheel_init() {
+  struct timer_wheel* wheel =
+      (struct timer_wheel*)calloc(1, sizeof(struct timer_wheel));
+  pthread_mutex_init(&wheel->lock, NULL);
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      struct timer* head = &wheel->slots[level][slot];
+      head->next = head;
+      head->prev = head;
+    }
+  }
+  pthread_create(&wheel->thread, NULL, wheel_thread, wheel);
+  return wheel;
+}
+
+void timer_init(struct timer* timer,
+                uint64_t (*fn)(struct timer* timer),
+                void* arg) {
+  memset(timer, 0, sizeof(struct timer));
+  timer->fn = fn;
+  timer->arg = arg;
+}
+
+void timer_wheel_arm(struct timer_wheel* wheel,
+                     struct timer* timer,
+                     uint64_t ticks) {
+  pthread_mutex_lock(&wheel->lock);
+  if (timer->armed) {
+    unlink_timer(timer);
+  }
+  timer->armed = 1;
+  timer->expires = wheel->now + (ticks > 0 ? ticks : 1);
+  place(wheel, timer);
+  pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_wheel_cancel(struct timer_wheel* wheel, struct timer* timer) {
+  pthread_mutex_lock(&wheel->lock);
+  if (timer->armed) {
+    unlink_timer(timer);
+    timer->armed = 0;
+  }
+  pthread_mutex_unlock(&wheel->lock);
+}
+
+uint64_t timer_wheel_now(struct timer_wheel* wheel) {
+  return __atomic_load_n(&wheel->now, __ATOMIC_RELAXED);
+}
+
+void timer_wheel_destory(struct timer_wheel* wheel) {
+  pthread_mutex_lock(&wheel->lock);
+  wheel->stop = 1;
+  pthread_mutex_unlock(&wheel->lock);
+  pthread_join(wheel->thread, NULL);
+  pthread_mutex_destroy(&wheel->lock);
+  free(wheel);
+}
@@ -0,0 +1,89 @@
+#ifndef TIMER_WHEEL_H /* guard */
+#define TIMER_WHEEL_H
+
+/*
+  Hierarchical timer wheel.
+  Time advances in ticks of TIMER_TICK_MS, counted by a thread of the
+  wheel. Level 0 has a slot per tick for the next TIMER_WHEEL_SLOTS
+  ticks, and every level above has a slot per whole turn of the level
+  below it. A timer sits in a doubly linked list of one slot, so arming
+  and cancelling it are O(1), and a timer of a higher level is moved
+  down a level when the wheel reaches its slot.
+
+  Callbacks run on the thread of the wheel with its lock held, so once
+  timer_wheel_cancel returns the callback is not running and never
+  will. A callback must be short, and must not arm or cancel timers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TIMER_TICK_MS (100)     // length of a tick
+#define TIMER_WHEEL_BITS (6)    // a level has 1 << TIMER_WHEEL_BITS slots
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS (4)  // timers up to 2^24 ticks, longer wait more
+
+/*
+  a timer, kept by its owner and linked into the wheel while armed.
+  fn returns the ticks after which it runs again, 0 to be done,
+  the wheel does not touch the timer once fn returns 0
+*/
+struct timer {
+  struct timer* next;
+  struct timer* prev;
+  uint64_t expires;  // tick it runs at
+  int armed;
+
+  uint64_t (*fn)(struct timer* timer);
+  void* arg;
+};
+
+/*the wheel, and its thread*/
+struct timer_wheel {
+  pthread_mutex_t lock;
+  uint64_t now;  // ticks since the wheel started
+  struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+
+  pthread_t thread;
+  int stop;
+};
+
+/*
+  initilize a wheel and start its thread
+*/
+struct timer_wheel* timer_wheel_init();
+
+/*
+  initilize a timer which is not armed
+*/
+void timer_init(struct timer* timer,
+                uint64_t (*fn)(struct timer* timer),
+                void* arg);
+
+/*
+  Arm a timer to run after ticks ticks, at least 1,
+  it is moved if it is already armed
+*/
+void timer_wheel_arm(struct timer_wheel* wheel,
+                     struct timer* timer,
+                     uint64_t ticks);
+
+/*
+  Disarm a timer, nothing happens if it is not armed
+*/
+void timer_wheel_cancel(struct timer_wheel* wheel, struct timer* timer);
+
+/*
+  return the ticks since the wheel started
+*/
+uint64_t timer_wheel_now(struct timer_wheel* wheel);
+
+/*
+  Stop the thread, the timers still armed never run,
+  and free all memory usage of the wheel
+*/
+void timer_wheel_destory(struct timer_wheel* wheel);
+
+#endif //TIMER_WHEEL_H
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define CQ_ENTRIES_PER_SQE (4)  // completions queued per submission entry
+
+/*
+  Set up the ring with flags, the setup flags the kernel does not know
+  make it fail with EINVAL
+*/
+static int setup(unsigned entries, struct io_uring_params* params,
+                 unsigned flags) {
+  memset(params, 0, sizeof(struct io_uring_params));
+  params->flags = flags;
+  params->cq_entries = entries * CQ_ENTRIES_PER_SQE;
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int enter(struct uring* ring, unsigned to_submit, unsigned wait_nr) {
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  return (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                      flags, NULL, 0);
+}
+
+int uring_init(struct uring* ring, unsigned entries) {
+  memset(ring, 0, sizeof(struct uring));
+
+  // only this thread submits, and completions are run when it enters
+  // the kernel anyway, so no interrupt is needed to run them
+  struct io_uring_params params;
+  ring->fd = setup(entries, &params,
+                   IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+                       IORING_SETUP_COOP_TASKRUN);
+  if (ring->fd < 0 && errno == EINVAL) {
+    ring->fd = setup(entries, &params, IORING_SETUP_CQSIZE);
+  }
+  if (ring->fd < 0) {
+    return -1;
+  }
+
+  ring->sq_map_len =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_map_len > ring->sq_map_len) {
+    ring->sq_map_len = ring->cq_map_len;
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  ring->cq_map = ring->sq_map;
+  if (!single) {
+    ring->cq_map =
+        mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      munmap(ring->sq_map, ring->sq_map_len);
+      close(ring->fd);
+      return -1;
+    }
+  }
+
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(
+      NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (!single) {
+      munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+    return -1;
+  }
+
+  uint8_t* sq = (uint8_t*)ring->sq_map;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+
+  uint8_t* cq = (uint8_t*)ring->cq_map;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // entry i of the queue always names sqe i
+  for (unsigned i = 0; i <= ring->sq_mask; i++) {
+    ring->sq_array[i] = i;
+  }
+  return 0;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  if (tail - head > ring->sq_mask) {
+    if (uring_submit(ring, 0) < 0) {
+      return NULL;
+    }
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    tail = *ring->sq_tail;
+    if (tail - head > ring->sq_mask) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_pending++;
+  return sqe;
+}
+
+int uring_submit(struct uring* ring, unsigned wait_nr) {
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  ring->sq_pending = 0;
+
+  // entries left by a submit that failed are submitted again
+  unsigned to_submit =
+      tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  while (1) {
+    int res = enter(ring, to_submit, wait_nr);
+    if (res >= 0) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EBUSY) {
+      // completions are backed up, reaping them lets it go on
+      return 0;
+    }
+    return -1;
+  }
+}
+
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring* ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_register_buffers(struct uring* ring, struct iovec* iovs,
+                           unsigned n) {
+  return (int)syscall(__NR_io_uring_register, ring->fd,
+                      IORING_REGISTER_BUFFERS, iovs, n) < 0
+             ? -1
+             : 0;
+}
+
+int uring_register_files(struct uring* ring, unsigned n) {
+  int* fds = (int*)malloc(n * sizeof(int));
+  for (unsigned i = 0; i < n; i++) {
+    fds[i] = -1;
+  }
+  int res = (int)syscall(__NR_io_uring_register, ring->fd,
+                         IORING_REGISTER_FILES, fds, n);
+  free(fds);
+  return res < 0 ? -1 : 0;
+}
+
+int uring_set_file(struct uring* ring, unsigned slot, int fd) {
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = slot;
+  update.fds = (uint64_t)(uintptr_t)&fd;
+  return (int)syscall(__NR_io_uring_register, ring->fd,
+                      IORING_REGISTER_FILES_UPDATE, &update, 1) < 0
+             ? -1
+             : 0;
+}
+
+void uring_destory(struct uring* ring) {
+  munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_len);
+  }
+  munmap(ring->sq_map, ring->sq_map_len);
+  close(ring->fd);
+}
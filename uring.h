@@ -0,0 +1,104 @@
+#ifndef URING_H /* guard */
+#define URING_H
+
+/*
+  io_uring ring.
+  A thin wrapper over the io_uring system calls, no liburing needed.
+  Operations are queued as submission entries and submitted in one
+  io_uring_enter together with the wait for completions, so a batch
+  of receives, file reads and sends costs a single system call.
+
+  Buffers and files may be registered with the ring, operations on
+  them skip the lookup and page pinning the kernel does per call.
+
+  A ring is used by one thread only.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*a ring and the shared memory of its queues*/
+struct uring {
+  int fd;
+
+  /* submission queue */
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned sq_pending;  // entries queued since the last submit
+
+  /* completion queue */
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* sq_map;
+  size_t sq_map_len;
+  void* cq_map;  // sq_map if the kernel maps both queues at once
+  size_t cq_map_len;
+  size_t sqes_len;
+};
+
+/*
+  initilize a ring of entries submission entries
+  return 0 on success, -1 if io_uring is not available
+*/
+int uring_init(struct uring* ring, unsigned entries);
+
+/*
+  Get a cleared submission entry to fill,
+  the queue is submitted first if it is full
+  return NULL only if the queue can not be submitted
+*/
+struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+
+/*
+  Submit the queued entries, and wait until at least wait_nr
+  completions are available
+  return 0 on success, -1 on error
+*/
+int uring_submit(struct uring* ring, unsigned wait_nr);
+
+/*
+  Return the next completion, or NULL if none is available,
+  mark it seen with uring_cqe_seen once handled
+*/
+struct io_uring_cqe* uring_peek_cqe(struct uring* ring);
+
+/*
+  Give the completion slot back to the kernel
+*/
+void uring_cqe_seen(struct uring* ring);
+
+/*
+  Register n buffers, used by IORING_OP_READ_FIXED with their index
+  return 0 on success, -1 on error
+*/
+int uring_register_buffers(struct uring* ring, struct iovec* iovs,
+                           unsigned n);
+
+/*
+  Register a table of n files, all empty,
+  a slot is used with IOSQE_FIXED_FILE once set by uring_set_file
+  return 0 on success, -1 on error
+*/
+int uring_register_files(struct uring* ring, unsigned n);
+
+/*
+  Set the file in a slot of the file table, fd -1 empties it
+  return 0 on success, -1 on error
+*/
+int uring_set_file(struct uring* ring, unsigned slot, int fd);
+
+/*
+  Unmap and close the ring
+*/
+void uring_destory(struct uring* ring);
+
+#endif //URING_H
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "work-pool.h"
+
+/*argument of a worker thread*/
+struct worker_arg {
+  struct work_pool* pool;
+  int index;
+};
+
+static void deque_push(struct work_deque* deque, void* task) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail - deque->head == deque->cap) {
+    // grow, the tasks keep their positions modulo the new capacity
+    void** tasks = (void**)malloc(2 * deque->cap * sizeof(void*));
+    for (uint64_t i = deque->head; i < deque->tail; i++) {
+      tasks[i & (2 * deque->cap - 1)] = deque->tasks[i & (deque->cap - 1)];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->cap *= 2;
+  }
+  deque->tasks[deque->tail & (deque->cap - 1)] = task;
+  deque->tail++;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+  Take a task from the back of a deque if owner, from the front if not
+  return NULL if it is empty
+*/
+static void* deque_take(struct work_deque* deque, int owner) {
+  void* task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head != deque->tail) {
+    if (owner) {
+      deque->tail--;
+      task = deque->tasks[deque->tail & (deque->cap - 1)];
+    } else {
+      task = deque->tasks[deque->head & (deque->cap - 1)];
+      deque->head++;
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/*
+  Take the next task of a worker, its own or stolen,
+  sleep while the pool has none
+  return NULL once the pool is stopped
+*/
+static void* next_task(struct work_pool* pool, int index) {
+  while (1) {
+    void* task = deque_take(&pool->deques[index], 1);
+    for (int i = 1; task == NULL && i < pool->workers; i++) {
+      task = deque_take(&pool->deques[(index + i) % pool->workers], 0);
+    }
+    if (task != NULL) {
+      __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+      return task;
+    }
+
+    // idle is counted before pending is checked, and submit counts
+    // pending before it checks idle, so one of them sees the other
+    pthread_mutex_lock(&pool->sleep_lock);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+      if (pool->stop) {
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->sleep_lock);
+        return NULL;
+      }
+      pthread_cond_wait(&pool->wake, &pool->sleep_lock);
+    }
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+}
+
+static void* worker_thread(void* arg) {
+  struct worker_arg* worker = (struct worker_arg*)arg;
+  struct work_pool* pool = worker->pool;
+  int index = worker->index;
+  free(worker);
+
+  void* task;
+  while ((task = next_task(pool, index)) != NULL) {
+    pool->run(task, index);
+  }
+  return NULL;
+}
+
+struct work_pool* work_pool_init(int workers,
+                                 void (*run)(void* task, int worker)) {
+  struct work_pool* pool =
+      (struct work_pool*)calloc(1, sizeof(struct work_pool));
+  pool->workers = workers;
+  pool->run = run;
+  pthread_mutex_init(&pool->sleep_lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  if (posix_memalign((void**)&pool->deques, 64,
+                     workers * sizeof(struct work_deque)) != 0) {
+    free(pool);
+    return NULL;
+  }
+  memset(pool->deques, 0, workers * sizeof(struct work_deque));
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pool->deques[i].cap = WORK_DEQUE_INIT;
+    pool->deques[i].tasks = (void**)malloc(WORK_DEQUE_INIT * sizeof(void*));
+  }
+
+  pool->threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+  for (int i = 0; i < workers; i++) {
+    struct worker_arg* arg =
+        (struct worker_arg*)malloc(sizeof(struct worker_arg));
+    arg->pool = pool;
+    arg->index = i;
+    pthread_create(&pool->threads[i], NULL, worker_thread, arg);
+  }
+  return pool;
+}
+
+void work_pool_submit(struct work_pool* pool, void* task, int worker) {
+  if (worker < 0 || worker >= pool->workers) {
+    worker = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) %
+             pool->workers;
+  }
+  // counted first, a worker that takes it early never sees pending 0
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  deque_push(&pool->deques[worker], task);
+
+  if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->sleep_lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->sleep_lock);
+  }
+}
+
+void work_pool_destory(struct work_pool* pool) {
+  pthread_mutex_lock(&pool->sleep_lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->sleep_lock);
+  for (int i = 0; i < pool->workers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  for (int i = 0; i < pool->workers; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  free(pool->deques);
+  free(pool->threads);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->sleep_lock);
+  free(pool);
+}
@@ -0,0 +1,69 @@
+#ifndef WORK_POOL_H /* guard */
+#define WORK_POOL_H
+
+/*
+  Work stealing thread pool.
+  A fixed number of workers run tasks submitted to the pool.
+  Every worker has its own deque: a task is pushed to the back of the
+  deque of the worker it is submitted to, and the owner pops from the
+  back, the most recent task, whose data is likely still in its cache.
+  A worker with an empty deque steals from the front of the others,
+  the oldest task, so work spreads over all workers instead of piling
+  up on one. Workers with nothing to run or steal sleep until the next
+  submit.
+
+  Each deque has its own lock, only taken by its owner, the submitters
+  to it and thieves.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define WORK_DEQUE_INIT (64)  // initial tasks of a deque, power of 2
+
+/*tasks of one worker, a ring grown when full*/
+struct work_deque {
+  pthread_mutex_t lock;
+  void** tasks;
+  uint64_t cap;   // power of 2
+  uint64_t head;  // first task, stolen next
+  uint64_t tail;  // after the last task, popped next
+} __attribute__((aligned(64)));
+
+/*the pool*/
+struct work_pool {
+  int workers;
+  struct work_deque* deques;
+  pthread_t* threads;
+  void (*run)(void* task, int worker);
+
+  uint64_t pending;  // tasks submitted and not taken
+  uint64_t next;     // worker of the next submit without a worker
+  pthread_mutex_t sleep_lock;
+  pthread_cond_t wake;
+  int idle;  // workers sleeping or about to
+  int stop;
+};
+
+/*
+  initilize a pool of workers threads, started at once
+  run - called by a worker for every task, with its worker index
+*/
+struct work_pool* work_pool_init(int workers,
+                                 void (*run)(void* task, int worker));
+
+/*
+  Submit a task to the deque of worker, or of the next worker in turn
+  if worker is -1
+*/
+void work_pool_submit(struct work_pool* pool, void* task, int worker);
+
+/*
+  Stop the workers once the tasks submitted are run,
+  and free all memory usage of the pool
+*/
+void work_pool_destory(struct work_pool* pool);
+
+#endif //WORK_POOL_H